@@ -35,7 +35,7 @@ static int logfile_buffered_writes = 0;
 static int *bandwidth_limits_unique;
 static int class_count; // = number of elements in bandwidth_limits_unique[]
 
-static inline void system_or_fatal(const char *command)
+void system_or_fatal(const char *command)
 {
 	int ret;
 	fprintf(stderr, "$ %s\n", command);
@@ -170,7 +170,11 @@ static inline void SetupTrafficControl()
 
 __attribute__((cold)) void InitializeActions()
 {
-	SetupTrafficControl();
+	/* Recorded traffic must not affect the live system */
+	if(ltReplayFile)
+		fprintf(stderr, "--replay: traffic control is not touched\n");
+	else
+		SetupTrafficControl();
 
 	logfile = fopen(ltLogFile, "a+b");
 	if(!logfile)
@@ -194,19 +198,29 @@ void FlushLog()
 	}
 }
 
-void TakeAction(const char *ip, const struct AnalyzePlanAction *action, long bandwidth_used, int used_interval)
+void LogLoss(uint64_t lost, int interval)
 {
-	fprintf(stderr, "TakeAction(%s) called: action=%i\n", ip, action->type);
+	logfile_buffered_writes ++;
+	fprintf(logfile, "[%li] LOSSY: %lu packets LOST IN %i\n", TIME, (unsigned long) lost, interval);
+}
+
+void TakeAction(const struct IpAddr *ip, int prefix, const struct AnalyzePlanAction *action, long bandwidth_used, int used_interval)
+{
+	char ip_text[IPADDR_SUBNET_STRLEN];
+
+	IpAddrSubnetToString(ip, prefix, ip_text);
+	fprintf(stderr, "TakeAction(%s) called: action=%i\n", ip_text, action->type);
 	
-	if(is_legitimate_search_engine(ip))
+	/* A subnet can't be verified by DNS: only single clients are recognized as search engines */
+	if(!prefix && is_legitimate_search_engine(ip))
 	{
-		fprintf(stderr, "TakeAction: ignoring %s, it's a search engine.\n", ip);
+		fprintf(stderr, "TakeAction: ignoring %s, it's a search engine.\n", ip_text);
 		return;
 	}
 	
 	logfile_buffered_writes ++;
 	fprintf(logfile, "[%li] %s USED %li IN %i (> %li, %.2f times) %s(%i)\n",
-		TIME, ip, bandwidth_used, used_interval, action->level, (float) bandwidth_used / action->level,
+		TIME, ip_text, bandwidth_used, used_interval, action->level, (float) bandwidth_used / action->level,
 		action_text[action->type], action->bandwidth_limit
 	);
 
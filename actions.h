@@ -17,6 +17,7 @@
 #define _LIMITTRAF_ACTIONS_H
 
 #include "conf.h"
+#include "ipaddr.h"
 
 /* should be called from Initialize()/Terminate().
 	NOTE: InitializeActions() MUST be called after ReadConfiguration().
@@ -25,16 +26,27 @@ void InitializeActions();
 void TerminateActions();
 
 /*
-	Apply action to the specified IP.
+	Apply action to the specified IP or, if 'prefix' is not 0, to its subnet
+	(see IpAddrSubnet(): 'ip' is the address of the subnet then).
 	
 	NOTE: bandwidth_used and used_interval are only needed for logging,
 	they are irrelevant to the restricting action inself.
 */
-void TakeAction(const char *ip, const struct AnalyzePlanAction *action,
+void TakeAction(const struct IpAddr *ip, int prefix, const struct AnalyzePlanAction *action,
 	long bandwidth_used, int used_interval);
 
+/*
+	Mark the analysis of 'interval' seconds as incomplete in the log:
+	'lost' packets were lost by the capture, so the missing actions may be
+	caused by that and not by the limits.
+*/
+void LogLoss(uint64_t lost, int interval);
+
 /* FlushLog() - should be called after a group of TakeAction() calls */
 void FlushLog();
 
+/* Run the shell command, exit(1) if it fails (used for 'tc') */
+void system_or_fatal(const char *command);
+
 #endif
 
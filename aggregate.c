@@ -0,0 +1,113 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "aggregate.h"
+
+static const unsigned int AGGREGATE_INITIAL_BITS = 12; /* 4096 clients */
+
+static void AggregateAllocate(struct Aggregate *agg, unsigned int bits)
+{
+	size_t capacity = (size_t) 1 << bits;
+
+	agg->bits = bits;
+	agg->used = 0;
+	agg->ip = calloc(capacity, sizeof(struct IpAddr));
+	agg->bytes = calloc(capacity * AGGREGATE_SLOTS, sizeof(uint64_t));
+
+	if(!agg->ip || !agg->bytes)
+	{
+		fprintf(stderr, "calloc() for aggregate table (%zu clients) failed: %s\n", capacity, strerror(errno));
+		exit(1);
+	}
+}
+
+static void AggregateFree(struct Aggregate *agg)
+{
+	free(agg->ip);
+	free(agg->bytes);
+	agg->ip = NULL;
+	agg->bytes = NULL;
+}
+
+__attribute__((cold)) void InitializeAggregate(struct Aggregate *agg)
+{
+	memset(agg->slot_time, 0, sizeof(agg->slot_time));
+	AggregateAllocate(agg, AGGREGATE_INITIAL_BITS);
+}
+
+__attribute__((cold)) void TerminateAggregate(struct Aggregate *agg)
+{
+	AggregateFree(agg);
+}
+
+void AggregateGrow(struct Aggregate *agg)
+{
+	struct Aggregate old = *agg;
+	size_t i, capacity = (size_t) 1 << old.bits;
+	unsigned int mask, j;
+
+	AggregateAllocate(agg, old.bits + 1);
+	mask = (1U << agg->bits) - 1;
+
+	for(i = 0; i < capacity; i ++)
+	{
+		if(IpAddrIsEmpty(&old.ip[i])) continue;
+
+		j = IpAddrHash(&old.ip[i]) >> (32 - agg->bits);
+		while(!IpAddrIsEmpty(&agg->ip[j]))
+			j = (j + 1) & mask;
+
+		agg->ip[j] = old.ip[i];
+		memcpy(&agg->bytes[(size_t) j * AGGREGATE_SLOTS], &old.bytes[i * AGGREGATE_SLOTS], AGGREGATE_SLOTS * sizeof(uint64_t));
+		agg->used ++;
+	}
+
+	AggregateFree(&old);
+}
+
+void AggregateFlush(struct Aggregate *agg, void (*callback)(time_t bucket, const struct IpAddr *ip, uint64_t bytes))
+{
+	size_t i, capacity = (size_t) 1 << agg->bits;
+	unsigned int slot;
+	uint64_t *bytes;
+
+	for(i = 0; i < capacity; i ++)
+	{
+		if(IpAddrIsEmpty(&agg->ip[i])) continue;
+
+		bytes = &agg->bytes[i * AGGREGATE_SLOTS];
+		for(slot = 0; slot < AGGREGATE_SLOTS; slot ++)
+		{
+			if(bytes[slot])
+				callback(agg->slot_time[slot], &agg->ip[i], bytes[slot]);
+		}
+
+		memset(&agg->ip[i], 0, sizeof(struct IpAddr));
+		memset(bytes, 0, AGGREGATE_SLOTS * sizeof(uint64_t));
+	}
+
+	agg->used = 0;
+	memset(agg->slot_time, 0, sizeof(agg->slot_time));
+}
+
+size_t AggregateMemoryUsed(const struct Aggregate *agg)
+{
+	return (size_t) agg->used * (sizeof(struct IpAddr) + AGGREGATE_SLOTS * sizeof(uint64_t));
+}
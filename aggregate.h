@@ -0,0 +1,101 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_AGGREGATE_H
+#define _LIMITTRAF_AGGREGATE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "ipaddr.h"
+
+/*
+	Aggregate: per-IP byte sums of the traffic since the last CompactDb(),
+	in time buckets of AGGREGATE_BUCKET seconds (the same as the records of the archive).
+	Register() is only a hash probe and an addition: SQLite receives the sums.
+
+	The buckets of one client are AGGREGATE_SLOTS consecutive numbers,
+	so that all buckets touched between two CompactDb() calls share a cache line.
+*/
+#define AGGREGATE_BUCKET 10 /* seconds */
+#define AGGREGATE_SLOTS 8 /* buckets held at once: 80 seconds (CompactDb() runs much more often) */
+
+struct Aggregate
+{
+	struct IpAddr *ip; /* open addressing with linear probing; :: = empty slot */
+	uint64_t *bytes; /* bytes[i * AGGREGATE_SLOTS + slot] */
+	unsigned int bits; /* capacity = 1 << bits */
+	unsigned int used;
+	time_t slot_time[AGGREGATE_SLOTS]; /* bucket (its p_time) held in each slot, 0 = none */
+};
+
+void InitializeAggregate(struct Aggregate *agg);
+void TerminateAggregate(struct Aggregate *agg);
+
+/* Resize the table when it becomes too full (called by AggregateAdd()) */
+void AggregateGrow(struct Aggregate *agg);
+
+/* p_time of the bucket: same as ROUND(time * 0.1) * 10 in the older versions */
+static inline time_t AggregateBucket(time_t time)
+{
+	return (time + AGGREGATE_BUCKET / 2) / AGGREGATE_BUCKET * AGGREGATE_BUCKET;
+}
+
+static inline unsigned int AggregateSlot(time_t bucket)
+{
+	return (bucket / AGGREGATE_BUCKET) % AGGREGATE_SLOTS;
+}
+
+/*
+	Add 'length' bytes to the bucket in 'slot' (the caller makes sure
+	that slot_time[slot] is the right bucket, see Register()).
+*/
+__attribute__((hot)) static inline void AggregateAdd(struct Aggregate *agg, const struct IpAddr *ip, unsigned int slot, uint64_t length)
+{
+	unsigned int mask = (1U << agg->bits) - 1;
+	unsigned int i = IpAddrHash(ip) >> (32 - agg->bits);
+
+	while(!IpAddrEqual(&agg->ip[i], ip))
+	{
+		if(IpAddrIsEmpty(&agg->ip[i]))
+		{
+			if(agg->used * 4 >= mask * 3) /* 75% full */
+			{
+				AggregateGrow(agg);
+				AggregateAdd(agg, ip, slot, length);
+				return;
+			}
+
+			agg->ip[i] = *ip;
+			agg->used ++;
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+
+	agg->bytes[(size_t) i * AGGREGATE_SLOTS + slot] += length;
+}
+
+/*
+	Call 'callback' for every non-zero sum, then empty the table
+	(its capacity is kept: the same clients are likely to return).
+*/
+void AggregateFlush(struct Aggregate *agg, void (*callback)(time_t bucket, const struct IpAddr *ip, uint64_t bytes));
+
+/* Memory used by the clients in the table, in bytes (the free slots are not counted) */
+size_t AggregateMemoryUsed(const struct Aggregate *agg);
+
+#endif
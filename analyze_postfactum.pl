@@ -14,16 +14,17 @@
 # GNU General Public License for more details.
 ###############################################################################
 #
-# Scan $dbfile and print statistical distribution of a number of clients by the level of traffic they exceed in $limit_interval.
+# Scan $archive and print statistical distribution of a number of clients by the level of traffic they exceed in $limit_interval.
 #
 
 #
-# NOTE: 
-#	CREATE INDEX packet_time ON packet (p_time);
-# makes everything much faster.
+# NOTE: the traffic is read from the archive of limittraf (one file per hour, see archive.h)
+# by the 'ltarchive' tool, which only reads the blocks overlapping the analyzed interval.
+# (a database of older versions is moved into the archive when limittraf starts)
 #
 
-our $dbfile = 'limittraf.sample.db';
+our $archive = 'archive';
+our $ltarchive = './ltarchive';
 our $limit_interval = 15*60; # 15 minutes
 our $analyze_interval = 15; # the increase of $TIME between 2 calculations (in seconds).
 our $deltaM = 10240; # 10 kilobytes, the step between keys in distribution function $N{$M} (which is calculated by this script).
@@ -31,13 +32,15 @@ our $deltaM = 10240; # 10 kilobytes, the step between keys in distribution funct
 use strict;
 use Data::Dumper;
 
-use DBI;
-my $dbh = DBI->connect("dbi:SQLite:dbname=$dbfile", undef, undef, { RaiseError => 1 });
-
-my $sth = $dbh->prepare('SELECT MIN(p_time), MAX(p_time) FROM packet');
-$sth->execute();
-our($TIME_START, $TIME_END) = $sth->fetchrow_array;
-$sth->finish();
+our($TIME_START, $TIME_END);
+open(my $stat, '-|', $ltarchive, $archive, 'stat') or die "Can't run $ltarchive: $!\n";
+while(<$stat>)
+{
+	$TIME_START = $1 if /^from: (\d+)/;
+	$TIME_END = $1 if /^to: (\d+)/;
+}
+close($stat);
+die "No records in $archive\n" unless defined $TIME_START;
 
 #
 # Make sure that there're no "incomplete $analyze_interval invervals".
@@ -47,12 +50,6 @@ my $skip_last = $seconds % $analyze_interval;
 $TIME_END -= $skip_last;
 $seconds -= $skip_last;
 
-#
-# Prepare the scanning SQL.
-#
-my $sth = $dbh->prepare('SELECT p_ip, SUM(p_len) FROM packet WHERE p_time > ? AND p_time < ? GROUP BY p_ip ORDER BY SUM(p_len) DESC');
-$sth->execute();
-
 #
 # Begin the scan.
 #
@@ -72,9 +69,10 @@ for(my $TIME = $TIME_START; $TIME < $TIME_END; $TIME += $analyze_interval, $step
 {
 	print STDERR sprintf('%-5i/%5i', $step, $STEPS) . "\n";
 
-	$sth->execute($TIME, $TIME + $limit_interval);
-	while(my($ip, $len) = $sth->fetchrow_array)
+	open(my $sum, '-|', $ltarchive, $archive, 'sum', $TIME, $TIME + $limit_interval) or die "Can't run $ltarchive: $!\n";
+	while(<$sum>)
 	{
+		my($ip, $len) = split;
 		my $M = $len - $len % $deltaM; # scale down
 		
 		if(exists $SPIKE{$ip}) # This IP has already exceeded the limit
@@ -92,6 +90,7 @@ for(my $TIME = $TIME_START; $TIME < $TIME_END; $TIME += $analyze_interval, $step
 			$N{$M} ++;
 		}
 	}
+	close($sum);
 }
 
 foreach my $M(sort { $a - $b } keys %N)
@@ -0,0 +1,743 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stddef.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "archive.h"
+#include "writer.h"
+
+static char *archive_dir = NULL;
+static struct ArchiveRecord *pending = NULL;
+static unsigned int pending_count = 0, pending_size = 0;
+static int64_t pending_min, pending_max; /* time range of pending[] */
+
+/*
+	Varints (LEB128): 7 bits per byte, the high bit is set in all bytes except the last.
+	Times and 10-second sums mostly take 1-3 bytes.
+*/
+static inline uint8_t *PutVarint(uint8_t *p, uint64_t value)
+{
+	while(value >= 0x80)
+	{
+		*p ++ = (value & 0x7f) | 0x80;
+		value >>= 7;
+	}
+	*p ++ = value;
+	return p;
+}
+
+/* Returns NULL if the varint doesn't end before 'end' */
+static inline const uint8_t *GetVarint(const uint8_t *p, const uint8_t *end, uint64_t *value)
+{
+	unsigned int shift = 0;
+
+	*value = 0;
+	while(p < end && shift < 64)
+	{
+		*value |= (uint64_t) (*p & 0x7f) << shift;
+		if(!(*p ++ & 0x80))
+			return p;
+		shift += 7;
+	}
+	return NULL;
+}
+
+/*
+	Bloom filter of the block: 3 bits per address, about 10 bits per address in total
+	(a false positive in ~2% of the blocks which don't have it).
+*/
+static inline void FilterPositions(const struct IpAddr *ip, unsigned int words, uint32_t pos[3])
+{
+	uint32_t h = IpAddrHash(ip), g;
+	unsigned int shift = 32 - 6 - __builtin_ctz(words); /* 32 - log2(words * 64) */
+
+	g = (h ^ (h >> 15)) * 2246822519U;
+	g ^= g >> 13;
+	pos[0] = h >> shift;
+	pos[1] = g >> shift;
+	pos[2] = (g * 3266489917U) >> shift;
+}
+
+static inline void FilterAdd(uint64_t *filter, unsigned int words, const struct IpAddr *ip)
+{
+	uint32_t pos[3];
+	unsigned int i;
+
+	FilterPositions(ip, words, pos);
+	for(i = 0; i < 3; i ++)
+		filter[pos[i] / 64] |= (uint64_t) 1 << (pos[i] % 64);
+}
+
+static inline int FilterMayContain(const uint64_t *filter, unsigned int words, const struct IpAddr *ip)
+{
+	uint32_t pos[3];
+	unsigned int i;
+
+	FilterPositions(ip, words, pos);
+	for(i = 0; i < 3; i ++)
+		if(!(filter[pos[i] / 64] & ((uint64_t) 1 << (pos[i] % 64))))
+			return 0;
+	return 1;
+}
+
+static void PartitionPath(char *path, size_t size, const char *dir, int64_t hour)
+{
+	snprintf(path, size, "%s/%lld.lta", dir, (long long) hour);
+}
+
+static int compare_hours(const void *a, const void *b)
+{
+	int64_t x = *(const int64_t *) a, y = *(const int64_t *) b;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/*
+	Hours which have a file in 'dir', ascending.
+	Returns their number (0 if 'dir' doesn't exist), '*hours' must be freed.
+*/
+static unsigned int ListPartitions(const char *dir, int64_t **hours)
+{
+	DIR *d = opendir(dir);
+	struct dirent *e;
+	unsigned int count = 0, size = 0;
+	char *end;
+	long long hour;
+
+	*hours = NULL;
+	if(!d)
+		return 0;
+
+	while((e = readdir(d)))
+	{
+		hour = strtoll(e->d_name, &end, 10);
+		if(end == e->d_name || strcmp(end, ".lta"))
+			continue;
+
+		if(count == size)
+		{
+			size = size ? size * 2 : 64;
+			*hours = realloc(*hours, size * sizeof(int64_t));
+			if(!*hours)
+			{
+				fprintf(stderr, "realloc() for the list of archive files failed: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+		(*hours)[count ++] = hour;
+	}
+	closedir(d);
+
+	qsort(*hours, count, sizeof(int64_t), compare_hours);
+	return count;
+}
+
+/* Header of the block at 'offset' of a file of 'size' bytes, or NULL if the block is damaged or incomplete */
+static inline const struct ArchiveBlockHeader *BlockAt(const uint8_t *map, uint64_t size, uint64_t offset)
+{
+	const struct ArchiveBlockHeader *h = (const struct ArchiveBlockHeader *) (map + offset);
+
+	if(size - offset < sizeof(*h) || h->magic != ARCHIVE_MAGIC || h->size < sizeof(*h) || h->size > size - offset)
+		return NULL;
+	if(!h->filter_words || (h->filter_words & (h->filter_words - 1))
+		|| sizeof(*h) + (uint64_t) h->filter_words * 8 + h->dict_bytes + h->times_bytes + h->indices_bytes > h->size)
+		return NULL;
+	return h;
+}
+
+/* Map the whole file (read-only); returns NULL if it's empty or can't be opened */
+static const uint8_t *MapFile(const char *path, uint64_t *size)
+{
+	struct stat st;
+	void *map;
+	int fd = open(path, O_RDONLY);
+
+	if(fd < 0)
+		return NULL;
+	if(fstat(fd, &st) < 0 || st.st_size == 0)
+	{
+		close(fd);
+		return NULL;
+	}
+
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap(%s) failed: %s\n", path, strerror(errno));
+		return NULL;
+	}
+	madvise(map, st.st_size, MADV_SEQUENTIAL);
+
+	*size = st.st_size;
+	return map;
+}
+
+/* Cut off the incomplete block at the end of the file (if any) */
+__attribute__((cold)) static void RepairFile(const char *path)
+{
+	uint64_t size = 0, offset = 0;
+	const uint8_t *map = MapFile(path, &size);
+	const struct ArchiveBlockHeader *h;
+
+	if(!map)
+		return;
+
+	while(offset < size && (h = BlockAt(map, size, offset)))
+		offset += h->size;
+	munmap((void *) map, size);
+
+	if(offset < size)
+	{
+		fprintf(stderr, "%s: the last %llu bytes are not a complete block (interrupted write?), removing them\n", path, (unsigned long long) (size - offset));
+		if(truncate(path, offset) < 0)
+		{
+			fprintf(stderr, "truncate(%s) failed: %s\n", path, strerror(errno));
+			exit(1);
+		}
+	}
+}
+
+__attribute__((cold)) void InitializeArchive(const char *dir)
+{
+	int64_t *hours;
+	unsigned int count, i;
+	char path[4096];
+
+	if(mkdir(dir, 0700) < 0 && errno != EEXIST)
+	{
+		fprintf(stderr, "mkdir(%s) failed: %s\n", dir, strerror(errno));
+		exit(1);
+	}
+	archive_dir = strdup(dir);
+
+	count = ListPartitions(dir, &hours);
+	for(i = 0; i < count; i ++)
+	{
+		PartitionPath(path, sizeof(path), dir, hours[i]);
+		RepairFile(path);
+	}
+	free(hours);
+}
+
+__attribute__((cold)) void TerminateArchive()
+{
+	ArchiveFlush(1);
+
+	free(pending);
+	pending = NULL;
+	pending_count = pending_size = 0;
+	free(archive_dir);
+	archive_dir = NULL;
+}
+
+void ArchiveAppend(time_t time, const struct IpAddr *ip, uint64_t bytes)
+{
+	struct ArchiveRecord *r;
+
+	if(pending_count == pending_size)
+	{
+		pending_size = pending_size ? pending_size * 2 : 4096;
+		pending = realloc(pending, pending_size * sizeof(struct ArchiveRecord));
+		if(!pending)
+		{
+			fprintf(stderr, "realloc() for the archive buffer (%u records) failed: %s\n", pending_size, strerror(errno));
+			exit(1);
+		}
+	}
+
+	if(!pending_count || time < pending_min)
+		pending_min = time;
+	if(!pending_count || time > pending_max)
+		pending_max = time;
+
+	r = &pending[pending_count ++];
+	r->time = time;
+	r->ip = *ip;
+	r->bytes = bytes;
+}
+
+static int compare_records_by_time(const void *a, const void *b)
+{
+	int64_t x = ((const struct ArchiveRecord *) a)->time, y = ((const struct ArchiveRecord *) b)->time;
+	return x < y ? -1 : (x > y ? 1 : 0);
+}
+
+/* Order of the dictionary: IPv4 addresses (ascending), then IPv6 ones */
+static int compare_addresses(const void *a, const void *b)
+{
+	const struct IpAddr *x = a, *y = b;
+	int v4 = IpAddrIsIpv4(x);
+
+	if(v4 != IpAddrIsIpv4(y))
+		return v4 ? -1 : 1;
+	return memcmp(x->addr, y->addr, 16);
+}
+
+/* Record of the block being written: the address is replaced by its index in the dictionary */
+struct BlockRecord
+{
+	int64_t time;
+	uint32_t index;
+	uint64_t bytes;
+};
+
+static int compare_block_records(const void *a, const void *b)
+{
+	const struct BlockRecord *x = a, *y = b;
+
+	if(x->time != y->time)
+		return x->time < y->time ? -1 : 1;
+	return x->index < y->index ? -1 : (x->index > y->index ? 1 : 0);
+}
+
+/* Append 'count' records of one hour to its file as one block */
+static void WriteBlock(const struct ArchiveRecord *records, unsigned int count)
+{
+	/* Addresses of the block: open addressing, 'index' is the position in the dictionary */
+	struct DictSlot
+	{
+		struct IpAddr ip;
+		uint32_t index;
+	} *slots;
+	struct IpAddr *dict;
+	struct BlockRecord *sorted;
+	unsigned int *slot_of; /* slot of each record */
+	unsigned int bits = 1, mask, i, j, s, dict_count = 0, ipv4_count, words = 4;
+	struct ArchiveBlockHeader *h;
+	uint8_t *block, *scratch, *p, *times, *indices, *lengths;
+	uint32_t prev_ip, prev_index;
+	int64_t prev_time;
+	char path[4096];
+	ssize_t written;
+	off_t old_size;
+	int fd;
+
+	while((1U << bits) < count * 2)
+		bits ++;
+	mask = (1U << bits) - 1;
+
+	slots = calloc(mask + 1, sizeof(struct DictSlot));
+	slot_of = malloc(count * sizeof(unsigned int));
+	dict = malloc(count * sizeof(struct IpAddr));
+	sorted = malloc(count * sizeof(struct BlockRecord));
+	scratch = malloc((size_t) count * (20 + 5 + 10)); /* worst case of the 3 columns */
+	if(!slots || !slot_of || !dict || !sorted || !scratch)
+	{
+		fprintf(stderr, "malloc() for an archive block (%u records) failed: %s\n", count, strerror(errno));
+		exit(1);
+	}
+
+	for(i = 0; i < count; i ++)
+	{
+		s = IpAddrHash(&records[i].ip) >> (32 - bits);
+		while(!IpAddrEqual(&slots[s].ip, &records[i].ip))
+		{
+			if(IpAddrIsEmpty(&slots[s].ip))
+			{
+				slots[s].ip = records[i].ip;
+				dict[dict_count ++] = records[i].ip;
+				break;
+			}
+			s = (s + 1) & mask;
+		}
+		slot_of[i] = s;
+	}
+
+	/* Sorted dictionary: IPv4 addresses are stored as deltas */
+	qsort(dict, dict_count, sizeof(struct IpAddr), compare_addresses);
+	for(ipv4_count = 0; ipv4_count < dict_count && IpAddrIsIpv4(&dict[ipv4_count]); ipv4_count ++);
+	for(i = 0; i < dict_count; i ++)
+	{
+		s = IpAddrHash(&dict[i]) >> (32 - bits);
+		while(!IpAddrEqual(&slots[s].ip, &dict[i]))
+			s = (s + 1) & mask;
+		slots[s].index = i;
+	}
+
+	/* Within the same time, the records are ordered by index, so that the indices are deltas too */
+	for(i = 0; i < count; i ++)
+	{
+		sorted[i].time = records[i].time;
+		sorted[i].index = slots[slot_of[i]].index;
+		sorted[i].bytes = records[i].bytes;
+	}
+	qsort(sorted, count, sizeof(struct BlockRecord), compare_block_records);
+
+	/* Columns: (time delta, number of records) of each time, index deltas, lengths */
+	times = scratch;
+	indices = scratch + (size_t) count * 20;
+	lengths = indices + (size_t) count * 5;
+	prev_time = sorted[0].time;
+	for(i = 0; i < count; i = j)
+	{
+		for(j = i + 1; j < count && sorted[j].time == sorted[i].time; j ++);
+		times = PutVarint(times, sorted[i].time - prev_time);
+		times = PutVarint(times, j - i);
+		prev_time = sorted[i].time;
+
+		for(prev_index = 0; i < j; i ++)
+		{
+			indices = PutVarint(indices, sorted[i].index - prev_index);
+			lengths = PutVarint(lengths, sorted[i].bytes);
+			prev_index = sorted[i].index;
+		}
+	}
+
+	while(words * 64 < dict_count * 10)
+		words *= 2;
+
+	block = malloc(sizeof(*h) + words * 8 + ipv4_count * 5 + (dict_count - ipv4_count) * 16
+		+ (times - scratch) + (indices - (scratch + (size_t) count * 20)) + (lengths - (scratch + (size_t) count * 25)) + 8);
+	if(!block)
+	{
+		fprintf(stderr, "malloc() for an archive block (%u records) failed: %s\n", count, strerror(errno));
+		exit(1);
+	}
+
+	h = (struct ArchiveBlockHeader *) block;
+	memset(h, 0, sizeof(*h));
+	h->magic = ARCHIVE_MAGIC;
+	h->time_min = sorted[0].time;
+	h->time_max = sorted[count - 1].time;
+	h->records = count;
+	h->ipv4_count = ipv4_count;
+	h->ipv6_count = dict_count - ipv4_count;
+	h->filter_words = words;
+
+	p = block + sizeof(*h);
+	memset(p, 0, words * 8);
+	for(i = 0; i < dict_count; i ++)
+		FilterAdd((uint64_t *) p, words, &dict[i]);
+	p += words * 8;
+
+	for(i = 0, prev_ip = 0; i < ipv4_count; i ++)
+	{
+		p = PutVarint(p, IpAddrIpv4(&dict[i]) - prev_ip);
+		prev_ip = IpAddrIpv4(&dict[i]);
+	}
+	for(; i < dict_count; i ++, p += 16)
+		memcpy(p, dict[i].addr, 16);
+	h->dict_bytes = p - (block + sizeof(*h) + words * 8);
+
+	h->times_bytes = times - scratch;
+	memcpy(p, scratch, h->times_bytes);
+	p += h->times_bytes;
+	h->indices_bytes = indices - (scratch + (size_t) count * 20);
+	memcpy(p, scratch + (size_t) count * 20, h->indices_bytes);
+	p += h->indices_bytes;
+	memcpy(p, scratch + (size_t) count * 25, lengths - (scratch + (size_t) count * 25));
+	p += lengths - (scratch + (size_t) count * 25);
+
+	while((p - block) % 8)
+		*p ++ = 0; /* the next header (and its filter) stays aligned in the mmap()ed file */
+	h->size = p - block;
+
+	free(slots);
+	free(slot_of);
+	free(dict);
+	free(sorted);
+	free(scratch);
+
+	/* One write() per block: if it's interrupted, InitializeArchive() cuts the rest off */
+	PartitionPath(path, sizeof(path), archive_dir, ArchivePartitionOf(h->time_min));
+	fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0600);
+	if(fd < 0)
+	{
+		fprintf(stderr, "open(%s) failed: %s (%u records are not archived)\n", path, strerror(errno), count);
+		free(block);
+		return;
+	}
+	old_size = lseek(fd, 0, SEEK_END);
+	written = write(fd, block, h->size);
+	if(written != (ssize_t) h->size)
+	{
+		fprintf(stderr, "write(%s) failed: %s (%u records are not archived)\n", path, written < 0 ? strerror(errno) : "short write", count);
+		if(old_size >= 0 && ftruncate(fd, old_size) < 0)
+			fprintf(stderr, "ftruncate(%s) failed: %s\n", path, strerror(errno));
+	}
+	close(fd);
+	free(block);
+}
+
+/* Writer job of ArchiveFlush(): 'data' is an array of records */
+static void WriteRecords(void *data, size_t size)
+{
+	struct ArchiveRecord *records = data;
+	unsigned int count = size / sizeof(struct ArchiveRecord), start, i;
+
+	qsort(records, count, sizeof(struct ArchiveRecord), compare_records_by_time);
+
+	for(start = 0; start < count; start = i)
+	{
+		for(i = start + 1; i < count && ArchivePartitionOf(records[i].time) == ArchivePartitionOf(records[start].time); i ++);
+		WriteBlock(records + start, i - start);
+	}
+}
+
+void ArchiveFlush(int force)
+{
+	if(!pending_count)
+		return;
+	if(!force && pending_count < ARCHIVE_BLOCK_RECORDS && pending_max - pending_min < ARCHIVE_BLOCK_SECONDS)
+		return;
+
+	/* The buffer goes to the writer as is, the next records start a new one */
+	WriterQueue(WriteRecords, pending, pending_count * sizeof(struct ArchiveRecord));
+	pending = NULL;
+	pending_count = pending_size = 0;
+}
+
+unsigned int ArchivePending(const struct ArchiveRecord **records)
+{
+	*records = pending;
+	return pending_count;
+}
+
+void ArchiveGetMark(struct ArchiveMark *mark)
+{
+	int64_t *hours;
+	unsigned int count;
+	char path[4096];
+	struct stat st;
+
+	memset(mark, 0, sizeof(*mark));
+
+	count = ListPartitions(archive_dir, &hours);
+	if(count)
+	{
+		mark->hour = hours[count - 1];
+		PartitionPath(path, sizeof(path), archive_dir, mark->hour);
+		if(stat(path, &st) == 0)
+			mark->size = st.st_size;
+	}
+	free(hours);
+}
+
+/* Writer job of ArchiveExpire(): 'data' is the time_t */
+static void DeleteHours(void *data, size_t size)
+{
+	time_t before = *(time_t *) data;
+	int64_t *hours;
+	unsigned int count, i, deleted = 0;
+	char path[4096];
+	(void) size;
+
+	count = ListPartitions(archive_dir, &hours);
+	for(i = 0; i < count && (hours[i] + 1) * ARCHIVE_PARTITION_SECONDS <= before; i ++)
+	{
+		PartitionPath(path, sizeof(path), archive_dir, hours[i]);
+		if(unlink(path) < 0)
+			fprintf(stderr, "unlink(%s) failed: %s\n", path, strerror(errno));
+		else
+			deleted ++;
+	}
+	free(hours);
+
+	if(deleted)
+		fprintf(stderr, "Deleted %u hour(s) of the archive older than %lld\n", deleted, (long long) before);
+}
+
+void ArchiveExpire(time_t before)
+{
+	static int64_t last_hour = -1;
+	time_t *data;
+
+	/* Nothing new to delete until the horizon reaches the next hour */
+	if(ArchivePartitionOf(before) == last_hour)
+		return;
+	last_hour = ArchivePartitionOf(before);
+
+	data = malloc(sizeof(time_t));
+	if(!data)
+	{
+		fprintf(stderr, "malloc() failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	*data = before;
+	WriterQueue(DeleteHours, data, sizeof(time_t));
+}
+
+/* Decode the dictionary of block 'h' (at 'p') into 'dict'; returns -1 if it's damaged */
+static int DecodeDictionary(const struct ArchiveBlockHeader *h, const uint8_t *p, struct IpAddr *dict)
+{
+	const uint8_t *end = p + h->dict_bytes;
+	uint64_t delta;
+	uint32_t ip = 0;
+	unsigned int i;
+
+	for(i = 0; i < h->ipv4_count; i ++)
+	{
+		if(!(p = GetVarint(p, end, &delta)))
+			return -1;
+		ip += delta;
+		IpAddrFromIpv4(&dict[i], ip);
+	}
+	if(end - p != (ptrdiff_t) h->ipv6_count * 16)
+		return -1;
+	for(; i < h->ipv4_count + h->ipv6_count; i ++, p += 16)
+		memcpy(dict[i].addr, p, 16);
+	return 0;
+}
+
+/* ArchiveRead() of one file */
+static uint64_t ReadFile(const char *path, time_t from, time_t to, const struct IpAddr *ip, ArchiveCallback callback, void *arg)
+{
+	static struct IpAddr *dict = NULL;
+	static unsigned int dict_size = 0;
+	const struct ArchiveBlockHeader *h;
+	const struct IpAddr *found_ip;
+	const uint8_t *map, *p, *times, *indices, *lengths, *times_end, *indices_end, *end;
+	uint64_t size = 0, offset, found = 0, delta, run, index, bytes;
+	unsigned int dict_count, i, wanted = 0;
+	int64_t time;
+
+	if(!(map = MapFile(path, &size)))
+		return 0;
+
+	for(offset = 0; (h = BlockAt(map, size, offset)); offset += h->size)
+	{
+		if(h->time_max <= from || h->time_min >= to)
+			continue;
+
+		p = map + offset + sizeof(*h);
+		if(ip && !FilterMayContain((const uint64_t *) p, h->filter_words, ip))
+			continue;
+		p += h->filter_words * 8;
+
+		dict_count = h->ipv4_count + h->ipv6_count;
+		if(dict_count > dict_size)
+		{
+			dict_size = dict_count;
+			free(dict);
+			dict = malloc(dict_size * sizeof(struct IpAddr));
+			if(!dict)
+			{
+				fprintf(stderr, "malloc() for the dictionary of an archive block (%u addresses) failed: %s\n", dict_size, strerror(errno));
+				exit(1);
+			}
+		}
+		if(DecodeDictionary(h, p, dict) < 0)
+		{
+			fprintf(stderr, "%s: damaged dictionary of the block at offset %llu\n", path, (unsigned long long) offset);
+			continue;
+		}
+
+		if(ip)
+		{
+			if(!(found_ip = bsearch(ip, dict, dict_count, sizeof(struct IpAddr), compare_addresses)))
+				continue; /* false positive of the filter */
+			wanted = found_ip - dict;
+		}
+
+		times = p + h->dict_bytes;
+		times_end = indices = times + h->times_bytes;
+		indices_end = lengths = indices + h->indices_bytes;
+		end = map + offset + h->size;
+
+		time = h->time_min;
+		for(i = 0; i < h->records; )
+		{
+			if(!(times = GetVarint(times, times_end, &delta)) || !(times = GetVarint(times, times_end, &run)) || run > h->records - i)
+				break;
+			time += delta;
+			if(time >= to)
+				break;
+
+			for(index = 0; run > 0; run --, i ++)
+			{
+				if(!(indices = GetVarint(indices, indices_end, &delta)) || !(lengths = GetVarint(lengths, end, &bytes)))
+					break;
+				index += delta;
+				if(time <= from || index >= dict_count || (ip && index != wanted))
+					continue;
+
+				callback(time, &dict[index], bytes, arg);
+				found ++;
+			}
+			if(run)
+				break;
+		}
+		if(i < h->records && time < to)
+			fprintf(stderr, "%s: damaged block at offset %llu\n", path, (unsigned long long) offset);
+	}
+
+	munmap((void *) map, size);
+	return found;
+}
+
+uint64_t ArchiveRead(const char *dir, time_t from, time_t to, const struct IpAddr *ip, ArchiveCallback callback, void *arg)
+{
+	int64_t *hours;
+	unsigned int count, i;
+	uint64_t found = 0;
+	char path[4096];
+
+	count = ListPartitions(dir, &hours);
+	for(i = 0; i < count; i ++)
+	{
+		/* Hour H has the records with H * 3600 <= time < (H + 1) * 3600 */
+		if((hours[i] + 1) * ARCHIVE_PARTITION_SECONDS - 1 <= from || hours[i] * ARCHIVE_PARTITION_SECONDS >= to)
+			continue;
+
+		PartitionPath(path, sizeof(path), dir, hours[i]);
+		found += ReadFile(path, from, to, ip, callback, arg);
+	}
+	free(hours);
+	return found;
+}
+
+int ArchiveSummarize(const char *dir, struct ArchiveSummary *summary)
+{
+	const struct ArchiveBlockHeader *h;
+	const uint8_t *map;
+	int64_t *hours;
+	unsigned int count, i;
+	uint64_t size, offset;
+	char path[4096];
+
+	memset(summary, 0, sizeof(*summary));
+
+	count = ListPartitions(dir, &hours);
+	for(i = 0; i < count; i ++)
+	{
+		PartitionPath(path, sizeof(path), dir, hours[i]);
+		summary->files ++;
+		if(!(map = MapFile(path, &size)))
+			continue;
+		summary->bytes += size;
+
+		for(offset = 0; (h = BlockAt(map, size, offset)); offset += h->size)
+		{
+			if(!summary->records || h->time_min < summary->time_min)
+				summary->time_min = h->time_min;
+			if(!summary->records || h->time_max > summary->time_max)
+				summary->time_max = h->time_max;
+			summary->blocks ++;
+			summary->records += h->records;
+		}
+		munmap((void *) map, size);
+	}
+	free(hours);
+	return summary->records ? 0 : -1;
+}
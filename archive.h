@@ -0,0 +1,139 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_ARCHIVE_H
+#define _LIMITTRAF_ARCHIVE_H
+
+#include <stdint.h>
+#include <time.h>
+
+#include "ipaddr.h"
+
+/*
+	Archive: on-disc traffic history (the rows written by CompactDb(): bytes sent
+	to one client in one 10-second bucket), stored in files instead of SQLite.
+
+	Directory 'dir' has one file per hour, "H.lta" with H = time / ARCHIVE_PARTITION_SECONDS.
+	Old hours are deleted as a whole (ArchiveExpire()).
+	A file is a sequence of blocks, appended and never modified.
+	Each block has the records of ARCHIVE_BLOCK_SECONDS, by columns:
+
+		struct ArchiveBlockHeader
+		uint64_t filter[filter_words] - Bloom filter of the addresses in the block
+		dictionary (dict_bytes)       - ascending IPv4 addresses as varint deltas (LEB128),
+		                                then ascending IPv6 addresses, 16 bytes each;
+		                                the records refer to the addresses by position
+		times (times_bytes)           - for each distinct time: varint(time - previous time
+		                                or time_min), varint(number of records)
+		indices (indices_bytes)       - for each record: varint(index - previous index of
+		                                the same time, or 0)
+		lengths                       - for each record: varint(bytes)
+		zero padding to a multiple of 8 bytes
+
+	Integers are in host byte order (the files are not moved between architectures).
+	A block which was not completely written (e.g. power failure) is cut off by InitializeArchive().
+
+	Readers mmap() the files and skip the blocks by time range and by the filter,
+	see ArchiveRead() and the 'ltarchive' tool.
+*/
+#define ARCHIVE_PARTITION_SECONDS 3600
+#define ARCHIVE_MAGIC 0x3141544c /* "LTA1" */
+
+/* Records are buffered until they cover this many seconds (or ARCHIVE_BLOCK_RECORDS), then written as one block */
+#define ARCHIVE_BLOCK_SECONDS 300
+#define ARCHIVE_BLOCK_RECORDS 65536
+
+struct ArchiveBlockHeader
+{
+	uint32_t magic; /* ARCHIVE_MAGIC */
+	uint32_t size; /* of the whole block, including this header */
+	int64_t time_min, time_max;
+	uint32_t records;
+	uint32_t ipv4_count, ipv6_count;
+	uint32_t filter_words; /* power of 2 */
+	uint32_t dict_bytes, times_bytes, indices_bytes; /* sizes of the columns */
+	uint32_t reserved;
+};
+
+/* Record waiting for ArchiveFlush() */
+struct ArchiveRecord
+{
+	int64_t time;
+	struct IpAddr ip;
+	uint64_t bytes;
+};
+
+static inline int64_t ArchivePartitionOf(time_t time)
+{
+	return time / ARCHIVE_PARTITION_SECONDS;
+}
+
+/*
+	Writer (only one process may write to 'dir' at a time).
+	InitializeArchive() creates 'dir' if needed and repairs the last blocks of the existing files.
+*/
+void InitializeArchive(const char *dir);
+void TerminateArchive(); /* writes the buffered records (after TerminateWriter(): right away) */
+
+/* Buffer one record; it's written by ArchiveFlush() */
+void ArchiveAppend(time_t time, const struct IpAddr *ip, uint64_t bytes);
+
+/*
+	Write the buffered records as one block per hour, if they cover ARCHIVE_BLOCK_SECONDS
+	(or if 'force' is set). The writing itself is a job of the writer thread (see writer.h),
+	as well as ArchiveExpire(): call WriterWait() before reading the files.
+*/
+void ArchiveFlush(int force);
+
+/* The buffered records (not written yet), for the snapshot (see SaveSnapshot()) */
+unsigned int ArchivePending(const struct ArchiveRecord **records);
+
+/*
+	End of the archive: the newest file and its size.
+	Every ArchiveFlush() which writes something changes it (the newest records go into the newest hour), so if the mark
+	is the same as when ArchivePending() was saved, these records are still not in the archive.
+	Only meaningful in a writer job or after WriterWait(): the flushes queued before must be written.
+*/
+struct ArchiveMark
+{
+	int64_t hour;
+	uint64_t size;
+};
+void ArchiveGetMark(struct ArchiveMark *mark);
+
+/* Delete the hours which are completely older than 'before' */
+void ArchiveExpire(time_t before);
+
+/*
+	Reader: call 'callback' for every record with from < time < to
+	(and, if 'ip' is not NULL, for this address only), in the order of time within each hour.
+	Only reads the files in 'dir' (doesn't need InitializeArchive()): the buffered records are not seen.
+	Returns the number of records.
+*/
+typedef void (*ArchiveCallback)(time_t time, const struct IpAddr *ip, uint64_t bytes, void *arg);
+uint64_t ArchiveRead(const char *dir, time_t from, time_t to, const struct IpAddr *ip, ArchiveCallback callback, void *arg);
+
+/*
+	Totals of 'dir', from the block headers only.
+	Returns 0 on success, -1 if there are no records (then only 'files' and 'bytes' are set).
+*/
+struct ArchiveSummary
+{
+	time_t time_min, time_max;
+	uint64_t files, blocks, records, bytes;
+};
+int ArchiveSummarize(const char *dir, struct ArchiveSummary *summary);
+
+#endif
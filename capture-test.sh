@@ -0,0 +1,56 @@
+#! /bin/bash
+###############################################################################
+# limittraf - per-client outgoing traffic limiter.
+# Copyright (C) 2013-2015 Edward Chernenko.
+#
+# This program is free software; you can redistribute it and/or modify
+# it under the terms of the GNU General Public License as published by
+# the Free Software Foundation; either version 3 of the License, or
+# (at your option) any later version.
+#
+# This program is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+# GNU General Public License for more details.
+###############################################################################
+
+# Test bed for the capture modes (LIMITTRAF_CAPTURE_PCAP, LIMITTRAF_CAPTURE_RING, LIMITTRAF_CAPTURE_EBPF,
+# LIMITTRAF_CAPTURE_CONNTRACK):
+# a veth pair between the host (server, 10.99.0.1) and a network namespace (client, 10.99.0.2).
+#
+# 1) run this script as root,
+# 2) set ltNetworkInterface = "lt0" in limittraf.c, rebuild and start limittraf,
+# 3) download something from the namespace:
+#	ip netns exec lt-client curl -o /dev/null http://10.99.0.1/bigfile
+#
+# Traffic to 10.99.0.2 should then be reported by AnalyzeDb().
+#
+# LIMITTRAF_CAPTURE_EBPF also needs the BPF filesystem (mounted below if it isn't).
+# LIMITTRAF_CAPTURE_CONNTRACK needs conntrack to be in use, e.g. by any rule with 'ct state'.
+#
+# Cleanup: ip netns del lt-client (this removes the veth pair too).
+
+export NS="lt-client"
+export DEV="lt0"
+export PEER="lt1"
+export DOCROOT="/tmp/limittraf-test-www"
+
+ip netns del $NS 2>/dev/null
+ip netns add $NS || exit
+
+ip link add $DEV type veth peer name $PEER || exit
+ip link set $PEER netns $NS
+
+ip addr add 10.99.0.1/24 dev $DEV
+ip link set $DEV up
+ip netns exec $NS ip addr add 10.99.0.2/24 dev $PEER
+ip netns exec $NS ip link set $PEER up
+ip netns exec $NS ip link set lo up
+
+mountpoint -q /sys/fs/bpf || mount -t bpf bpf /sys/fs/bpf
+
+mkdir -p $DOCROOT
+dd if=/dev/zero of=$DOCROOT/bigfile bs=1M count=100 2>/dev/null
+
+echo "Serving $DOCROOT on http://10.99.0.1:80/ (Ctrl+C to stop)"
+cd $DOCROOT && python3 -m http.server --bind 10.99.0.1 80
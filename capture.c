@@ -0,0 +1,687 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#define _GNU_SOURCE /* memmem() */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <arpa/inet.h>
+#include <pcap.h>
+
+#include "limittraf.h"
+#include "capture.h"
+#include "ring.h"
+#include "ebpf.h"
+#include "conntrack.h"
+
+const char *capture_mode_text[] = { "tcpdump", "pcap", "ring", "stdin", "ebpf", "conntrack" };
+
+/*
+	LIMITTRAF_CAPTURE_PCAP.
+
+	We only need the link-layer header (with up to two VLAN tags) and the IP header,
+	so the snapshot length is small: the kernel never copies the payload to us.
+*/
+static const int PCAP_SNAPLEN = 96;
+static const int PCAP_BUFFER_SIZE = 32 * 1024 * 1024; /* kernel buffer: absorbs bursts while Analyze() is running */
+static const int PCAP_TIMEOUT = 1000; /* milliseconds */
+
+static pcap_t *pcap;
+static int pcap_linktype;
+
+/*
+	LIMITTRAF_CAPTURE_TCPDUMP.
+
+	Format of two lines printed by 'tcpdump -fnvKtq':
+		IP (tos 0x0, ttl 64, id 46394, offset 0, flags [DF], proto TCP (6), length 1492)
+		    10.205.15.60.80 > 80.102.204.74.1155: tcp 1452
+	We need "length N" from the first line and the destination address from the second one.
+	IPv6 packets are printed as one line:
+		IP6 (flowlabel 0x3f1a2, hlim 64, next-header TCP (6) payload length: 1440) 2001:db8::1.80 > 2001:db8::2.1155: tcp 1420
+	and "payload length: N" doesn't include the 40-byte header.
+
+	The standard error of tcpdump is a separate pipe: on SIGUSR1 tcpdump prints there
+		123 packets captured
+		456 packets received by filter
+		7 packets dropped by kernel
+	which is how CaptureStatistics() learns about the drops.
+
+	LIMITTRAF_CAPTURE_STDIN.
+
+	Lines of "IP length" (e.g. "80.102.204.74 1492" or "2001:db8::2 1480") are read from the standard input,
+	so that any other program can feed limittraf.
+*/
+static const char TcpDumpRequiredParams[] = "-fnvKtq"; /* These affect the format and therefore must be specified for parsing to success */
+static const int TEXT_BUFFER_SIZE = 65536; /* we read() this much at once, must be longer than any line */
+
+static pid_t tcpdump_pid = 0;
+static int tcpdump_stderr = -1; /* non-blocking */
+static uint64_t tcpdump_received = 0, tcpdump_dropped = 0; /* from the last report on tcpdump_stderr */
+static int text_fd = -1; /* stdout of tcpdump or 0 (stdin) */
+static char *text_buffer;
+static long text_pending_length = -1; /* "length N" from the first line of tcpdump output, -1 if none */
+static time_t text_time; /* time of the last read(): timestamp of the packets in text_buffer */
+
+/*
+	Returns the offset of the IP header in a packet captured on a link of type pcap_linktype,
+	or -1 if this is not an IPv4 or IPv6 packet.
+*/
+static inline int pcap_ip_offset(const u_char *bytes, unsigned int caplen)
+{
+	unsigned int off;
+	uint16_t ethertype;
+
+	switch(pcap_linktype)
+	{
+		case DLT_RAW:
+#ifdef DLT_IPV4
+		case DLT_IPV4:
+#endif
+			return 0;
+
+		case DLT_NULL:
+		case DLT_LOOP:
+			return 4; /* BSD loopback: 4-byte address family, we rely on the IP version check below */
+
+		case DLT_LINUX_SLL: /* "tcpdump -i any" */
+			if(caplen < 16) return -1;
+			ethertype = (bytes[14] << 8) | bytes[15];
+			return ethertype == 0x0800 || ethertype == 0x86dd ? 16 : -1;
+
+		case DLT_EN10MB:
+			off = 12;
+			if(caplen < off + 2) return -1;
+			ethertype = (bytes[off] << 8) | bytes[off + 1];
+
+			/* skip 802.1Q and 802.1ad tags */
+			while(ethertype == 0x8100 || ethertype == 0x88a8)
+			{
+				off += 4;
+				if(caplen < off + 2) return -1;
+				ethertype = (bytes[off] << 8) | bytes[off + 1];
+			}
+			return ethertype == 0x0800 || ethertype == 0x86dd ? (int) off + 2 : -1;
+	}
+	return -1;
+}
+
+__attribute__((hot)) static void CapturePcapPacket(u_char *user, const struct pcap_pkthdr *h, const u_char *bytes)
+{
+	struct IpAddr ip;
+	unsigned int length;
+	int off;
+	(void) user;
+
+	off = pcap_ip_offset(bytes, h->caplen);
+	if(off < 0 || (unsigned int) off > h->caplen || IpAddrFromPacket(bytes + off, h->caplen - off, &ip, &length) < 0)
+		return;
+
+	HandlePacket(h->ts.tv_sec, &ip, length);
+}
+
+/*
+	Check the link-layer type and apply ltTcpDumpOptions to the opened 'pcap'.
+	'source' is an interface or a file name (for error messages).
+*/
+__attribute__((cold)) static void PcapSetup(const char *source)
+{
+	struct bpf_program filter;
+
+	pcap_linktype = pcap_datalink(pcap);
+	if(pcap_linktype != DLT_EN10MB && pcap_linktype != DLT_LINUX_SLL && pcap_linktype != DLT_RAW
+		&& pcap_linktype != DLT_NULL && pcap_linktype != DLT_LOOP
+#ifdef DLT_IPV4
+		&& pcap_linktype != DLT_IPV4
+#endif
+	)
+	{
+		fprintf(stderr, "%s: unsupported link-layer type %i\n", source, pcap_linktype);
+		exit(1);
+	}
+
+	/* ltTcpDumpOptions is a tcpdump expression, i.e. a BPF filter */
+	if(pcap_compile(pcap, &filter, ltTcpDumpOptions, 1, PCAP_NETMASK_UNKNOWN) < 0)
+	{
+		fprintf(stderr, "pcap_compile(%s) failed: %s\n", ltTcpDumpOptions, pcap_geterr(pcap));
+		exit(1);
+	}
+	if(pcap_setfilter(pcap, &filter) < 0)
+	{
+		fprintf(stderr, "pcap_setfilter(%s) failed: %s\n", ltTcpDumpOptions, pcap_geterr(pcap));
+		exit(1);
+	}
+	pcap_freecode(&filter);
+
+	fprintf(stderr, "Capturing on %s (filter: %s)\n", source, ltTcpDumpOptions);
+}
+
+__attribute__((cold)) static void InitializePcap()
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+	int ret;
+
+	pcap = pcap_create(ltNetworkInterface, errbuf);
+	if(!pcap)
+	{
+		fprintf(stderr, "pcap_create(%s) failed: %s\n", ltNetworkInterface, errbuf);
+		exit(1);
+	}
+
+	pcap_set_snaplen(pcap, PCAP_SNAPLEN);
+	pcap_set_promisc(pcap, 0);
+	pcap_set_timeout(pcap, PCAP_TIMEOUT);
+	pcap_set_buffer_size(pcap, PCAP_BUFFER_SIZE);
+
+	ret = pcap_activate(pcap);
+	if(ret < 0)
+	{
+		fprintf(stderr, "pcap_activate(%s) failed: %s: %s\n", ltNetworkInterface, pcap_statustostr(ret), pcap_geterr(pcap));
+		exit(1);
+	}
+	if(ret > 0)
+		fprintf(stderr, "pcap_activate(%s): warning: %s: %s\n", ltNetworkInterface, pcap_statustostr(ret), pcap_geterr(pcap));
+
+	PcapSetup(ltNetworkInterface);
+}
+
+/*
+	--replay: read packets from ltReplayFile as fast as possible.
+	TIME is taken from the capture timestamps, so the result is the same as with live capture.
+*/
+__attribute__((cold)) static void InitializeReplay()
+{
+	char errbuf[PCAP_ERRBUF_SIZE];
+
+	pcap = pcap_open_offline(ltReplayFile, errbuf);
+	if(!pcap)
+	{
+		fprintf(stderr, "pcap_open_offline(%s) failed: %s\n", ltReplayFile, errbuf);
+		exit(1);
+	}
+
+	PcapSetup(ltReplayFile);
+}
+
+/* LIMITTRAF_CAPTURE_PCAP and --replay */
+__attribute__((hot)) static void CaptureLoopPcap()
+{
+	int ret = pcap_loop(pcap, -1, CapturePcapPacket, NULL);
+	if(ret == -1)
+		fprintf(stderr, "pcap_loop() failed: %s\n", pcap_geterr(pcap));
+}
+
+__attribute__((cold)) static void InitializeTextInput()
+{
+	char *TcpDumpCommand;
+	int out[2], err[2];
+
+	text_buffer = malloc(TEXT_BUFFER_SIZE);
+	if(!text_buffer)
+	{
+		fprintf(stderr, "malloc(TEXT_BUFFER_SIZE = %i) failed: %s\n", TEXT_BUFFER_SIZE, strerror(errno));
+		exit(1);
+	}
+
+	if(ltCaptureMode == LIMITTRAF_CAPTURE_STDIN)
+	{
+		fprintf(stderr, "Reading \"IP length\" lines from the standard input\n");
+		text_fd = 0;
+		return;
+	}
+
+	TcpDumpCommand = malloc(1024);
+	if(!TcpDumpCommand)
+	{
+		fprintf(stderr, "malloc() for TcpDumpCommand failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	/* "exec": tcpdump_pid must be the pid of tcpdump itself (for SIGUSR1), not of the shell */
+	snprintf(TcpDumpCommand, 1024, "exec %s %s %s -i %s", ltTcpDump, ltTcpDumpOptions, TcpDumpRequiredParams, ltNetworkInterface);
+
+	fprintf(stderr, "Starting %s\n", TcpDumpCommand + 5);
+	if(pipe(out) < 0 || pipe(err) < 0)
+	{
+		fprintf(stderr, "pipe() for %s failed: %s\n", ltTcpDump, strerror(errno));
+		exit(1);
+	}
+
+	tcpdump_pid = fork();
+	if(tcpdump_pid < 0)
+	{
+		fprintf(stderr, "fork() for %s failed: %s\n", ltTcpDump, strerror(errno));
+		exit(1);
+	}
+	if(tcpdump_pid == 0)
+	{
+		dup2(out[1], 1);
+		dup2(err[1], 2);
+		close(out[0]); close(out[1]);
+		close(err[0]); close(err[1]);
+
+		execl("/bin/sh", "sh", "-c", TcpDumpCommand, (char *) NULL);
+		_exit(127);
+	}
+	free(TcpDumpCommand);
+
+	close(out[1]);
+	close(err[1]);
+	text_fd = out[0];
+	tcpdump_stderr = err[0];
+	fcntl(tcpdump_stderr, F_SETFL, fcntl(tcpdump_stderr, F_GETFL) | O_NONBLOCK);
+}
+
+/*
+	Read everything that tcpdump has printed to its standard error so far:
+	remember the counters (reply to SIGUSR1), pass all other lines to our stderr.
+*/
+__attribute__((cold)) static void ReadTcpDumpStderr()
+{
+	static char buf[4096];
+	static size_t have = 0;
+	unsigned long value;
+	char *p, *eol;
+	ssize_t ret;
+
+	while((ret = read(tcpdump_stderr, buf + have, sizeof(buf) - 1 - have)) > 0)
+	{
+		have += ret;
+		buf[have] = '\0';
+
+		p = buf;
+		while((eol = strchr(p, '\n')))
+		{
+			*eol = '\0';
+			if(sscanf(p, "%lu packet", &value) == 1 && strstr(p, " received by filter"))
+				tcpdump_received = value;
+			else if(sscanf(p, "%lu packet", &value) == 1 && strstr(p, " dropped by kernel"))
+				tcpdump_dropped = value;
+			else if(sscanf(p, "%lu packet", &value) != 1)
+				fprintf(stderr, "%s: %s\n", ltTcpDump, p);
+			p = eol + 1;
+		}
+
+		have = strlen(p);
+		if(have == sizeof(buf) - 1)
+			have = 0; /* too long line, ignored */
+		else
+			memmove(buf, p, have + 1);
+	}
+}
+
+/*
+	Parse "a.b.c.d" at 'p' (nothing else is allowed before it).
+	Returns the pointer to the first character after the address,
+	or NULL if there is no valid IPv4 address here.
+*/
+static inline const char *parse_ipv4(const char *p, const char *end, uint32_t *ip)
+{
+	uint32_t addr = 0;
+	unsigned int octet;
+	int i, digits;
+
+	for(i = 0; i < 4; i ++)
+	{
+		if(i > 0)
+		{
+			if(p >= end || *p != '.') return NULL;
+			p ++;
+		}
+
+		octet = 0;
+		for(digits = 0; digits < 3 && p < end && *p >= '0' && *p <= '9'; digits ++, p ++)
+			octet = octet * 10 + (*p - '0');
+
+		if(!digits || octet > 255) return NULL;
+		addr = (addr << 8) | octet;
+	}
+
+	*ip = addr;
+	return p;
+}
+
+/*
+	Parse an IPv4 or IPv6 address at 'p'. If 'with_port' is set, the address is
+	followed by ".port" and/or ':' (as in the tcpdump output), which are skipped.
+	Returns the pointer to the first character after it, or NULL if there's no valid address.
+*/
+static inline const char *parse_ip(const char *p, const char *end, int with_port, struct IpAddr *ip)
+{
+	char text[IPADDR_STRLEN];
+	const char *token_end, *addr_end;
+	uint32_t ipv4;
+	size_t len;
+
+	token_end = parse_ipv4(p, end, &ipv4);
+	if(token_end && (token_end == end || *token_end == ' ' || *token_end == '\t' || *token_end == '.' || *token_end == ':'))
+	{
+		IpAddrFromIpv4(ip, ipv4);
+		return token_end;
+	}
+
+	/* IPv6 (rare, so the slower inet_pton() is fine here) */
+	for(token_end = p; token_end < end && *token_end != ' ' && *token_end != '\t'; token_end ++);
+	addr_end = token_end;
+	if(with_port)
+	{
+		if(addr_end > p && addr_end[-1] == ':') addr_end --;
+		len = addr_end - p;
+		while(addr_end > p && addr_end[-1] != '.' && addr_end[-1] != ':') addr_end --;
+		if(addr_end > p && addr_end[-1] == '.')
+			addr_end --; /* ".port" */
+		else
+			addr_end = p + len; /* no port (e.g. ICMPv6) */
+	}
+
+	len = addr_end - p;
+	if(len == 0 || len >= sizeof(text) || !memchr(p, ':', len))
+		return NULL;
+	memcpy(text, p, len);
+	text[len] = '\0';
+
+	if(inet_pton(AF_INET6, text, ip->addr) != 1)
+		return NULL;
+	return token_end;
+}
+
+/*
+	Parse a decimal number at 'p'. Returns -1 if there are no digits here.
+*/
+static inline long parse_length(const char *p, const char *end)
+{
+	long value = 0;
+	const char *start = p;
+
+	for(; p < end && p - start < 9 && *p >= '0' && *p <= '9'; p ++)
+		value = value * 10 + (*p - '0');
+
+	return p == start ? -1 : value;
+}
+
+/*
+	One line of 'tcpdump -fnvKtq' output (without '\n').
+	Both lines of the packet are also accepted if they are joined into one.
+*/
+__attribute__((hot)) static void ParseTcpDumpLine(const char *line, const char *end)
+{
+	const char *p, *gt;
+	struct IpAddr ip;
+
+	gt = memchr(line, '>', end - line);
+
+	/* "length N" of the IP header line (ignore "length" of the payload after the '>') */
+	p = memmem(line, (gt ? gt : end) - line, "length ", 7);
+	if(p)
+		text_pending_length = parse_length(p + 7, end);
+	else if((p = memmem(line, (gt ? gt : end) - line, "payload length: ", 16)))
+	{
+		text_pending_length = parse_length(p + 16, end);
+		if(text_pending_length >= 0)
+			text_pending_length += 40;
+	}
+
+	if(!gt || gt + 1 >= end || gt[1] != ' ')
+		return;
+
+	if(text_pending_length < 0)
+		return; /* second line without the first one (e.g. the beginning of output was lost) */
+
+	if(parse_ip(gt + 2, end, 1, &ip))
+		HandlePacket(text_time, &ip, text_pending_length);
+
+	text_pending_length = -1;
+}
+
+/*
+	One line of "IP length" (LIMITTRAF_CAPTURE_STDIN).
+*/
+__attribute__((hot)) static void ParsePlainLine(const char *line, const char *end)
+{
+	const char *p;
+	struct IpAddr ip;
+	long length;
+
+	p = parse_ip(line, end, 0, &ip);
+	if(p)
+	{
+		while(p < end && (*p == ' ' || *p == '\t')) p ++;
+
+		length = parse_length(p, end);
+		if(length >= 0)
+		{
+			HandlePacket(text_time, &ip, length);
+			return;
+		}
+	}
+
+	if(end > line)
+		fprintf(stderr, "Can't parse \"IP length\" from [[%.*s]]\n", (int) (end - line), line);
+}
+
+/*
+	Text input is read in blocks of up to TEXT_BUFFER_SIZE bytes and split into lines with memchr().
+	Nothing is allocated or copied per line (except the incomplete line at the end of the block).
+*/
+__attribute__((hot)) static void CaptureLoopText()
+{
+	const char *p, *end, *eol;
+	size_t have = 0; /* bytes in text_buffer */
+	ssize_t ret;
+
+	while(1)
+	{
+		ret = read(text_fd, text_buffer + have, TEXT_BUFFER_SIZE - have);
+		if(ret < 0)
+		{
+			if(errno == EINTR) continue;
+			fprintf(stderr, "read() from %s failed: %s\n", capture_mode_text[ltCaptureMode], strerror(errno));
+			return;
+		}
+		if(ret == 0)
+		{
+			/* EOF (if tcpdump has exited, its error message is in tcpdump_stderr) */
+			if(tcpdump_stderr >= 0)
+				ReadTcpDumpStderr();
+			return;
+		}
+
+		time(&text_time);
+		have += ret;
+
+		p = text_buffer;
+		end = text_buffer + have;
+		while((eol = memchr(p, '\n', end - p)))
+		{
+			if(ltCaptureMode == LIMITTRAF_CAPTURE_STDIN)
+				ParsePlainLine(p, eol);
+			else
+				ParseTcpDumpLine(p, eol);
+			p = eol + 1;
+		}
+
+		/* Keep the incomplete last line for the next read() */
+		have = end - p;
+		if(have == (size_t) TEXT_BUFFER_SIZE)
+		{
+			fprintf(stderr, "Line longer than %i bytes, ignored\n", TEXT_BUFFER_SIZE);
+			have = 0;
+		}
+		else if(have)
+			memmove(text_buffer, p, have);
+	}
+}
+
+/*
+	The filter expression can't be compiled for the modes which don't see packets
+	in userspace (eBPF, conntrack), so only "src port N" is supported there.
+*/
+__attribute__((cold)) unsigned int CaptureSourcePort()
+{
+	unsigned int port;
+	int end = 0;
+
+	if(ltTcpDumpOptions[0] == '\0')
+		return 0;
+
+	if(sscanf(ltTcpDumpOptions, "src port %u%n", &port, &end) != 1 || ltTcpDumpOptions[end] != '\0' || port == 0 || port > 65535)
+	{
+		fprintf(stderr, "Capture mode \"%s\" only supports ltTcpDumpOptions of the form \"src port N\" (or empty), not \"%s\"\n",
+			capture_mode_text[ltCaptureMode], ltTcpDumpOptions);
+		exit(1);
+	}
+	return port;
+}
+
+int CaptureUsesQueue()
+{
+	if(ltReplayFile)
+		return 1;
+	if(ltCaptureMode == LIMITTRAF_CAPTURE_EBPF || ltCaptureMode == LIMITTRAF_CAPTURE_CONNTRACK)
+		return 0;
+	if(ltCaptureMode == LIMITTRAF_CAPTURE_RING && ltCaptureThreads > 1)
+		return 0;
+	return 1;
+}
+
+__attribute__((cold)) void InitializeCapture()
+{
+	if(ltReplayFile)
+	{
+		InitializeReplay();
+		return;
+	}
+
+	switch(ltCaptureMode)
+	{
+		case LIMITTRAF_CAPTURE_PCAP:
+			InitializePcap();
+			break;
+		case LIMITTRAF_CAPTURE_RING:
+			InitializeRing();
+			break;
+		case LIMITTRAF_CAPTURE_EBPF:
+			InitializeEbpf();
+			break;
+		case LIMITTRAF_CAPTURE_CONNTRACK:
+			InitializeConntrack();
+			break;
+		default:
+			InitializeTextInput();
+	}
+}
+
+__attribute__((cold)) void TerminateCapture()
+{
+	TerminateRing();
+	TerminateEbpf();
+	TerminateConntrack();
+	if(pcap)
+	{
+		pcap_close(pcap);
+		pcap = NULL;
+	}
+	if(tcpdump_pid > 0)
+	{
+		close(text_fd);
+		close(tcpdump_stderr);
+		kill(tcpdump_pid, SIGTERM);
+		waitpid(tcpdump_pid, NULL, 0);
+		tcpdump_pid = 0;
+		tcpdump_stderr = -1;
+	}
+	free(text_buffer);
+	text_buffer = NULL;
+}
+
+void CaptureStatistics(struct CaptureStats *stats)
+{
+	struct pcap_stat ps;
+	int pending;
+
+	memset(stats, 0, sizeof(*stats));
+	if(ltReplayFile)
+		return; /* nothing can be lost */
+
+	switch(ltCaptureMode)
+	{
+		case LIMITTRAF_CAPTURE_PCAP:
+			/* Only reads the counters, so it's safe while pcap_loop() is running in the capture thread */
+			if(pcap_stats(pcap, &ps) < 0)
+			{
+				fprintf(stderr, "pcap_stats() failed: %s\n", pcap_geterr(pcap));
+				return;
+			}
+			stats->received = ps.ps_recv;
+			stats->dropped = (uint64_t) ps.ps_drop + ps.ps_ifdrop;
+			break;
+		case LIMITTRAF_CAPTURE_RING:
+			RingStatistics(stats);
+			break;
+		case LIMITTRAF_CAPTURE_EBPF:
+			break;
+		case LIMITTRAF_CAPTURE_CONNTRACK:
+			stats->dropped = ConntrackEventsLost();
+			break;
+		default:
+			if(tcpdump_pid > 0)
+			{
+				/* The reply to the previous SIGUSR1 */
+				ReadTcpDumpStderr();
+				kill(tcpdump_pid, SIGUSR1);
+
+				stats->received = tcpdump_received;
+				stats->dropped = tcpdump_dropped;
+			}
+			if(ioctl(text_fd, FIONREAD, &pending) == 0)
+			{
+				stats->backlog = pending;
+				stats->backlog_unit = "bytes";
+			}
+	}
+}
+
+void CaptureLoop()
+{
+	if(ltReplayFile)
+	{
+		CaptureLoopPcap();
+		return;
+	}
+
+	switch(ltCaptureMode)
+	{
+		case LIMITTRAF_CAPTURE_PCAP:
+			CaptureLoopPcap();
+			break;
+		case LIMITTRAF_CAPTURE_RING:
+			CaptureLoopRing();
+			break;
+		case LIMITTRAF_CAPTURE_EBPF:
+			CaptureLoopEbpf();
+			break;
+		case LIMITTRAF_CAPTURE_CONNTRACK:
+			CaptureLoopConntrack();
+			break;
+		default:
+			CaptureLoopText();
+	}
+}
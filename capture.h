@@ -0,0 +1,81 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_CAPTURE_H
+#define _LIMITTRAF_CAPTURE_H
+
+#include <stdint.h>
+
+/*
+	Possible values of ltCaptureMode.
+*/
+#define LIMITTRAF_CAPTURE_TCPDUMP 0 /* popen(ltTcpDump) and parse its text output (e.g. when limittraf must not capture packets itself) */
+#define LIMITTRAF_CAPTURE_PCAP 1 /* capture packets on ltNetworkInterface via libpcap */
+#define LIMITTRAF_CAPTURE_RING 2 /* mmap'ed TPACKET_V3 ring of an AF_PACKET socket (Linux only), see ring.c */
+#define LIMITTRAF_CAPTURE_STDIN 3 /* read "a.b.c.d length" lines from the standard input */
+#define LIMITTRAF_CAPTURE_EBPF 4 /* count bytes per IP in the kernel (tc egress eBPF program), see ebpf.c */
+#define LIMITTRAF_CAPTURE_CONNTRACK 5 /* per-flow byte counters of netfilter conntrack (via netlink), see conntrack.c */
+
+extern const char *capture_mode_text[]; /* capture_mode_text[0] = "tcpdump", etc.; defined in capture.c */
+
+/*
+	Open the packet source selected by ltCaptureMode (or ltReplayFile, if set).
+	NOTE: InitializeCapture() must be called after chdir(ltWorkDir) and
+	after InitializeDb() (packets may arrive as soon as it returns).
+*/
+void InitializeCapture();
+void TerminateCapture();
+
+/*
+	Main loop: read packets from the source opened by InitializeCapture()
+	and pass each of them to HandlePacket() (or HandleTraffic(), see CaptureUsesQueue()).
+	Normally never returns (only on EOF or a fatal capture error).
+*/
+void CaptureLoop();
+
+/*
+	1 if CaptureLoop() calls HandlePacket() for each packet (pcap, tcpdump, stdin,
+	the ring with one worker, --replay), so it must run in its own thread (see ConsumeLoop()).
+	0 if CaptureLoop() aggregates the traffic itself and calls HandleTraffic()
+	and AnalyzeIfDue() in the main thread (eBPF, conntrack, several ring workers).
+*/
+int CaptureUsesQueue();
+
+/*
+	Source port from ltTcpDumpOptions ("src port N"), 0 if the filter is empty.
+	Exits with an error for any other filter expression.
+*/
+unsigned int CaptureSourcePort();
+
+/*
+	Counters of the packet source (totals since InitializeCapture()), see CaptureStatistics().
+*/
+struct CaptureStats
+{
+	uint64_t received; /* packets seen by the source, 0 if unknown */
+	uint64_t dropped; /* packets lost before we could read them (kernel buffer was full, etc.) */
+	uint64_t backlog; /* data which is waiting to be read by us, in 'backlog_unit' */
+	const char *backlog_unit; /* e.g. "bytes", NULL if the backlog is unknown */
+};
+
+/*
+	Collect the counters of the source opened by InitializeCapture().
+	Called by Analyze() in the main thread (the capture may be running in another thread).
+	NOTE: for LIMITTRAF_CAPTURE_CONNTRACK 'dropped' is the number of overflows of the events socket
+	(the number of lost flows is unknown), for LIMITTRAF_CAPTURE_EBPF nothing is known.
+*/
+void CaptureStatistics(struct CaptureStats *stats);
+
+#endif
@@ -33,6 +33,9 @@ struct CfgTrigger
 	/* 1) If 'limit_used' is downloaded in 'limit_interval' seconds, ... */
 	int limit_interval; /* seconds */
 	long limit_used; /* bytes */
+
+	/* "PER /24": 'limit_used' is the traffic of the whole subnet (see IpAddrSubnet()), 0 = of one client */
+	int prefix;
 	
 	/* 2) ... then undertake 'action' */
 	int action;
@@ -57,7 +60,7 @@ static inline int size_prefix(const char *prefix)
 	exit(1);
 }
 /*
-	Convert "h", "m", "" into a numeric multiplier.
+	Convert "w", "d", "h", "m", "s", "" into a numeric multiplier.
 */
 static inline int time_prefix(const char *prefix)
 {
@@ -67,6 +70,7 @@ static inline int time_prefix(const char *prefix)
 	if(c == 'm') return 60;
 	if(c == 'h') return 3600;
 	if(c == 'd') return 24 * 3600;
+	if(c == 'w') return 7 * 24 * 3600;
 
 	fprintf(stderr, "Unknown time prefix: '%s'\n", prefix);
 	exit(1);
@@ -92,13 +96,17 @@ static inline int action(const char *str)
 	exit(1);
 }
 
-__attribute__((cold)) static int compare_analyze_actions_desc(const void *a, const void *b)
+__attribute__((cold)) static int compare_analyze_actions_asc(const void *a, const void *b)
 {
-	return ((struct AnalyzePlanAction *) b)->level - ((struct AnalyzePlanAction *) a)->level;
+	long x = ((struct AnalyzePlanAction *) a)->level, y = ((struct AnalyzePlanAction *) b)->level;
+	return x < y ? -1 : (x > y ? 1 : 0);
 }
 __attribute__((cold)) static int compare_analyze_intervals_asc(const void *a, const void *b)
 {
-	return ((struct AnalyzePlanInterval *) a)->seconds - ((struct AnalyzePlanInterval *) b)->seconds;
+	const struct AnalyzePlanInterval *x = a, *y = b;
+	if(x->seconds != y->seconds)
+		return x->seconds - y->seconds;
+	return x->prefix - y->prefix;
 }
 
 
@@ -120,8 +128,8 @@ void ReadConfiguration(const char *filename)
 	pcre_extra *cfg_extra;
 	const char **listptr;
 	int err, matched;
-	int ovector[24]; /* (7 subexpressions + 1 whole expression) multiplied by 3, as needed for pcre_exec */
-	const char CONFIG_REGEX[] = "^USED\\s+([0-9]+)([KMG]?)\\s+IN\\s+([0-9]+)([dhms]?)\\s*=\\s*(LIMIT|LOG|JAIL|BLOCK)\\s*(?:([0-9]+)([km]?)|)\\s*$";
+	int ovector[27]; /* (8 subexpressions + 1 whole expression) multiplied by 3, as needed for pcre_exec */
+	const char CONFIG_REGEX[] = "^USED\\s+([0-9]+)([KMG]?)\\s+IN\\s+([0-9]+)([wdhms]?)\\s*(?:PER\\s+/([0-9]+)\\s*|)=\\s*(LIMIT|LOG|JAIL|BLOCK)\\s*(?:([0-9]+)([km]?)|)\\s*$";
 	const int LIMITTRAF_TRIGGERS_MAX = 200;
 	struct CfgTrigger *triggers;
 	const char *error; int erroffset;
@@ -179,7 +187,7 @@ void ReadConfiguration(const char *filename)
 		if(buffer[0] == '\0') /* comment only */
 			continue;
 			
-		matched = pcre_exec(cfg_regex, cfg_extra, buffer, len, 0, 0, ovector, 24);
+		matched = pcre_exec(cfg_regex, cfg_extra, buffer, len, 0, 0, ovector, 27);
 		if(matched < 0)
 		{
 			if(matched == PCRE_ERROR_NOMATCH)
@@ -188,7 +196,7 @@ void ReadConfiguration(const char *filename)
 				fprintf(stderr, "pcre_exec() returned %i on [[%s]]\n", matched, buffer);
 			continue;
 		}
-		if(matched < 5)
+		if(matched < 7)
 		{
 			fprintf(stderr, "%s:%i: syntax error: %s\n", filename, lineno, buffer);
 			exit(1);
@@ -210,12 +218,19 @@ void ReadConfiguration(const char *filename)
 		
 		triggers[trigger_idx].limit_interval = atoi(listptr[3]) * time_prefix(listptr[4]);
 		triggers[trigger_idx].limit_used = atoi(listptr[1]) * size_prefix(listptr[2]);
-		triggers[trigger_idx].action = action(listptr[5]);
+		triggers[trigger_idx].action = action(listptr[6]);
+
+		triggers[trigger_idx].prefix = atoi(listptr[5]); /* "" if there's no PER */
+		if(*listptr[5] && (triggers[trigger_idx].prefix < 1 || triggers[trigger_idx].prefix > 32))
+		{
+			fprintf(stderr, "%s:%i: PER /%s: the prefix must be from /1 to /32\n", filename, lineno, listptr[5]);
+			exit(1);
+		}
 		
 		if(triggers[trigger_idx].action == LIMITTRAF_ACTION_LIMIT)
 		{
 			PLAN_limit_triggers_count ++;
-			triggers[trigger_idx].bandwidth_limit = atoi(listptr[6]) * size_prefix(listptr[7]);
+			triggers[trigger_idx].bandwidth_limit = atoi(listptr[7]) * size_prefix(listptr[8]);
 		}
 		else triggers[trigger_idx].bandwidth_limit = 0;
 		
@@ -260,7 +275,7 @@ void ReadConfiguration(const char *filename)
 		int already_counted = -1;
 		for(j = 0; j < PLAN.count; j ++)
 		{
-			if(triggers[i].limit_interval == PLAN.intervals[j].seconds)
+			if(triggers[i].limit_interval == PLAN.intervals[j].seconds && triggers[i].prefix == PLAN.intervals[j].prefix)
 			{
 				already_counted = j;
 				break;
@@ -270,6 +285,7 @@ void ReadConfiguration(const char *filename)
 		if(already_counted == -1)
 		{
 			PLAN.intervals[PLAN.count].seconds = triggers[i].limit_interval;
+			PLAN.intervals[PLAN.count].prefix = triggers[i].prefix;
 			PLAN.intervals[PLAN.count].count = 1;
 			PLAN.count ++;
 		}
@@ -304,7 +320,7 @@ void ReadConfiguration(const char *filename)
 		
 		for(i = 0; i < trigger_idx; i ++)
 		{
-			if(PLAN.intervals[j].seconds == triggers[i].limit_interval)
+			if(PLAN.intervals[j].seconds == triggers[i].limit_interval && PLAN.intervals[j].prefix == triggers[i].prefix)
 			{
 				PLAN.intervals[j].actions[action_idx].level = triggers[i].limit_used;
 				PLAN.intervals[j].actions[action_idx].type = triggers[i].action;
@@ -313,22 +329,21 @@ void ReadConfiguration(const char *filename)
 			}
 		}
 		
-		qsort(PLAN.intervals[j].actions, action_idx, sizeof(struct AnalyzePlanAction), compare_analyze_actions_desc);
+		qsort(PLAN.intervals[j].actions, action_idx, sizeof(struct AnalyzePlanAction), compare_analyze_actions_asc);
 	}
 
 	/*
 		4. Sort the intervals, from smaller to bigger.
-		(for further I/O optimization: e.g. when Analyze checks the rule for 15M first
-		and for 360M after that, data on those 15M is probably still in the disc cache;
-		on the other hand, if we read 360M first, OS could unload it from memory prematurely.)
+		WindowAdvance() relies on this: it sums the buckets of a tier from the newest one back
+		and takes the sum of each interval on the way, so the shorter ones must come first.
 	*/
 	qsort(PLAN.intervals, PLAN.count, sizeof(struct AnalyzePlanInterval), compare_analyze_intervals_asc);
 
 #if 1
 	for(j = 0; j < PLAN.count; j ++)
 	{
-		fprintf(stderr, "DEBUG: interval = %i seconds, %i actions\n",
-			PLAN.intervals[j].seconds, PLAN.intervals[j].count);
+		fprintf(stderr, "DEBUG: interval = %i seconds, prefix = %i, %i actions\n",
+			PLAN.intervals[j].seconds, PLAN.intervals[j].prefix, PLAN.intervals[j].count);
 		for(i = 0; i < PLAN.intervals[j].count; i ++)
 			fprintf(stderr, "DEBUG:     level = %li bytes, action = %i, bandwidth_limit = %i\n",
 				PLAN.intervals[j].actions[i].level,
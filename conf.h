@@ -33,6 +33,7 @@ struct AnalyzePlan /* parsed configuration, as optimized for Analyze() call */
 struct AnalyzePlanInterval
 {
 	int seconds; /* = limit_interval from CfgTrigger */
+	int prefix; /* = prefix from CfgTrigger */
 	
 	int count;
 	struct AnalyzePlanAction *actions;
@@ -0,0 +1,435 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <endian.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/netlink.h>
+#include <linux/netfilter/nfnetlink.h>
+#include <linux/netfilter/nfnetlink_conntrack.h>
+
+#include "limittraf.h"
+#include "capture.h"
+#include "conntrack.h"
+
+/*
+	The kernel only includes counters into destroy events (not into update events),
+	so the bytes of long downloads are obtained by periodic dumps of the whole table.
+	For each flow we remember the counters at the previous dump and pass the difference
+	to HandleTraffic(). The client is the source of the original direction,
+	and its traffic is the reply direction (e.g. server:80 -> client).
+*/
+static const char CONNTRACK_ACCT_SYSCTL[] = "/proc/sys/net/netfilter/nf_conntrack_acct";
+static const int CONNTRACK_EVENTS_BUFFER = 8 * 1024 * 1024; /* kernel buffer for destroy events */
+static const unsigned int CONNTRACK_MIN_BITS = 16;
+static const unsigned int CONNTRACK_STALE_DUMPS = 2; /* flows missing in this many dumps are forgotten */
+
+struct ConntrackFlow
+{
+	struct IpAddr ip; /* client; :: = empty slot */
+	uint32_t id; /* CTA_ID */
+	uint64_t bytes; /* reply-direction counters at the previous dump */
+	uint64_t packets;
+	unsigned int stale; /* number of dumps this flow was missing from */
+	unsigned int seen; /* found in the current dump */
+};
+struct ConntrackTable
+{
+	struct ConntrackFlow *flows; /* open addressing with linear probing */
+	unsigned int bits;
+	unsigned int used;
+};
+
+static int conntrack_events_fd = -1, conntrack_dump_fd = -1;
+static unsigned int conntrack_port; /* CaptureSourcePort() */
+static struct ConntrackTable conntrack_flows[2]; /* [0] = flows of the previous dump, [1] = being built by the current dump */
+static int conntrack_dumping = 0; /* messages come from the dump, not from events */
+static int conntrack_baseline = 0; /* first dump: remember the counters, don't count them */
+static uint32_t conntrack_seq = 0;
+static char conntrack_buffer[1 << 16];
+static unsigned long conntrack_events_lost = 0; /* ENOBUFS on the events socket */
+
+static void ConntrackTableAllocate(struct ConntrackTable *table, unsigned int bits)
+{
+	table->bits = bits;
+	table->used = 0;
+	table->flows = calloc((size_t) 1 << bits, sizeof(struct ConntrackFlow));
+	if(!table->flows)
+	{
+		fprintf(stderr, "calloc() for conntrack table (%u flows) failed: %s\n", 1U << bits, strerror(errno));
+		exit(1);
+	}
+}
+
+static struct ConntrackFlow *ConntrackFind(struct ConntrackTable *table, uint32_t id)
+{
+	unsigned int mask = (1U << table->bits) - 1;
+	unsigned int i = (id * 2654435761U) >> (32 - table->bits);
+
+	for(; !IpAddrIsEmpty(&table->flows[i].ip); i = (i + 1) & mask)
+		if(table->flows[i].id == id)
+			return &table->flows[i];
+	return NULL;
+}
+
+static struct ConntrackFlow *ConntrackInsert(struct ConntrackTable *table, uint32_t id, const struct IpAddr *ip)
+{
+	struct ConntrackTable old;
+	unsigned int mask, i, j;
+	struct ConntrackFlow *flow;
+
+	if(table->used * 4 >= (1U << table->bits) * 3) /* 75% full */
+	{
+		old = *table;
+		ConntrackTableAllocate(table, old.bits + 1);
+		for(j = 0; j < (1U << old.bits); j ++)
+		{
+			if(IpAddrIsEmpty(&old.flows[j].ip)) continue;
+			flow = ConntrackInsert(table, old.flows[j].id, &old.flows[j].ip);
+			*flow = old.flows[j];
+		}
+		free(old.flows);
+	}
+
+	mask = (1U << table->bits) - 1;
+	for(i = (id * 2654435761U) >> (32 - table->bits); !IpAddrIsEmpty(&table->flows[i].ip); i = (i + 1) & mask);
+
+	flow = &table->flows[i];
+	memset(flow, 0, sizeof(*flow));
+	flow->id = id;
+	flow->ip = *ip;
+	table->used ++;
+	return flow;
+}
+
+/*
+	Split the attributes of the netlink message into tb[type].
+*/
+static void ConntrackParse(struct nlattr **tb, int max, void *data, int len)
+{
+	struct nlattr *attr;
+	int type;
+
+	memset(tb, 0, sizeof(struct nlattr *) * (max + 1));
+	for(attr = data; len >= NLA_HDRLEN && attr->nla_len >= NLA_HDRLEN && attr->nla_len <= len;
+		len -= NLA_ALIGN(attr->nla_len), attr = (struct nlattr *) ((char *) attr + NLA_ALIGN(attr->nla_len)))
+	{
+		type = attr->nla_type & NLA_TYPE_MASK;
+		if(type <= max)
+			tb[type] = attr;
+	}
+}
+#define ConntrackParseNested(tb, max, attr) ConntrackParse(tb, max, (char *) (attr) + NLA_HDRLEN, (attr)->nla_len - NLA_HDRLEN)
+#define NLA_PAYLOAD(attr) ((void *) ((char *) (attr) + NLA_HDRLEN))
+
+static inline uint64_t nla_be64(struct nlattr *attr)
+{
+	uint64_t value;
+	memcpy(&value, NLA_PAYLOAD(attr), sizeof(value));
+	return be64toh(value);
+}
+
+/*
+	One flow from the dump (IPCTNL_MSG_CT_NEW) or from a destroy event (IPCTNL_MSG_CT_DELETE).
+*/
+__attribute__((hot)) static void ConntrackFlow(struct nlmsghdr *nlh)
+{
+	struct nfgenmsg *g = NLMSG_DATA(nlh);
+	struct nlattr *tb[CTA_MAX + 1], *tuple[CTA_TUPLE_MAX + 1], *ip[CTA_IP_MAX + 1], *proto[CTA_PROTO_MAX + 1], *counters[CTA_COUNTERS_MAX + 1];
+	struct ConntrackFlow *flow;
+	struct IpAddr client;
+	uint32_t id;
+	uint64_t bytes, packets, prev_bytes = 0, prev_packets = 0;
+	uint8_t protonum;
+	int destroy = NFNL_MSG_TYPE(nlh->nlmsg_type) == IPCTNL_MSG_CT_DELETE;
+
+	if(g->nfgen_family != AF_INET && g->nfgen_family != AF_INET6)
+		return;
+
+	ConntrackParse(tb, CTA_MAX, (char *) g + NLMSG_ALIGN(sizeof(*g)), nlh->nlmsg_len - NLMSG_SPACE(sizeof(*g)));
+	if(!tb[CTA_ID] || !tb[CTA_TUPLE_ORIG] || !tb[CTA_COUNTERS_REPLY])
+		return; /* e.g. nf_conntrack_acct was off when this flow was created */
+
+	ConntrackParseNested(tuple, CTA_TUPLE_MAX, tb[CTA_TUPLE_ORIG]);
+	if(!tuple[CTA_TUPLE_IP] || !tuple[CTA_TUPLE_PROTO])
+		return;
+	ConntrackParseNested(ip, CTA_IP_MAX, tuple[CTA_TUPLE_IP]);
+	if(ip[CTA_IP_V4_SRC])
+		IpAddrFromIpv4Bytes(&client, NLA_PAYLOAD(ip[CTA_IP_V4_SRC]));
+	else if(ip[CTA_IP_V6_SRC])
+		memcpy(client.addr, NLA_PAYLOAD(ip[CTA_IP_V6_SRC]), 16);
+	else
+		return;
+
+	if(conntrack_port)
+	{
+		ConntrackParseNested(proto, CTA_PROTO_MAX, tuple[CTA_TUPLE_PROTO]);
+		if(!proto[CTA_PROTO_NUM] || !proto[CTA_PROTO_DST_PORT])
+			return;
+		protonum = *(uint8_t *) NLA_PAYLOAD(proto[CTA_PROTO_NUM]);
+		if(protonum != IPPROTO_TCP && protonum != IPPROTO_UDP)
+			return;
+		if(ntohs(*(uint16_t *) NLA_PAYLOAD(proto[CTA_PROTO_DST_PORT])) != conntrack_port)
+			return;
+	}
+
+	ConntrackParseNested(counters, CTA_COUNTERS_MAX, tb[CTA_COUNTERS_REPLY]);
+	if(!counters[CTA_COUNTERS_BYTES] || !counters[CTA_COUNTERS_PACKETS])
+		return;
+	bytes = nla_be64(counters[CTA_COUNTERS_BYTES]);
+	packets = nla_be64(counters[CTA_COUNTERS_PACKETS]);
+	id = ntohl(*(uint32_t *) NLA_PAYLOAD(tb[CTA_ID]));
+
+	/* Counters at the previous dump (a flow unknown to it is newer than that dump) */
+	flow = ConntrackFind(&conntrack_flows[0], id);
+	if(flow)
+	{
+		prev_bytes = flow->bytes;
+		prev_packets = flow->packets;
+		flow->seen = 1;
+	}
+
+	if(bytes < prev_bytes) /* same CTA_ID reused by a new flow */
+		prev_bytes = prev_packets = 0;
+
+	if(bytes > prev_bytes && !conntrack_baseline)
+		HandleTraffic(&client, bytes - prev_bytes, packets - prev_packets);
+
+	if(conntrack_dumping)
+	{
+		flow = ConntrackInsert(&conntrack_flows[1], id, &client);
+		flow->bytes = bytes;
+		flow->packets = packets;
+	}
+	else if(destroy && flow)
+	{
+		/* Closed: an older dump may still be reporting it, don't count it twice */
+		flow->bytes = bytes;
+		flow->packets = packets;
+	}
+}
+
+/*
+	Read netlink messages from 'fd' until there are no more (events)
+	or until NLMSG_DONE (dump). Returns 0 when the dump is complete.
+*/
+__attribute__((hot)) static int ConntrackReceive(int fd, int flags)
+{
+	struct nlmsghdr *nlh;
+	ssize_t len;
+	struct nlmsgerr *err;
+
+	while(1)
+	{
+		len = recv(fd, conntrack_buffer, sizeof(conntrack_buffer), flags);
+		if(len < 0)
+		{
+			if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+				return 1;
+			if(errno == ENOBUFS)
+			{
+				/* Some destroy events are lost: the final bytes of those flows won't be counted */
+				conntrack_events_lost ++;
+				fprintf(stderr, "WARNING: conntrack events lost (ENOBUFS, %lu times so far)\n", conntrack_events_lost);
+				continue;
+			}
+			fprintf(stderr, "recv() from conntrack netlink socket failed: %s\n", strerror(errno));
+			exit(1);
+		}
+
+		for(nlh = (struct nlmsghdr *) conntrack_buffer; NLMSG_OK(nlh, len); nlh = NLMSG_NEXT(nlh, len))
+		{
+			if(nlh->nlmsg_type == NLMSG_DONE)
+				return 0;
+			if(nlh->nlmsg_type == NLMSG_ERROR)
+			{
+				err = NLMSG_DATA(nlh);
+				if(err->error == 0) continue;
+				fprintf(stderr, "conntrack dump failed: %s\n", strerror(-err->error));
+				exit(1);
+			}
+			if(NFNL_SUBSYS_ID(nlh->nlmsg_type) == NFNL_SUBSYS_CTNETLINK)
+				ConntrackFlow(nlh);
+		}
+	}
+}
+
+/*
+	Dump all flows: counts the traffic since the previous dump
+	and replaces conntrack_flows[0] with the current set of flows.
+	If 'count' is 0 (first dump), the counters are only remembered:
+	the traffic before the start of limittraf isn't ours to count.
+*/
+static void ConntrackDump(int count)
+{
+	struct
+	{
+		struct nlmsghdr nlh;
+		struct nfgenmsg g;
+	} request;
+	struct ConntrackTable *prev = &conntrack_flows[0], *cur = &conntrack_flows[1];
+	struct ConntrackFlow *flow;
+	unsigned int i, bits;
+
+	for(bits = CONNTRACK_MIN_BITS; (1U << bits) < prev->used * 2; bits ++);
+	ConntrackTableAllocate(cur, bits);
+
+	memset(&request, 0, sizeof(request));
+	request.nlh.nlmsg_len = sizeof(request);
+	request.nlh.nlmsg_type = (NFNL_SUBSYS_CTNETLINK << 8) | IPCTNL_MSG_CT_GET;
+	request.nlh.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+	request.nlh.nlmsg_seq = ++ conntrack_seq;
+	request.g.nfgen_family = AF_UNSPEC; /* both IPv4 and IPv6 */
+	request.g.version = NFNETLINK_V0;
+
+	if(send(conntrack_dump_fd, &request, sizeof(request), 0) < 0)
+	{
+		fprintf(stderr, "send() of conntrack dump request failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	conntrack_dumping = 1;
+	conntrack_baseline = !count;
+	while(ConntrackReceive(conntrack_dump_fd, 0) != 0);
+	conntrack_dumping = conntrack_baseline = 0;
+
+	/*
+		Flows which are absent from this dump are most likely closed,
+		but their destroy event may still be in the queue: keep them for a while.
+	*/
+	for(i = 0; i < (1U << prev->bits); i ++)
+	{
+		if(IpAddrIsEmpty(&prev->flows[i].ip) || prev->flows[i].seen) continue;
+		if(prev->flows[i].stale + 1 >= CONNTRACK_STALE_DUMPS) continue;
+
+		flow = ConntrackInsert(cur, prev->flows[i].id, &prev->flows[i].ip);
+		flow->bytes = prev->flows[i].bytes;
+		flow->packets = prev->flows[i].packets;
+		flow->stale = prev->flows[i].stale + 1;
+	}
+
+	free(prev->flows);
+	*prev = *cur;
+	memset(cur, 0, sizeof(*cur));
+}
+
+static int ConntrackSocket(unsigned int groups)
+{
+	struct sockaddr_nl addr;
+	int fd;
+
+	fd = socket(AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_NETFILTER);
+	if(fd < 0)
+	{
+		fprintf(stderr, "socket(AF_NETLINK, NETLINK_NETFILTER) failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.nl_family = AF_NETLINK;
+	addr.nl_groups = groups;
+	if(bind(fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "bind() of conntrack netlink socket failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	return fd;
+}
+
+__attribute__((cold)) void InitializeConntrack()
+{
+	FILE *f;
+	int acct = 0;
+
+	conntrack_port = CaptureSourcePort();
+
+	/* Flows created before this won't have counters */
+	f = fopen(CONNTRACK_ACCT_SYSCTL, "w");
+	if(f)
+	{
+		fputs("1\n", f);
+		fclose(f);
+	}
+	f = fopen(CONNTRACK_ACCT_SYSCTL, "r");
+	if(!f || fscanf(f, "%i", &acct) != 1 || !acct)
+		fprintf(stderr, "WARNING: %s is not enabled: conntrack won't count bytes.\n", CONNTRACK_ACCT_SYSCTL);
+	if(f) fclose(f);
+
+	conntrack_events_fd = ConntrackSocket(1 << (NFNLGRP_CONNTRACK_DESTROY - 1));
+	if(setsockopt(conntrack_events_fd, SOL_SOCKET, SO_RCVBUFFORCE, &CONNTRACK_EVENTS_BUFFER, sizeof(int)) < 0)
+		setsockopt(conntrack_events_fd, SOL_SOCKET, SO_RCVBUF, &CONNTRACK_EVENTS_BUFFER, sizeof(int));
+
+	conntrack_dump_fd = ConntrackSocket(0);
+
+	ConntrackTableAllocate(&conntrack_flows[0], CONNTRACK_MIN_BITS);
+	ConntrackDump(0);
+
+	fprintf(stderr, "Counting traffic of %u conntrack flows (filter: %s)\n", conntrack_flows[0].used, ltTcpDumpOptions);
+}
+
+__attribute__((cold)) void TerminateConntrack()
+{
+	if(conntrack_events_fd == -1)
+		return;
+
+	close(conntrack_events_fd);
+	close(conntrack_dump_fd);
+	conntrack_events_fd = conntrack_dump_fd = -1;
+
+	free(conntrack_flows[0].flows);
+	free(conntrack_flows[1].flows);
+	memset(conntrack_flows, 0, sizeof(conntrack_flows));
+}
+
+unsigned long ConntrackEventsLost()
+{
+	return conntrack_events_lost; /* same thread as CaptureLoopConntrack() */
+}
+
+__attribute__((hot)) void CaptureLoopConntrack()
+{
+	struct pollfd pfd;
+	time_t next_dump;
+
+	time(&TIME);
+	next_dump = TIME + ltConntrackDumpInterval;
+
+	while(1)
+	{
+		pfd.fd = conntrack_events_fd;
+		pfd.events = POLLIN;
+		if(poll(&pfd, 1, 1000) > 0)
+			ConntrackReceive(conntrack_events_fd, MSG_DONTWAIT);
+
+		time(&TIME);
+		if(TIME >= next_dump)
+		{
+			ConntrackReceive(conntrack_events_fd, MSG_DONTWAIT); /* destroy events before the dump */
+			ConntrackDump(1);
+			next_dump = TIME + ltConntrackDumpInterval;
+		}
+
+		AnalyzeIfDue();
+	}
+}
@@ -0,0 +1,33 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_CONNTRACK_H
+#define _LIMITTRAF_CONNTRACK_H
+
+/*
+	LIMITTRAF_CAPTURE_CONNTRACK: no packets are captured, the byte counters
+	of netfilter connection tracking (nf_conntrack_acct) are used instead.
+	The table of flows is dumped every ltConntrackDumpInterval seconds,
+	and destroy events provide the final counters of closed flows.
+	Used by capture.c, see InitializeCapture() and CaptureLoop().
+*/
+void InitializeConntrack();
+void TerminateConntrack();
+void CaptureLoopConntrack();
+
+/* Number of overflows (ENOBUFS) of the events socket, see CaptureStatistics() */
+unsigned long ConntrackEventsLost();
+
+#endif
@@ -16,19 +16,79 @@
 #include <sqlite3.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <arpa/inet.h>
 
 #include "limittraf.h"
 #include "database.h"
 #include "conf.h"
 #include "actions.h"
+#include "aggregate.h"
+#include "window.h"
+#include "archive.h"
+#include "writer.h"
+#include "sketch.h"
+#include "pool.h"
+#include "threshold.h"
 
 sqlite3 *dbh; /* in-memory database */
-sqlite3_stmt *sth_register;
-sqlite3_stmt *sth_analyze_range;
 sqlite3_stmt *sth_legsearch_get, *sth_legsearch_set, *sth_legsearch_deprecate_all;
-sqlite3_stmt *sth_insert_compact_db, *sth_clean_inmemory_packet_db;
 sqlite3_stmt *sth_legsearch_clean, *sth_legsearch_save;
 char *sql_error; int ret;
+static int legsearch_changed = 0; /* LegSearch_Set() was called since the last LegSearch_Save() */
+
+/*
+	Traffic since the last CompactDb(): Register() adds packets here
+	instead of inserting them into SQLite one by one.
+*/
+static struct Aggregate aggregate;
+
+/*
+	Traffic in the PLAN intervals, used by AnalyzeDb(): windows[0] of each client,
+	then one window for each prefix length of the "PER /prefix" rules, of each subnet.
+*/
+static struct Window *windows;
+static unsigned int windows_count;
+static struct SlabBudget windows_budget; /* ltWindowMemory, shared by all windows */
+
+/*
+	thresholds[i]: levels of PLAN.intervals[i] for ThresholdCrossed(). AnalyzeDb() acts on a client
+	which is above the lowest level, then takes the action of the highest level it has reached.
+*/
+static int64_t **thresholds;
+
+/* CheckLevels(): sums of one client before WindowAdvance(), as many as the intervals of the biggest window */
+static uint64_t *levels_before;
+
+/* Instead of 'windows' if ltSketchMemory is set: estimates in fixed memory, see sketch.h */
+static struct Sketch sketch;
+
+/*
+	Client addresses are stored in the database as INTEGER (IPv4, host byte order)
+	or as 16-byte BLOB (IPv6), see BindIp() and ColumnIp().
+	The columns are declared as BLOB, because that affinity stores both as is.
+*/
+static const int DB_SCHEMA_VERSION = 3; /* PRAGMA ondisc.user_version; 0 = addresses as dotted-quad TEXT, 1 = one 'packet' table, 2 = hourly 'packet_H' tables */
+
+static inline int BindIp(sqlite3_stmt *sth, int idx, const struct IpAddr *ip)
+{
+	if(IpAddrIsIpv4(ip))
+		return sqlite3_bind_int64(sth, idx, IpAddrIpv4(ip));
+	return sqlite3_bind_blob(sth, idx, ip->addr, 16, SQLITE_STATIC);
+}
+
+static inline void ColumnIp(sqlite3_stmt *sth, int col, struct IpAddr *ip)
+{
+	if(sqlite3_column_type(sth, col) == SQLITE_BLOB && sqlite3_column_bytes(sth, col) == 16)
+		memcpy(ip->addr, sqlite3_column_blob(sth, col), 16);
+	else
+		IpAddrFromIpv4(ip, sqlite3_column_int64(sth, col));
+}
 
 __attribute__((hot)) void CommitTransaction()
 {
@@ -41,24 +101,94 @@ __attribute__((hot)) void BeginTransaction()
 
 __attribute__((hot)) uint64_t DbMemoryUsed()
 {
-	return sqlite3_memory_used();
+	return sqlite3_memory_used() + AggregateMemoryUsed(&aggregate);
+}
+
+/* Seconds covered by the longest interval of all windows */
+static time_t WindowsSpan()
+{
+	time_t span = 0;
+	unsigned int w;
+
+	for(w = 0; w < windows_count; w ++)
+		if(windows[w].span > span)
+			span = windows[w].span;
+	return span;
+}
+
+static void CheckLevels(struct Window *win, unsigned int i);
+
+/* The packet path of CheckLevels(): most packets only reduce the slack */
+static inline void CheckSlack(struct Window *win, int i, uint64_t bytes)
+{
+	struct WindowEntry *e;
+
+	if(i < 0)
+		return;
+	e = WindowEntryOf(win, i);
+	if(bytes < e->slack)
+		e->slack -= bytes;
+	else
+		CheckLevels(win, i);
+}
+
+/*
+	Account 'bytes' of 'ip' in all windows: the client and its subnets.
+	If 'immediate' is set (packets of Register(), not the history), the levels are checked right away.
+*/
+static inline void WindowsAdd(const struct IpAddr *ip, time_t time, uint64_t bytes, int immediate)
+{
+	struct IpAddr subnet;
+	unsigned int w;
+	int i;
+
+	if(windows[0].intervals)
+	{
+		i = WindowAdd(&windows[0], ip, time, bytes);
+		if(immediate)
+			CheckSlack(&windows[0], i, bytes);
+	}
+	for(w = 1; w < windows_count; w ++)
+	{
+		IpAddrSubnet(&subnet, ip, windows[w].prefix);
+		if(IpAddrIsEmpty(&subnet))
+			continue;
+
+		i = WindowAdd(&windows[w], &subnet, time, bytes);
+		if(immediate)
+			CheckSlack(&windows[w], i, bytes);
+	}
+}
+
+/*
+	Delete the hours of the archive which are completely older than the retention horizon:
+	ltHistoryRetention seconds before TIME or, if it's 0, the longest PLAN interval.
+*/
+static void ExpireHistory()
+{
+	time_t retention = ltHistoryRetention ? (time_t) ltHistoryRetention : WindowsSpan();
+	ArchiveExpire(TIME - retention);
+}
+
+/* AggregateFlush() callback: one record of the archive */
+static void InsertCompacted(time_t bucket, const struct IpAddr *ip, uint64_t bytes)
+{
+	ArchiveAppend(bucket, ip, bytes);
 }
 
 __attribute__((hot)) void CompactDb()
 {
-	ret = sqlite3_step(sth_insert_compact_db);
-	sqlite3_reset(sth_insert_compact_db);
-	if(ret != SQLITE_DONE)
-		fprintf(stderr, "sqlite3_step(sth_insert_compact_db) failed at %s:%i: error %i: %s\n", __FILE__, __LINE__, ret, sqlite3_errmsg(dbh));
-	
-	ret = sqlite3_step(sth_clean_inmemory_packet_db);
-	sqlite3_reset(sth_clean_inmemory_packet_db);
-	if(ret != SQLITE_DONE)
-		fprintf(stderr, "sqlite3_step(sth_clean_inmemory_packet_db) failed at %s:%i: error %i: %s\n", __FILE__, __LINE__, ret, sqlite3_errmsg(dbh));
+	AggregateFlush(&aggregate, InsertCompacted);
+	ArchiveFlush(0);
+	ExpireHistory();
 }
 
 __attribute__((hot)) void LegSearch_Save()
 {
+	if(!legsearch_changed)
+		return;
+	legsearch_changed = 0;
+
 	/*
 		NOTE: sth_legsearch_clean and sth_legsearch_save must form a transaction
 		(so that if application is killed by a signal or power failure, the data
@@ -79,11 +209,11 @@ __attribute__((hot)) void LegSearch_Save()
 	sqlite3_exec(dbh, "END TRANSACTION", NULL, NULL, NULL);
 }
 
-int LegSearch_Get(const char *ip)
+int LegSearch_Get(const struct IpAddr *ip)
 {
 	int value;
 	
-	sqlite3_bind_text(sth_legsearch_get, 1, ip, -1, SQLITE_STATIC);
+	BindIp(sth_legsearch_get, 1, ip);
 	ret = sqlite3_step(sth_legsearch_get);
 	value = sqlite3_column_int(sth_legsearch_get, 0);
 	sqlite3_reset(sth_legsearch_get);
@@ -96,27 +226,495 @@ int LegSearch_Get(const char *ip)
 	return -1;
 }
 
-void LegSearch_Set(const char *ip, int value)
+void LegSearch_Set(const struct IpAddr *ip, int value)
 {
-	sqlite3_bind_text(sth_legsearch_set, 1, ip, -1, SQLITE_STATIC);
+	BindIp(sth_legsearch_set, 1, ip);
 	sqlite3_bind_int(sth_legsearch_set, 2, value);
 	sqlite3_bind_int(sth_legsearch_set, 3, TIME);
 	ret = sqlite3_step(sth_legsearch_set);
 	sqlite3_reset(sth_legsearch_set);
+	legsearch_changed = 1;
 	
 	if(ret != SQLITE_DONE)
 		fprintf(stderr, "sqlite3_step(sth_legsearch_set) failed at %s:%i: error %i: %s\n", __FILE__, __LINE__, ret, sqlite3_errmsg(dbh));
 }
 
-__attribute__((hot)) void Register(const char *ip, unsigned int length)
+__attribute__((hot)) void Register(const struct IpAddr *ip, uint64_t length)
 {
-	sqlite3_bind_int(sth_register, 1, TIME);
-	sqlite3_bind_text(sth_register, 2, ip, -1, SQLITE_STATIC);
-	sqlite3_bind_int(sth_register, 3, length);
-	ret = sqlite3_step(sth_register);
-	sqlite3_reset(sth_register);
-	if(ret != SQLITE_DONE)
-		fprintf(stderr, "sqlite3_step(sth_register) failed at %s:%i: error %i: %s\n", __FILE__, __LINE__, ret, sqlite3_errmsg(dbh));
+	time_t bucket = AggregateBucket(TIME);
+	unsigned int slot = AggregateSlot(bucket);
+
+	if(aggregate.slot_time[slot] != bucket)
+	{
+		/*
+			The slot still holds an older (or, if TIME went back, a newer) bucket:
+			write everything to the archive and start over.
+		*/
+		if(aggregate.slot_time[slot])
+			AggregateFlush(&aggregate, InsertCompacted);
+		aggregate.slot_time[slot] = bucket;
+	}
+
+	AggregateAdd(&aggregate, ip, slot, length);
+	if(ltSketchMemory)
+		SketchAdd(&sketch, ip, TIME, length);
+	else
+		WindowsAdd(ip, TIME, length, ltImmediateTriggers);
+}
+
+/*
+	ip_pack(text) - SQL function used by UpgradeDb():
+	returns the value which BindIp() would store for this address (NULL if it's not an address).
+*/
+__attribute__((cold)) static void sql_ip_pack(sqlite3_context *ctx, int argc, sqlite3_value **argv)
+{
+	const char *text = (const char *) sqlite3_value_text(argv[0]);
+	struct in_addr addr;
+	struct in6_addr addr6;
+	(void) argc;
+
+	if(text && inet_pton(AF_INET, text, &addr) == 1)
+		sqlite3_result_int64(ctx, ntohl(addr.s_addr));
+	else if(text && inet_pton(AF_INET6, text, &addr6) == 1)
+		sqlite3_result_blob(ctx, &addr6, 16, SQLITE_TRANSIENT);
+	else
+		sqlite3_result_null(ctx);
+}
+
+/*
+	Version 1, 2 -> 3: move the rows of ondisc.packet (version 1) or ondisc.packet_H
+	(hourly tables of version 2) into the archive, then drop them.
+*/
+__attribute__((cold)) static void MoveToArchive()
+{
+	sqlite3_stmt *sth, *sth_rows;
+	struct IpAddr ip;
+	char table[64], query[256];
+	uint64_t rows = 0;
+
+	while(1)
+	{
+		ret = sqlite3_prepare_v2(dbh, "SELECT name FROM ondisc.sqlite_master WHERE type = 'table' AND (name = 'packet' OR name GLOB 'packet_[0-9]*') LIMIT 1", -1, &sth, NULL);
+		if(ret != SQLITE_OK || sqlite3_step(sth) != SQLITE_ROW)
+		{
+			sqlite3_finalize(sth);
+			break;
+		}
+		snprintf(table, sizeof(table), "%s", (const char *) sqlite3_column_text(sth, 0));
+		sqlite3_finalize(sth);
+
+		if(!rows)
+			fprintf(stderr, "Moving the traffic history from %s into %s/...\n", ltDbFile, ltArchiveDir);
+
+		snprintf(query, sizeof(query), "SELECT p_time, p_ip, p_len FROM ondisc.%s ORDER BY p_time", table);
+		ret = sqlite3_prepare_v2(dbh, query, -1, &sth_rows, NULL);
+		if(ret != SQLITE_OK)
+		{
+			fprintf(stderr, "Failed to compile SELECT query for 'ondisc.%s': error %i: %s\n", table, ret, sqlite3_errmsg(dbh));
+			exit(1);
+		}
+		while((ret = sqlite3_step(sth_rows)) == SQLITE_ROW)
+		{
+			ColumnIp(sth_rows, 1, &ip);
+			ArchiveAppend(sqlite3_column_int64(sth_rows, 0), &ip, sqlite3_column_int64(sth_rows, 2));
+			ArchiveFlush(0);
+			rows ++;
+		}
+		sqlite3_finalize(sth_rows);
+		if(ret != SQLITE_DONE)
+		{
+			fprintf(stderr, "sqlite3_step() on 'ondisc.%s' failed at %s:%i: error %i: %s\n", table, __FILE__, __LINE__, ret, sqlite3_errmsg(dbh));
+			exit(1);
+		}
+		ArchiveFlush(1);
+
+		/* The rows are in the archive: the table can go */
+		snprintf(query, sizeof(query), "DROP TABLE ondisc.%s", table);
+		if(sqlite3_exec(dbh, query, NULL, NULL, &sql_error) != SQLITE_OK)
+		{
+			fprintf(stderr, "Failed to drop SQLite table '%s': %s\n", table, sql_error);
+			exit(1);
+		}
+	}
+
+	if(rows)
+	{
+		fprintf(stderr, "Moved %llu rows, compacting %s...\n", (unsigned long long) rows, ltDbFile);
+		sqlite3_exec(dbh, "VACUUM ondisc", NULL, NULL, NULL);
+	}
+}
+
+/*
+	Convert the on-disc database of an older version (if any) to DB_SCHEMA_VERSION.
+	Must be called after ATTACH and before the tables are created.
+*/
+__attribute__((cold)) static void UpgradeDb()
+{
+	sqlite3_stmt *sth;
+	int version = 0, tables = 0;
+	char query[128];
+
+	ret = sqlite3_prepare_v2(dbh, "PRAGMA ondisc.user_version", -1, &sth, NULL);
+	if(ret == SQLITE_OK && sqlite3_step(sth) == SQLITE_ROW)
+		version = sqlite3_column_int(sth, 0);
+	sqlite3_finalize(sth);
+
+	if(version >= DB_SCHEMA_VERSION)
+		return;
+
+	ret = sqlite3_prepare_v2(dbh, "SELECT COUNT(*) FROM ondisc.sqlite_master WHERE type = 'table' AND name IN ('packet', 'legsearch')", -1, &sth, NULL);
+	if(ret == SQLITE_OK && sqlite3_step(sth) == SQLITE_ROW)
+		tables = sqlite3_column_int(sth, 0);
+	sqlite3_finalize(sth);
+
+	if(tables > 0 && version < 1)
+	{
+		fprintf(stderr, "Converting the addresses in %s from text to binary...\n", ltDbFile);
+
+		sqlite3_create_function(dbh, "ip_pack", 1, SQLITE_UTF8, NULL, sql_ip_pack, NULL, NULL);
+		ret = sqlite3_exec(dbh,
+			"BEGIN TRANSACTION;"
+			"CREATE TABLE IF NOT EXISTS ondisc.packet (p_time INTEGER, p_ip TEXT, p_len INTEGER);"
+			"CREATE TABLE IF NOT EXISTS ondisc.legsearch (ls_ip TEXT PRIMARY KEY, ls_is_search_engine BOOLEAN, ls_updated INTEGER);"
+			"ALTER TABLE ondisc.packet RENAME TO packet_text;"
+			"ALTER TABLE ondisc.legsearch RENAME TO legsearch_text;"
+			"CREATE TABLE ondisc.packet (p_time INTEGER, p_ip BLOB, p_len INTEGER);"
+			"CREATE TABLE ondisc.legsearch (ls_ip BLOB PRIMARY KEY, ls_is_search_engine BOOLEAN, ls_updated INTEGER);"
+			"INSERT INTO ondisc.packet (p_time, p_ip, p_len) SELECT p_time, ip_pack(p_ip), p_len FROM ondisc.packet_text WHERE ip_pack(p_ip) IS NOT NULL;"
+			"INSERT OR REPLACE INTO ondisc.legsearch (ls_ip, ls_is_search_engine, ls_updated) SELECT ip_pack(ls_ip), ls_is_search_engine, ls_updated FROM ondisc.legsearch_text WHERE ip_pack(ls_ip) IS NOT NULL;"
+			"DROP TABLE ondisc.packet_text;"
+			"DROP TABLE ondisc.legsearch_text;"
+			"COMMIT TRANSACTION",
+			NULL, NULL, &sql_error);
+		if(ret != SQLITE_OK)
+		{
+			fprintf(stderr, "Failed to convert %s to the new format: %s\n", ltDbFile, sql_error);
+			sqlite3_free(sql_error);
+			exit(1);
+		}
+	}
+
+
+	if(tables > 0 && version < 3)
+		MoveToArchive();
+
+	snprintf(query, sizeof(query), "PRAGMA ondisc.user_version = %i", DB_SCHEMA_VERSION);
+	sqlite3_exec(dbh, query, NULL, NULL, NULL);
+}
+
+/* ArchiveRead() callback of LoadWindow() */
+static void LoadWindowRecord(time_t time, const struct IpAddr *ip, uint64_t bytes, void *arg)
+{
+	(void) arg;
+	WindowsAdd(ip, time, bytes, 0);
+}
+
+/* ArchiveRead() callback of LoadWindow() in the approximate mode */
+static void LoadSketchRecord(time_t time, const struct IpAddr *ip, uint64_t bytes, void *arg)
+{
+	(void) arg;
+	SketchAdd(&sketch, ip, time, bytes);
+}
+
+/*
+	Snapshot: the state which would be lost by a restart, i.e. 'windows' and the records
+	which are not in the archive yet (ArchivePending()). Actions have no state of their own
+	(the 'tc' rules are recreated by InitializeActions()).
+	The file is: struct SnapshotHeader, WindowSave() of each window, then the pending records.
+*/
+#define SNAPSHOT_MAGIC 0x31534c54 /* "LTS1" */
+struct SnapshotHeader
+{
+	uint32_t magic;
+	uint32_t reserved;
+	int64_t time; /* TIME when the snapshot was made */
+	struct ArchiveMark mark; /* end of the archive at that moment */
+	uint64_t pending_count;
+};
+
+/* Writer job of SaveSnapshot(): 'data' is the whole file, except the mark */
+static void WriteSnapshot(void *data, size_t size)
+{
+	char tmp[4096];
+	FILE *f;
+	int failed;
+
+	/* The flushes queued before this job are written: the mark is right after them */
+	ArchiveGetMark(&((struct SnapshotHeader *) data)->mark);
+
+	/* Written into a temporary file, which then replaces the old snapshot: a snapshot is always complete */
+	snprintf(tmp, sizeof(tmp), "%s.tmp", ltSnapshotFile);
+	f = fopen(tmp, "wb");
+	if(!f)
+	{
+		fprintf(stderr, "fopen(%s) failed: %s\n", tmp, strerror(errno));
+		return;
+	}
+
+	failed = fwrite(data, size, 1, f) != 1
+		|| fflush(f) != 0
+		|| fsync(fileno(f)) < 0;
+	if(fclose(f) != 0 || failed)
+	{
+		fprintf(stderr, "Failed to write the snapshot into %s: %s\n", tmp, strerror(errno));
+		unlink(tmp);
+		return;
+	}
+
+	if(rename(tmp, ltSnapshotFile) < 0)
+	{
+		fprintf(stderr, "rename(%s, %s) failed: %s\n", tmp, ltSnapshotFile, strerror(errno));
+		unlink(tmp);
+	}
+}
+
+void SaveSnapshot()
+{
+	struct SnapshotHeader h;
+	const struct ArchiveRecord *records;
+	char *data = NULL;
+	size_t size = 0;
+	FILE *f;
+	unsigned int w;
+	int failed;
+
+	/*
+		The sketch is not saved: it's restored from the archive (see LoadWindow()).
+		Nor are the empty 'windows': the snapshot would hide the archive from the exact mode.
+	*/
+	if(ltSketchMemory)
+		return;
+
+	/* Here the state is only copied into memory, the writer thread does the rest */
+	f = open_memstream(&data, &size);
+	if(!f)
+	{
+		fprintf(stderr, "open_memstream() for the snapshot failed: %s\n", strerror(errno));
+		return;
+	}
+
+	memset(&h, 0, sizeof(h));
+	h.magic = SNAPSHOT_MAGIC;
+	h.time = TIME;
+	h.pending_count = ArchivePending(&records);
+
+	failed = fwrite(&h, sizeof(h), 1, f) != 1;
+	for(w = 0; w < windows_count && !failed; w ++)
+		failed = WindowSave(&windows[w], f) < 0;
+	failed = failed
+		|| fwrite(records, sizeof(struct ArchiveRecord), h.pending_count, f) != h.pending_count;
+	if(fclose(f) != 0 || failed)
+	{
+		fprintf(stderr, "Failed to copy the snapshot into memory: %s\n", strerror(errno));
+		free(data);
+		return;
+	}
+
+	WriterQueue(WriteSnapshot, data, size);
+}
+
+void WindowsStatistics(struct WindowsStats *stats)
+{
+	unsigned int w;
+
+	memset(stats, 0, sizeof(*stats));
+	stats->memory = windows_budget.used;
+	stats->budget = windows_budget.limit;
+	for(w = 0; w < windows_count; w ++)
+	{
+		stats->clients += windows[w].used;
+		stats->evicted += windows[w].evicted;
+		stats->rejected += windows[w].rejected;
+	}
+}
+
+/* 'windows': the clients, then the distinct prefix lengths of PLAN (in the order of PLAN) */
+__attribute__((cold)) static void InitializeWindows()
+{
+	unsigned int w;
+	int k;
+
+	windows = calloc(PLAN.count + 1, sizeof(struct Window));
+	if(!windows)
+	{
+		fprintf(stderr, "calloc() for windows failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	windows_budget.limit = ltWindowMemory;
+	windows_budget.used = 0;
+	InitializeWindow(&windows[0], 0, &windows_budget);
+	windows_count = 1;
+	for(k = 0; k < PLAN.count; k ++)
+	{
+		if(!PLAN.intervals[k].prefix)
+			continue;
+		for(w = 1; w < windows_count; w ++)
+			if(windows[w].prefix == PLAN.intervals[k].prefix)
+				break;
+		if(w == windows_count)
+			InitializeWindow(&windows[windows_count ++], PLAN.intervals[k].prefix, &windows_budget);
+	}
+}
+
+/* NOTE: after LoadWindow(), because 'levels_before' depends on the windows */
+__attribute__((cold)) static void InitializeThresholds()
+{
+	unsigned int w, intervals = 1;
+	int i, j;
+
+	for(w = 0; w < windows_count; w ++)
+		if(windows[w].intervals > intervals)
+			intervals = windows[w].intervals;
+	levels_before = malloc(intervals * sizeof(uint64_t));
+	if(!levels_before)
+	{
+		fprintf(stderr, "malloc() for CheckLevels sums failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	thresholds = malloc(PLAN.count * sizeof(int64_t *));
+	if(!thresholds)
+	{
+		fprintf(stderr, "malloc() for thresholds failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	for(i = 0; i < PLAN.count; i ++)
+	{
+		if(PLAN.intervals[i].count > THRESHOLD_MAX_LEVELS)
+		{
+			fprintf(stderr, "Too many levels (%i) for the interval of %i seconds, the maximum is %i\n",
+				PLAN.intervals[i].count, PLAN.intervals[i].seconds, THRESHOLD_MAX_LEVELS);
+			exit(1);
+		}
+
+		thresholds[i] = malloc(PLAN.intervals[i].count * sizeof(int64_t));
+		if(!thresholds[i])
+		{
+			fprintf(stderr, "malloc() for thresholds failed: %s\n", strerror(errno));
+			exit(1);
+		}
+		thresholds[i][0] = PLAN.intervals[i].actions[0].level + 1;
+		for(j = 1; j < PLAN.intervals[i].count; j ++)
+			thresholds[i][j] = PLAN.intervals[i].actions[j].level > thresholds[i][0] ? PLAN.intervals[i].actions[j].level : thresholds[i][0];
+	}
+
+	InitializeThreshold();
+}
+
+__attribute__((cold)) static void TerminateThresholds()
+{
+	int i;
+
+	for(i = 0; i < PLAN.count; i ++)
+		free(thresholds[i]);
+	free(thresholds);
+	thresholds = NULL;
+	free(levels_before);
+	levels_before = NULL;
+}
+
+__attribute__((cold)) static void TerminateWindows()
+{
+	unsigned int w;
+
+	for(w = 0; w < windows_count; w ++)
+		TerminateWindow(&windows[w]);
+	free(windows);
+	windows = NULL;
+	windows_count = 0;
+}
+
+/*
+	Restore 'windows' from the snapshot (one mmap() and a copy of the arrays),
+	then move them forward to the current time.
+	Returns 0 on success, -1 if there's no usable snapshot ('windows' are empty then).
+*/
+__attribute__((cold)) static int LoadSnapshot()
+{
+	struct SnapshotHeader h;
+	struct ArchiveMark mark;
+	const struct ArchiveRecord *records;
+	const uint8_t *map, *p;
+	struct stat st;
+	uint64_t i;
+	unsigned int w;
+	int fd;
+
+	fd = open(ltSnapshotFile, O_RDONLY);
+	if(fd < 0)
+		return -1;
+	if(fstat(fd, &st) < 0 || (size_t) st.st_size < sizeof(h))
+	{
+		close(fd);
+		return -1;
+	}
+	map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if(map == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap(%s) failed: %s\n", ltSnapshotFile, strerror(errno));
+		return -1;
+	}
+
+	memcpy(&h, map, sizeof(h));
+	p = h.magic == SNAPSHOT_MAGIC ? map + sizeof(h) : NULL;
+	for(w = 0; w < windows_count && p; w ++)
+		p = WindowLoad(&windows[w], p, map + st.st_size - p);
+	if(!p || (uint64_t) (map + st.st_size - p) != h.pending_count * sizeof(struct ArchiveRecord))
+	{
+		fprintf(stderr, "%s is damaged or was made with another %s, reading the archive instead\n", ltSnapshotFile, ltCfgFile);
+		munmap((void *) map, st.st_size);
+		TerminateWindows(); /* some of them may be loaded */
+		InitializeWindows();
+		return -1;
+	}
+
+	ArchiveGetMark(&mark);
+	if(mark.hour == h.mark.hour && mark.size == h.mark.size)
+	{
+		/* Nothing was written since the snapshot: the pending records are still not in the archive */
+		records = (const struct ArchiveRecord *) p;
+		for(i = 0; i < h.pending_count; i ++)
+			ArchiveAppend(records[i].time, &records[i].ip, records[i].bytes);
+	}
+	else
+	{
+		/*
+			The pending records were written after the snapshot (along with the newer traffic):
+			add the buckets which started after the snapshot, the others are already in 'windows'.
+		*/
+		ArchiveRead(ltArchiveDir, h.time + AGGREGATE_BUCKET / 2, INT64_MAX, NULL, LoadWindowRecord, NULL);
+	}
+	munmap((void *) map, st.st_size);
+
+	for(w = 0; w < windows_count; w ++)
+		WindowCatchUp(&windows[w], time(NULL));
+	fprintf(stderr, "Restored %u clients", windows[0].used);
+	for(w = 1; w < windows_count; w ++)
+		fprintf(stderr, ", %u subnets /%i", windows[w].used, windows[w].prefix);
+	fprintf(stderr, " from %s (made %lld seconds ago)\n", ltSnapshotFile, (long long) (time(NULL) - h.time));
+	return 0;
+}
+
+/*
+	Fill 'windows' with the traffic which is still in the longest interval,
+	so that the limits continue to work after a restart: from the snapshot if possible,
+	otherwise from the archive. The sketch (there are no snapshots of it) is always filled from the archive.
+*/
+__attribute__((cold)) static void LoadWindow()
+{
+	WriterWait(); /* e.g. the moves of UpgradeDb() */
+	InitializeWindows(); /* even with the sketch: WindowsSpan() is the horizon of ExpireHistory() */
+	if(ltSketchMemory)
+	{
+		InitializeSketch(&sketch, ltSketchMemory, ltSketchTopK);
+		ArchiveRead(ltArchiveDir, time(NULL) - WindowsSpan(), INT64_MAX, NULL, LoadSketchRecord, NULL);
+		return;
+	}
+	if(ltSnapshotInterval && LoadSnapshot() == 0)
+		return;
+	ArchiveRead(ltArchiveDir, time(NULL) - WindowsSpan(), INT64_MAX, NULL, LoadWindowRecord, NULL);
 }
 
 __attribute__((cold)) void InitializeDb()
@@ -148,37 +746,28 @@ __attribute__((cold)) void InitializeDb()
 	sqlite3_finalize(sth_attach);
 
 	/*
-		packet table: here we list the lengths of all intercepted packets.
-		Exists both in in-memory and on-disc databases.
+		WAL: a commit of LegSearch_Save() is an append to the log, without fsync()
+		(synchronous=NORMAL only syncs at checkpoints). A crash can lose the last commits,
+		which is fine for a cache.
 	*/
-	ret = sqlite3_exec(dbh,
-		"CREATE TABLE IF NOT EXISTS packet (p_time INTEGER, p_ip TEXT, p_len INTEGER)",
-		NULL, NULL, &sql_error);
-	if(ret != SQLITE_OK)
-	{	
-		fprintf(stderr, "Failed to create in-memory SQLite table 'packet': %s\n", sql_error);
-		sqlite3_free(sql_error);
-		exit(1);
-	}
-	ret = sqlite3_exec(dbh,
-		"CREATE TABLE IF NOT EXISTS ondisc.packet (p_time INTEGER, p_ip TEXT, p_len INTEGER)",
-		NULL, NULL, &sql_error);
-	if(ret != SQLITE_OK)
-	{	
-		fprintf(stderr, "Failed to create SQLite table 'packet': %s\n", sql_error);
-		sqlite3_free(sql_error);
-		exit(1);
-	}
-	
-	ret = sqlite3_exec(dbh,
-		"CREATE INDEX IF NOT EXISTS ondisc.packet_time ON packet (p_time)",
-		NULL, NULL, &sql_error);
+	ret = sqlite3_exec(dbh, "PRAGMA ondisc.journal_mode = WAL; PRAGMA ondisc.synchronous = NORMAL", NULL, NULL, &sql_error);
 	if(ret != SQLITE_OK)
-	{	
-		fprintf(stderr, "Failed to create SQLite index 'ondisc.packet_time' on 'packet(p_time)': %s\n", sql_error);
+	{
+		fprintf(stderr, "Failed to switch %s to WAL mode: %s\n", ltDbFile, sql_error);
 		sqlite3_free(sql_error);
-		exit(1);
 	}
+
+	/*
+		Traffic history: traffic of each client in 10-second intervals (AGGREGATE_BUCKET),
+		in the archive files (see archive.h), not in SQLite.
+		The recent packets are summed up in 'aggregate', see Register().
+	*/
+	InitializeArchive(ltArchiveDir);
+	InitializeWriter();
+	InitializePool(ltAnalyzeThreads);
+	InitializeAggregate(&aggregate);
+
+	UpgradeDb();
 	
 	/*
 		'legsearch' is a cache used by is_legitimate_search_engine() to
@@ -188,7 +777,7 @@ __attribute__((cold)) void InitializeDb()
 		Later LegSearch_Save() dumps in-memory database back to file.
 	*/
 	ret = sqlite3_exec(dbh,
-		"CREATE TABLE IF NOT EXISTS ondisc.legsearch (ls_ip TEXT PRIMARY KEY, ls_is_search_engine BOOLEAN, ls_updated INTEGER)",
+		"CREATE TABLE IF NOT EXISTS ondisc.legsearch (ls_ip BLOB PRIMARY KEY, ls_is_search_engine BOOLEAN, ls_updated INTEGER)",
 		NULL, NULL, &sql_error);
 	if(ret != SQLITE_OK)
 	{	
@@ -240,27 +829,6 @@ __attribute__((cold)) void InitializeDb()
 		exit(1);
 	}
 	
-	/*
-		sth_insert_compact_db, sth_clean_inmemory_packet_db
-			are statements used in CompactDb()
-	*/
-	ret = sqlite3_prepare_v2(dbh, "INSERT INTO ondisc.packet (p_time, p_ip, p_len) SELECT CAST(ROUND(p_time * 0.1) * 10 AS INTEGER), p_ip, SUM(p_len) FROM packet GROUP BY ROUND(p_time * 0.1) * 10, p_ip", -1,
-		&sth_insert_compact_db, NULL);
-	if(ret != SQLITE_OK)
-	{
-		fprintf(stderr, "Failed to compile INSERT TABLE query 'sth_insert_compact_db': error %i: %s\n", ret, sqlite3_errmsg(dbh));
-		fprintf(stderr, "SQLITE error message: %s\n", sqlite3_errmsg(dbh));
-		exit(1);
-	}
-	ret = sqlite3_prepare_v2(dbh, "DELETE FROM packet", -1,
-		&sth_clean_inmemory_packet_db, NULL);
-	if(ret != SQLITE_OK)
-	{
-		fprintf(stderr, "Failed to compile DELETE query 'sth_clean_inmemory_packet_db' for 'packet': error %i: %s\n", ret, sqlite3_errmsg(dbh));
-		fprintf(stderr, "SQLITE error message: %s\n", sqlite3_errmsg(dbh));
-		exit(1);
-	}
-	
 	/*
 		sth_legsearch_clean, sth_legsearch_save are the statement used in LegSearch_Save()
 	*/
@@ -281,24 +849,8 @@ __attribute__((cold)) void InitializeDb()
 		exit(1);
 	}
 	
-	/*
-		sth_register is called for every intercepted packet
-	*/
-	ret = sqlite3_prepare_v2(dbh, "INSERT INTO packet(p_time, p_ip, p_len) VALUES(?, ?, ?)", -1,
-		&sth_register, NULL);
-	if(ret != SQLITE_OK)
-	{
-		fprintf(stderr, "Failed to compile INSERT query 'sth_register' for 'packet': error %i: %s\n", ret, sqlite3_errmsg(dbh));
-		exit(1);
-	}
-	
-	ret = sqlite3_prepare_v2(dbh, "SELECT p_ip, SUM(p_len) FROM ondisc.packet WHERE p_time > ? AND p_time < ? GROUP BY p_ip HAVING SUM(p_len) > ?  ORDER BY SUM(p_len) DESC", -1,
-		&sth_analyze_range, NULL);
-	if(ret != SQLITE_OK)
-	{
-		fprintf(stderr, "Failed to compile SELECT query 'sth_analyze_range' for 'packet': error %i: %s\n", ret, sqlite3_errmsg(dbh));
-		exit(1);
-	}
+	LoadWindow();
+	InitializeThresholds();
 
 	/* Start scanning log and writing to DB */
 	ret = sqlite3_exec(dbh, "BEGIN TRANSACTION", NULL, NULL, &sql_error);
@@ -318,10 +870,20 @@ void TerminateDb()
 		fprintf(stderr, "Failed to end transaction: %s\n", sql_error);
 		sqlite3_free(sql_error);
 	}
-	
-	sqlite3_finalize(sth_analyze_range);
-	sqlite3_finalize(sth_register);
-	sqlite3_finalize(sth_insert_compact_db);
+
+	/* Don't lose the traffic since the last Analyze() */
+	CompactDb();
+	ArchiveFlush(1);
+	if(ltSnapshotInterval)
+		SaveSnapshot();
+	TerminateWriter(); /* after all of these are written */
+	TerminatePool();
+	TerminateAggregate(&aggregate);
+	TerminateArchive();
+	TerminateWindows();
+	TerminateThresholds();
+	if(ltSketchMemory)
+		TerminateSketch(&sketch);
 	
 	sqlite3_finalize(sth_legsearch_deprecate_all);
 	sqlite3_finalize(sth_legsearch_set);
@@ -338,58 +900,343 @@ void TerminateDb()
 	sqlite3_close(dbh);
 }
 
-__attribute__((hot)) void AnalyzeDb()
+/* Client which has exceeded the lowest level of an interval, see AnalyzeDb() */
+struct AnalyzeCandidate
 {
-	const unsigned char *ip;
-	long used; /* = SUM(p_len) for this IP */
+	struct IpAddr ip;
+	long used;
+	int interval; /* in PLAN.intervals */
 	struct AnalyzePlanAction *action;
-	
-	int i, j;
-	for(i = 0; i < PLAN.count; i ++)
+};
+
+#define ANALYZE_BLOCK 1024 /* clients per ThresholdCrossed() */
+
+struct AnalyzeCandidates
+{
+	struct AnalyzeCandidate *list;
+	unsigned int count, size;
+
+	/* AnalyzePart(): the clients it has advanced and their sums, gathered into columns */
+	uint32_t *entries;
+	uint64_t *sums; /* sums[k * capacity + c]: interval 'k' of client 'entries[c]' */
+	unsigned int capacity; /* clients, for PLAN.count intervals */
+	uint8_t crossed[ANALYZE_BLOCK]; /* result of ThresholdCrossed() */
+};
+
+/*
+	'candidates' are acted upon by ActOnCandidates(). AnalyzeWindow() collects them
+	in one list per part of the clients ('parts', one for each thread of the pool), then merges these.
+*/
+static struct AnalyzeCandidates candidates;
+static struct AnalyzeCandidates parts[POOL_MAX_THREADS];
+
+/* Clients per thread of AnalyzeWindow(): fewer of them are not worth waking up a thread */
+static const unsigned int ANALYZE_MIN_PART = 4096;
+
+/*
+	The highest level of PLAN.intervals[i] which 'used' has reached, NULL if none.
+	NOTE: PLAN.intervals[i].actions is sorted by level (ASC).
+*/
+static inline struct AnalyzePlanAction *FindAction(int i, long used)
+{
+	int j;
+	for(j = PLAN.intervals[i].count - 1; j >= 0; j --)
+		if(used >= PLAN.intervals[i].actions[j].level)
+			return &PLAN.intervals[i].actions[j];
+	return NULL;
+}
+
+/* Index of FindAction() in PLAN.intervals[i].actions for a client which AnalyzeDb() would act upon (i.e. over the lowest level), -1 otherwise */
+static inline int ReachedLevel(int i, long used)
+{
+	return used > PLAN.intervals[i].actions[0].level ? FindAction(i, used) - PLAN.intervals[i].actions : -1;
+}
+
+static void ReportAction(const char *caller, const struct IpAddr *ip, int i, struct AnalyzePlanAction *action, long used)
+{
+	char ip_text[IPADDR_SUBNET_STRLEN];
+	struct AnalyzePlanInterval *interval = &PLAN.intervals[i];
+
+	fprintf(stderr, "%s(): %s downloaded %.2f kilobytes in %i seconds (%.2f times the normal level %li): action would be %i\n",
+		caller, IpAddrSubnetToString(ip, interval->prefix, ip_text), used / 1024., interval->seconds, (float) used / interval->actions[0].level, interval->actions[0].level,
+		action->type
+	);
+
+	TakeAction(ip, interval->prefix, action, used, interval->seconds);
+}
+
+/*
+	Immediate triggers (ltImmediateTriggers): when the bytes since the last check have used up
+	the slack of the client, its sums are recalculated, and the action of every level which it has
+	reached since the last recalculation is taken without waiting for AnalyzeDb().
+	The slack is the distance to the nearest level above the sums: they can't reach any level
+	before that many bytes have arrived (expired buckets only make them smaller).
+*/
+static void CheckLevels(struct Window *win, unsigned int i)
+{
+	struct WindowEntry *e = WindowEntryOf(win, i);
+	uint64_t slack = UINT32_MAX, next;
+	unsigned int k;
+	long used;
+	int p, j;
+
+	for(k = 0; k < win->intervals; k ++)
+		levels_before[k] = WindowSum(win, i, k);
+	WindowAdvance(win, i, TIME);
+
+	for(k = 0; k < win->intervals; k ++)
 	{
-		/*
-			Analyze query (sth_analyze_range) is executed
-			once per interval.
-			
-			NOTE: PLAN.intervals[i].actions is sorted by level (ASC),
-			therefore actions[0].level is the lowest one.
-		*/
-		sqlite3_bind_int(sth_analyze_range, 1, TIME - PLAN.intervals[i].seconds);
-		sqlite3_bind_int(sth_analyze_range, 2, TIME);
-		sqlite3_bind_int(sth_analyze_range, 3, PLAN.intervals[i].actions[0].level);
-	
-		while(1)
+		p = win->plan[k];
+		used = WindowSum(win, i, k);
+
+		j = ReachedLevel(p, used);
+		if(j >= 0 && j > ReachedLevel(p, levels_before[k]))
+			ReportAction("Register", &e->ip, p, &PLAN.intervals[p].actions[j], used);
+
+		/* The next level: actions[0] is reached when the sum is above it, the others at their levels */
+		for(j = 0; j < PLAN.intervals[p].count; j ++)
 		{
-			ret = sqlite3_step(sth_analyze_range);
-			if(ret != SQLITE_ROW) break;
-			
-			/* TODO */
-			ip = sqlite3_column_text(sth_analyze_range, 0);
-			used = sqlite3_column_int(sth_analyze_range, 1);
-			
-			/* Determine which action to apply. Keep in mind that actions[] are sorted by level (ASC) */
-			for(j = PLAN.intervals[i].count - 1; j >= 0; j --)
+			next = PLAN.intervals[p].actions[j].level + (j == 0);
+			if(next > (uint64_t) used)
 			{
-				if(used >= PLAN.intervals[i].actions[j].level)
-				{
-					action = &PLAN.intervals[i].actions[j];
-					break;
-				}
+				if(next - used < slack)
+					slack = next - used;
+				break;
 			}
-			
-			fprintf(stderr, "AnalyzeDb(): %s downloaded %.2f kilobytes in %i seconds (%.2f times the normal level %li): action would be %i\n",
-				ip, used / 1024., PLAN.intervals[i].seconds, (float) used / PLAN.intervals[i].actions[0].level, PLAN.intervals[i].actions[0].level,
-				action->type
-			);
+		}
+	}
+	e->slack = slack;
+}
+
+/* Make room for 'count' more candidates in 'c' */
+static inline void ReserveCandidates(struct AnalyzeCandidates *c, unsigned int count)
+{
+	if(c->count + count <= c->size)
+		return;
+
+	while(c->count + count > c->size)
+		c->size = c->size ? c->size * 2 : 1024;
+	c->list = realloc(c->list, c->size * sizeof(struct AnalyzeCandidate));
+	if(!c->list)
+	{
+		fprintf(stderr, "realloc() for AnalyzeDb candidates failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+static inline void AddCandidate(struct AnalyzeCandidates *c, int i, const struct IpAddr *ip, long used, struct AnalyzePlanAction *action)
+{
+	struct AnalyzeCandidate *a;
+
+	ReserveCandidates(c, 1);
+	a = &c->list[c->count ++];
+	a->ip = *ip;
+	a->used = used;
+	a->interval = i;
+	a->action = action;
+}
+
+/* By interval, then the biggest downloaders first (the same client twice is next to itself) */
+static int compare_candidates(const void *a, const void *b)
+{
+	const struct AnalyzeCandidate *x = a, *y = b;
+	if(x->interval != y->interval)
+		return x->interval < y->interval ? -1 : 1;
+	if(x->used != y->used)
+		return x->used < y->used ? 1 : -1;
+	return memcmp(x->ip.addr, y->ip.addr, sizeof(x->ip.addr));
+}
+
+/* WindowSettle() callback: the client stays active while it's over some level */
+static int KeepOverLevel(struct Window *win, unsigned int i)
+{
+	unsigned int k;
+	for(k = 0; k < win->intervals; k ++)
+		if((long) WindowSum(win, i, k) > PLAN.intervals[win->plan[k]].actions[0].level)
+			return 1;
+	return 0;
+}
+
+/*
+	If the capture has lost packets during PLAN.intervals[i],
+	the sums are too low and some clients may escape the limits.
+*/
+static void WarnLoss(int i)
+{
+	uint64_t lost = LostSince(TIME - PLAN.intervals[i].seconds);
+	if(lost)
+	{
+		fprintf(stderr, "AnalyzeDb(): WARNING: %lu packets were lost in the last %i seconds, traffic is underestimated\n",
+			(unsigned long) lost, PLAN.intervals[i].seconds);
+		LogLoss(lost, PLAN.intervals[i].seconds);
+	}
+}
+
+/* Apply the actions to 'candidates' (of any intervals), each client once per interval */
+static void ActOnCandidates()
+{
+	struct AnalyzeCandidate *c, *end = candidates.list + candidates.count;
+
+	qsort(candidates.list, candidates.count, sizeof(struct AnalyzeCandidate), compare_candidates);
+
+	for(c = candidates.list; c < end; c ++)
+	{
+		if(c > candidates.list && c[-1].interval == c->interval && IpAddrEqual(&c[-1].ip, &c->ip))
+			continue;
+		ReportAction("AnalyzeDb", &c->ip, c->interval, c->action, c->used);
+	}
+	candidates.count = 0;
+}
+
+/*
+	AnalyzeDb() in the approximate mode: only the top-K clients of each interval are candidates.
+	An estimate is never below the real traffic, so nobody over a level escapes
+	(unless there are more than ltSketchTopK such clients), but it can be above it by SketchError(),
+	and a client this close to a level may be limited by mistake.
+*/
+static void AnalyzeSketch()
+{
+	const struct SketchEntry *top;
+	unsigned int n, e;
+	int i;
+
+	for(i = 0; i < PLAN.count; i ++)
+	{
+		WarnLoss(i);
 
-			TakeAction((const char *) ip, action, used, PLAN.intervals[i].seconds);
+		n = SketchTop(&sketch, i, TIME, &top);
+		for(e = 0; e < n; e ++)
+			if((long) top[e].estimate > PLAN.intervals[i].actions[0].level)
+				AddCandidate(&candidates, i, &top[e].ip, top[e].estimate, FindAction(i, top[e].estimate));
+
+		if(candidates.count)
+			fprintf(stderr, "AnalyzeDb(): %u of the top %u clients in %i seconds are over the level, the estimates may be %.2f kilobytes too high\n",
+				candidates.count, n, PLAN.intervals[i].seconds, SketchError(&sketch, i) / 1024.);
+		ActOnCandidates();
+	}
+	FlushLog();
+}
+
+/* Room for the columns of 'clients' clients in 'c' (the old ones are not kept) */
+static void ReserveColumns(struct AnalyzeCandidates *c, unsigned int clients)
+{
+	if(clients <= c->capacity)
+		return;
+
+	free(c->entries);
+	free(c->sums);
+	c->capacity = clients;
+	c->entries = malloc(c->capacity * sizeof(uint32_t));
+	c->sums = malloc((size_t) PLAN.count * c->capacity * sizeof(uint64_t));
+	if(!c->entries || !c->sums)
+	{
+		fprintf(stderr, "malloc() for AnalyzeDb columns failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+/*
+	PoolRun() job of AnalyzeWindow(): one part of the active clients, collected into parts[part].
+	Parts don't share anything but the index, which is only read: each client is in active[] once,
+	and WindowAdvance() only changes the client's own entry.
+
+	WindowAdvance() brings each client to TIME and calculates all its sums (in its entry, next to
+	each other), which are copied into one column per interval of the part, so that they are compared
+	with the levels a block of clients at a time (see ThresholdCrossed()).
+	Only the active clients are visited: the cost follows them, not the number of entries.
+*/
+static void AnalyzePart(unsigned int part, unsigned int count, void *arg)
+{
+	struct Window *win = arg;
+	struct AnalyzeCandidates *c = &parts[part];
+	unsigned int a, k, n, b, len, from, to, clients = 0;
+	const uint64_t *sums;
+	int i;
+
+	from = (uint64_t) win->active_count * part / count;
+	to = (uint64_t) win->active_count * (part + 1) / count;
+	ReserveColumns(c, to - from);
+
+	for(a = from; a < to; a ++)
+	{
+		i = WindowLookup(win, &win->active[a]);
+		if(i < 0)
+			continue;
+
+		WindowAdvance(win, i, TIME);
+		c->entries[clients] = i;
+		for(k = 0; k < win->intervals; k ++)
+			c->sums[(size_t) k * c->capacity + clients] = WindowSum(win, i, k);
+		clients ++;
+	}
+
+	c->count = 0;
+	for(k = 0; k < win->intervals; k ++)
+	{
+		i = win->plan[k];
+		sums = c->sums + (size_t) k * c->capacity;
+		for(n = 0; n < clients; n += len)
+		{
+			len = clients - n < ANALYZE_BLOCK ? clients - n : ANALYZE_BLOCK;
+			if(!ThresholdCrossed(sums + n, len, thresholds[i], PLAN.intervals[i].count, c->crossed))
+				continue;
+
+			for(b = 0; b < len; b ++)
+				if(c->crossed[b])
+					AddCandidate(c, i, WindowAddress(win, c->entries[n + b]), sums[n + b], &PLAN.intervals[i].actions[c->crossed[b] - 1]);
 		}
-		
-		/* */
-		if(ret != SQLITE_DONE)
-			fprintf(stderr, "sqlite3_step(sth_analyze_range) failed at %s:%i: error %i: %s\n", __FILE__, __LINE__, ret, sqlite3_errmsg(dbh));
-		
-		sqlite3_reset(sth_analyze_range);
 	}
+}
+
+/* AnalyzeDb() of one of 'windows' */
+static void AnalyzeWindow(struct Window *win)
+{
+	unsigned int count, part, k;
+
+	for(k = 0; k < win->intervals; k ++)
+		WarnLoss(win->plan[k]);
+
+	/*
+		Only the active clients are analyzed (see Window.active):
+		the sums of the others haven't grown since the last time, so they are still below the levels.
+		They are split between the threads of the pool, and the actions are taken
+		by this thread once all parts are done.
+	*/
+	count = win->active_count / ANALYZE_MIN_PART;
+	if(count > PoolSize())
+		count = PoolSize();
+	if(count < 1)
+		count = 1;
+	PoolRun(AnalyzePart, win, count);
+
+	for(part = 0; part < count; part ++)
+	{
+		if(!parts[part].count)
+			continue;
+		ReserveCandidates(&candidates, parts[part].count);
+		memcpy(candidates.list + candidates.count, parts[part].list, parts[part].count * sizeof(struct AnalyzeCandidate));
+		candidates.count += parts[part].count;
+	}
+
+	ActOnCandidates();
+	WindowSettle(win, TIME, KeepOverLevel);
+}
+
+/*
+	The clients, then the subnets of the "PER /prefix" rules:
+	both are the same kind of table (see window.h), so a subnet costs as much as a client.
+*/
+__attribute__((hot)) void AnalyzeDb()
+{
+	unsigned int w;
+
+	if(ltSketchMemory)
+	{
+		AnalyzeSketch();
+		return;
+	}
+
+	for(w = 0; w < windows_count; w ++)
+		AnalyzeWindow(&windows[w]);
 	FlushLog();
 }
@@ -17,6 +17,9 @@
 #define _LIMITTRAF_DATABASE_H
 
 #include <inttypes.h>
+#include <stddef.h>
+
+#include "ipaddr.h"
 
 /*
 	Create the database.
@@ -30,21 +33,38 @@ void InitializeDb();
 void TerminateDb();
 
 /*
-	DbMemoryUsed() = sqlite3_memory_used(). 
+	DbMemoryUsed() = sqlite3_memory_used() + the traffic which is not compacted yet.
 */
 uint64_t DbMemoryUsed();
 
 /*
 	Called from Analyze() and when in-memory DB 'dbh' exceeds ltMemoryDumpLevel.
-	It does two things:
-	1. merges several rows of in-memory 'packet' into one on-disc 'packet';
-	2. cleans in-memory 'packet'.
+	It writes the per-IP sums of the traffic since the last CompactDb()
+	(one record per 10 seconds per IP) into the archive and forgets them.
+	Doesn't wait for the disc: the archive is written by the writer thread (see writer.h).
 	
 	You should call CommitTransaction() before CompactDb()
 		and BeginTransaction() afterwards.
 */
 void CompactDb();
 
+/*
+	Write 'window' and the records not yet in the archive into ltSnapshotFile,
+	so that a restart doesn't lose them (called every ltSnapshotInterval seconds
+	by Analyze() and by TerminateDb()). Only copies them: the file is written by the writer thread.
+*/
+void SaveSnapshot();
+
+/*
+	Clients (and subnets) in the windows of AnalyzeDb() and their memory (see ltWindowMemory),
+	with the clients evicted and rejected to stay within it since the start.
+*/
+struct WindowsStats
+{
+	uint64_t clients, evicted, rejected;
+	size_t memory, budget;
+};
+void WindowsStatistics(struct WindowsStats *stats);
 
 /* 
 	LegSearch_Save() - write legsearch table from in-memory DB to disc
@@ -59,12 +79,12 @@ void LegSearch_Save();
 		-1 - cache miss,
 		0 or 1 - cache hit (0 - not a search engine, 1 - verified search engine).
 */
-int LegSearch_Get(const char *ip);
+int LegSearch_Get(const struct IpAddr *ip);
 
 /*
 	Write a value into legsearch cache.
 */
-void LegSearch_Set(const char *ip, int value);
+void LegSearch_Set(const struct IpAddr *ip, int value);
 
 /*
 	CommitTransaction() and BeginTransaction()
@@ -79,9 +99,10 @@ void CommitTransaction();
 void BeginTransaction();
 
 /*
-	Register a packet in the in-memory 'packet' database.
+	Account a packet (or several packets to the same IP) at TIME.
+	Doesn't touch SQLite: the bytes are summed up until CompactDb().
 */
-void Register(const char *ip, unsigned int length);
+void Register(const struct IpAddr *ip, uint64_t length);
 
 /*
 	Scan the database for clients who violate some rules from the PLAN,
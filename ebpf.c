@@ -0,0 +1,448 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <stddef.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <linux/bpf.h>
+#include <linux/if_ether.h>
+#include <linux/pkt_cls.h>
+
+#include "limittraf.h"
+#include "actions.h"
+#include "capture.h"
+#include "ebpf.h"
+
+/*
+	The eBPF program is assembled here (see EbpfBuildProgram()), so neither clang
+	nor libbpf are needed. It's pinned into the BPF filesystem, because that's how
+	we pass it to 'tc' (the same way actions.c configures traffic control).
+*/
+static const char EBPF_PIN_PATH[] = "/sys/fs/bpf/limittraf_egress";
+static const unsigned int EBPF_IDLE_WALKS = 60; /* clients unchanged for this many walks (seconds) are removed from the map */
+
+struct EbpfValue /* value of the map (per CPU) */
+{
+	uint64_t bytes;
+	uint64_t packets;
+};
+struct EbpfClient /* totals at the previous walk of the map */
+{
+	struct IpAddr ip; /* :: = empty slot */
+	uint64_t idle; /* number of walks without changes */
+	uint64_t bytes;
+	uint64_t packets;
+};
+
+static int ebpf_map_fd = -1, ebpf_prog_fd = -1;
+static int ebpf_cpus; /* number of possible CPUs: the map returns one value for each of them */
+static struct EbpfValue *ebpf_values;
+static struct EbpfClient *ebpf_seen[2]; /* previous and current walk */
+static unsigned int ebpf_seen_bits;
+static struct IpAddr *ebpf_idle_keys; /* keys to delete after the walk */
+
+/* Instruction encoding, as in samples/bpf/bpf_insn.h of the kernel */
+#define INSN(c, d, s, o, i) ((struct bpf_insn) { .code = (c), .dst_reg = (d), .src_reg = (s), .off = (o), .imm = (i) })
+#define MOV64_REG(d, s) INSN(BPF_ALU64 | BPF_MOV | BPF_X, d, s, 0, 0)
+#define MOV64_IMM(d, i) INSN(BPF_ALU64 | BPF_MOV | BPF_K, d, 0, 0, i)
+#define ALU64_REG(op, d, s) INSN(BPF_ALU64 | (op) | BPF_X, d, s, 0, 0)
+#define ALU64_IMM(op, d, i) INSN(BPF_ALU64 | (op) | BPF_K, d, 0, 0, i)
+#define LDX_MEM(size, d, s, o) INSN(BPF_LDX | BPF_MEM | (size), d, s, o, 0)
+#define STX_MEM(size, d, s, o) INSN(BPF_STX | BPF_MEM | (size), d, s, o, 0)
+#define ST_MEM(size, d, o, i) INSN(BPF_ST | BPF_MEM | (size), d, 0, o, i)
+#define JMP_IMM(op, d, i, o) INSN(BPF_JMP | (op) | BPF_K, d, 0, o, i)
+#define JMP_A(o) INSN(BPF_JMP | BPF_JA, 0, 0, o, 0)
+#define CALL(f) INSN(BPF_JMP | BPF_CALL, 0, 0, 0, f)
+#define EXIT() INSN(BPF_JMP | BPF_EXIT, 0, 0, 0, 0)
+#define LD_MAP_FD_1(d, fd) INSN(BPF_LD | BPF_DW | BPF_IMM, d, BPF_PSEUDO_MAP_FD, 0, fd)
+#define LD_MAP_FD_2() INSN(0, 0, 0, 0, 0)
+
+/* Jump offsets which are resolved after the whole program is assembled */
+#define JUMP_TO_EXIT 0x7fff
+#define JUMP_TO_INSERT 0x7ffe
+#define JUMP_TO_IPV4 0x7ffd
+#define JUMP_TO_COMMON 0x7ffc
+
+static inline long bpf(int cmd, union bpf_attr *attr)
+{
+	return syscall(__NR_bpf, cmd, attr, sizeof(*attr));
+}
+
+/*
+	Assemble the tc classifier. The key of the map is struct IpAddr, so IPv4 addresses
+	are converted into IPv4-mapped ones (::ffff:a.b.c.d). Stack layout:
+		[-16 .. -1] key (destination address)
+		[-80 .. -41] IP header (20 bytes of IPv4 or 40 bytes of IPv6)
+		[-88 .. -87] source port
+		[-104 .. -89] struct EbpfValue for a new key
+	Registers which survive the helper calls: r6 = skb, r7 = length of the packet,
+	r8 = length of the IP header, r9 = protocol (TCP, UDP, etc.).
+	'port' is the required source port (TCP or UDP), 0 = any.
+	For IPv6 packets with extension headers the port is not found (they're only counted if 'port' is 0).
+	Returns the number of instructions.
+*/
+__attribute__((cold)) static int EbpfBuildProgram(struct bpf_insn *p, unsigned int port)
+{
+	int n = 0, i, ipv4, common, insert, out;
+
+	p[n++] = MOV64_REG(BPF_REG_6, BPF_REG_1); /* r6 = skb */
+	p[n++] = LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_6, offsetof(struct __sk_buff, protocol));
+	p[n++] = JMP_IMM(BPF_JEQ, BPF_REG_2, htons(ETH_P_IP), JUMP_TO_IPV4);
+	p[n++] = JMP_IMM(BPF_JNE, BPF_REG_2, htons(ETH_P_IPV6), JUMP_TO_EXIT);
+
+	/* IPv6 header -> stack (relative to the network header: works for any link-layer) */
+	p[n++] = MOV64_REG(BPF_REG_1, BPF_REG_6);
+	p[n++] = MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_3, -80);
+	p[n++] = MOV64_IMM(BPF_REG_4, 40);
+	p[n++] = MOV64_IMM(BPF_REG_5, BPF_HDR_START_NET);
+	p[n++] = CALL(BPF_FUNC_skb_load_bytes_relative);
+	p[n++] = JMP_IMM(BPF_JNE, BPF_REG_0, 0, JUMP_TO_EXIT);
+
+	p[n++] = MOV64_IMM(BPF_REG_8, 40);
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_9, BPF_REG_10, -80 + 6); /* next header */
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_7, BPF_REG_10, -80 + 4); /* payload length + 40 */
+	p[n++] = ALU64_IMM(BPF_LSH, BPF_REG_7, 8);
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10, -80 + 5);
+	p[n++] = ALU64_REG(BPF_OR, BPF_REG_7, BPF_REG_2);
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_7, 40);
+	p[n++] = LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_10, -80 + 24); /* key = destination address */
+	p[n++] = STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_2, -16);
+	p[n++] = LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_10, -80 + 32);
+	p[n++] = STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_2, -8);
+	p[n++] = JMP_A(JUMP_TO_COMMON);
+
+	/* IPv4 header -> stack */
+	ipv4 = n;
+	p[n++] = MOV64_REG(BPF_REG_1, BPF_REG_6);
+	p[n++] = MOV64_IMM(BPF_REG_2, 0);
+	p[n++] = MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_3, -80);
+	p[n++] = MOV64_IMM(BPF_REG_4, 20);
+	p[n++] = MOV64_IMM(BPF_REG_5, BPF_HDR_START_NET);
+	p[n++] = CALL(BPF_FUNC_skb_load_bytes_relative);
+	p[n++] = JMP_IMM(BPF_JNE, BPF_REG_0, 0, JUMP_TO_EXIT);
+
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_8, BPF_REG_10, -80);
+	p[n++] = ALU64_IMM(BPF_AND, BPF_REG_8, 0x0f);
+	p[n++] = ALU64_IMM(BPF_LSH, BPF_REG_8, 2); /* header length */
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_9, BPF_REG_10, -80 + 9); /* protocol */
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_7, BPF_REG_10, -80 + 2); /* total length (same as "length N" of tcpdump) */
+	p[n++] = ALU64_IMM(BPF_LSH, BPF_REG_7, 8);
+	p[n++] = LDX_MEM(BPF_B, BPF_REG_2, BPF_REG_10, -80 + 3);
+	p[n++] = ALU64_REG(BPF_OR, BPF_REG_7, BPF_REG_2);
+	p[n++] = ST_MEM(BPF_DW, BPF_REG_10, -16, 0); /* key = ::ffff:a.b.c.d */
+	p[n++] = ST_MEM(BPF_W, BPF_REG_10, -8, htonl(0xffff));
+	p[n++] = LDX_MEM(BPF_W, BPF_REG_2, BPF_REG_10, -80 + 16);
+	p[n++] = STX_MEM(BPF_W, BPF_REG_10, BPF_REG_2, -4);
+
+	common = n;
+	if(port)
+	{
+		p[n++] = JMP_IMM(BPF_JEQ, BPF_REG_9, IPPROTO_TCP, 1);
+		p[n++] = JMP_IMM(BPF_JNE, BPF_REG_9, IPPROTO_UDP, JUMP_TO_EXIT);
+
+		p[n++] = MOV64_REG(BPF_REG_1, BPF_REG_6);
+		p[n++] = MOV64_REG(BPF_REG_2, BPF_REG_8);
+		p[n++] = MOV64_REG(BPF_REG_3, BPF_REG_10);
+		p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_3, -88);
+		p[n++] = MOV64_IMM(BPF_REG_4, 2);
+		p[n++] = MOV64_IMM(BPF_REG_5, BPF_HDR_START_NET);
+		p[n++] = CALL(BPF_FUNC_skb_load_bytes_relative);
+		p[n++] = JMP_IMM(BPF_JNE, BPF_REG_0, 0, JUMP_TO_EXIT);
+
+		p[n++] = LDX_MEM(BPF_H, BPF_REG_2, BPF_REG_10, -88); /* still in network byte order */
+		p[n++] = JMP_IMM(BPF_JNE, BPF_REG_2, htons(port), JUMP_TO_EXIT);
+	}
+
+	p[n++] = LD_MAP_FD_1(BPF_REG_1, ebpf_map_fd);
+	p[n++] = LD_MAP_FD_2();
+	p[n++] = MOV64_REG(BPF_REG_2, BPF_REG_10);
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_2, -16);
+	p[n++] = CALL(BPF_FUNC_map_lookup_elem);
+	p[n++] = JMP_IMM(BPF_JEQ, BPF_REG_0, 0, JUMP_TO_INSERT);
+
+	/* Known client: the value belongs to this CPU, so no atomic operations are needed */
+	p[n++] = LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_0, offsetof(struct EbpfValue, bytes));
+	p[n++] = ALU64_REG(BPF_ADD, BPF_REG_2, BPF_REG_7);
+	p[n++] = STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_2, offsetof(struct EbpfValue, bytes));
+	p[n++] = LDX_MEM(BPF_DW, BPF_REG_2, BPF_REG_0, offsetof(struct EbpfValue, packets));
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_2, 1);
+	p[n++] = STX_MEM(BPF_DW, BPF_REG_0, BPF_REG_2, offsetof(struct EbpfValue, packets));
+	p[n++] = JMP_A(JUMP_TO_EXIT);
+
+	/* New client (if the map is full, the update fails and the packet is not counted) */
+	insert = n;
+	p[n++] = STX_MEM(BPF_DW, BPF_REG_10, BPF_REG_7, -104 + (int) offsetof(struct EbpfValue, bytes));
+	p[n++] = ST_MEM(BPF_DW, BPF_REG_10, -104 + (int) offsetof(struct EbpfValue, packets), 1);
+	p[n++] = LD_MAP_FD_1(BPF_REG_1, ebpf_map_fd);
+	p[n++] = LD_MAP_FD_2();
+	p[n++] = MOV64_REG(BPF_REG_2, BPF_REG_10);
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_2, -16);
+	p[n++] = MOV64_REG(BPF_REG_3, BPF_REG_10);
+	p[n++] = ALU64_IMM(BPF_ADD, BPF_REG_3, -104);
+	p[n++] = MOV64_IMM(BPF_REG_4, BPF_ANY);
+	p[n++] = CALL(BPF_FUNC_map_update_elem);
+
+	out = n;
+	p[n++] = MOV64_IMM(BPF_REG_0, TC_ACT_OK); /* we only count, never drop */
+	p[n++] = EXIT();
+
+	for(i = 0; i < n; i ++)
+	{
+		if(BPF_CLASS(p[i].code) != BPF_JMP || BPF_OP(p[i].code) == BPF_CALL)
+			continue;
+		if(p[i].off == JUMP_TO_EXIT)
+			p[i].off = out - i - 1;
+		else if(p[i].off == JUMP_TO_INSERT)
+			p[i].off = insert - i - 1;
+		else if(p[i].off == JUMP_TO_IPV4)
+			p[i].off = ipv4 - i - 1;
+		else if(p[i].off == JUMP_TO_COMMON)
+			p[i].off = common - i - 1;
+	}
+	return n;
+}
+
+/*
+	The map has one value per *possible* CPU, see /sys/devices/system/cpu/possible (e.g. "0-15").
+*/
+__attribute__((cold)) static int possible_cpus()
+{
+	FILE *f;
+	int first, last, count = 0;
+	char sep;
+
+	f = fopen("/sys/devices/system/cpu/possible", "r");
+	if(f)
+	{
+		while(fscanf(f, "%i", &first) == 1)
+		{
+			last = first;
+			if(fscanf(f, "%c", &sep) == 1 && sep == '-')
+			{
+				if(fscanf(f, "%i", &last) != 1) break;
+				if(fscanf(f, "%c", &sep) != 1) sep = '\n';
+			}
+			count += last - first + 1;
+			if(sep != ',') break;
+		}
+		fclose(f);
+	}
+
+	return count > 0 ? count : sysconf(_SC_NPROCESSORS_CONF);
+}
+
+__attribute__((cold)) void InitializeEbpf()
+{
+	union bpf_attr attr;
+	struct bpf_insn program[128];
+	static char log[65536];
+	char command[1024];
+	unsigned int capacity;
+
+	ebpf_cpus = possible_cpus();
+	ebpf_values = calloc(ebpf_cpus, sizeof(struct EbpfValue));
+
+	/* Previous totals: twice as many slots as the map can hold */
+	for(ebpf_seen_bits = 1; (1U << ebpf_seen_bits) < 2 * ltEbpfMaxClients; ebpf_seen_bits ++);
+	capacity = 1U << ebpf_seen_bits;
+	ebpf_seen[0] = calloc(capacity, sizeof(struct EbpfClient));
+	ebpf_seen[1] = calloc(capacity, sizeof(struct EbpfClient));
+	ebpf_idle_keys = calloc(ltEbpfMaxClients, sizeof(struct IpAddr));
+	if(!ebpf_values || !ebpf_seen[0] || !ebpf_seen[1] || !ebpf_idle_keys)
+	{
+		fprintf(stderr, "calloc() for eBPF map copies failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.map_type = BPF_MAP_TYPE_PERCPU_HASH;
+	attr.key_size = sizeof(struct IpAddr);
+	attr.value_size = sizeof(struct EbpfValue);
+	attr.max_entries = ltEbpfMaxClients;
+	ebpf_map_fd = bpf(BPF_MAP_CREATE, &attr);
+	if(ebpf_map_fd < 0)
+	{
+		fprintf(stderr, "bpf(BPF_MAP_CREATE, %u entries) failed: %s\n", ltEbpfMaxClients, strerror(errno));
+		exit(1);
+	}
+
+	memset(&attr, 0, sizeof(attr));
+	attr.prog_type = BPF_PROG_TYPE_SCHED_CLS;
+	attr.insns = (uintptr_t) program;
+	attr.insn_cnt = EbpfBuildProgram(program, CaptureSourcePort());
+	attr.license = (uintptr_t) "GPL";
+	attr.log_buf = (uintptr_t) log;
+	attr.log_size = sizeof(log);
+	attr.log_level = 1;
+	ebpf_prog_fd = bpf(BPF_PROG_LOAD, &attr);
+	if(ebpf_prog_fd < 0)
+	{
+		fprintf(stderr, "bpf(BPF_PROG_LOAD) failed: %s\n%s\n", strerror(errno), log);
+		exit(1);
+	}
+
+	unlink(EBPF_PIN_PATH); /* left by the previous run */
+	memset(&attr, 0, sizeof(attr));
+	attr.pathname = (uintptr_t) EBPF_PIN_PATH;
+	attr.bpf_fd = ebpf_prog_fd;
+	if(bpf(BPF_OBJ_PIN, &attr) < 0)
+	{
+		fprintf(stderr, "bpf(BPF_OBJ_PIN, %s) failed: %s (is bpffs mounted on /sys/fs/bpf?)\n", EBPF_PIN_PATH, strerror(errno));
+		exit(1);
+	}
+
+	snprintf(command, 1024, "%s qdisc replace dev %s clsact", ltTc, ltNetworkInterface);
+	system_or_fatal(command);
+
+	snprintf(command, 1024, "%s filter replace dev %s egress pref 1 handle 1 bpf direct-action object-pinned %s",
+		ltTc, ltNetworkInterface, EBPF_PIN_PATH);
+	system_or_fatal(command);
+
+	fprintf(stderr, "Counting egress traffic of %s in the kernel (eBPF, filter: %s)\n", ltNetworkInterface, ltTcpDumpOptions);
+}
+
+__attribute__((cold)) void TerminateEbpf()
+{
+	char command[1024];
+
+	if(ebpf_prog_fd < 0)
+		return;
+
+	snprintf(command, 1024, "%s filter del dev %s egress pref 1 handle 1 bpf", ltTc, ltNetworkInterface);
+	fprintf(stderr, "$ %s\n", command);
+	if(system(command) != 0)
+		fprintf(stderr, "WARNING: '%s' failed.\n", command);
+
+	unlink(EBPF_PIN_PATH);
+	close(ebpf_prog_fd);
+	close(ebpf_map_fd);
+	ebpf_prog_fd = ebpf_map_fd = -1;
+
+	free(ebpf_values);
+	free(ebpf_seen[0]);
+	free(ebpf_seen[1]);
+	free(ebpf_idle_keys);
+}
+
+/*
+	Walk the map and pass the traffic since the previous walk to HandleTraffic().
+	The cost depends on the number of clients, not on the number of packets.
+*/
+__attribute__((hot)) static void EbpfCollect()
+{
+	union bpf_attr attr;
+	struct IpAddr key, next_key;
+	struct EbpfClient *prev = ebpf_seen[0], *cur = ebpf_seen[1], *c;
+	unsigned int mask = (1U << ebpf_seen_bits) - 1;
+	unsigned int i, idle_count = 0;
+	uint64_t bytes, packets, prev_bytes, prev_packets, idle;
+	int cpu, first = 1;
+
+	while(1)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = ebpf_map_fd;
+		attr.key = first ? 0 : (uintptr_t) &key;
+		attr.next_key = (uintptr_t) &next_key;
+		if(bpf(BPF_MAP_GET_NEXT_KEY, &attr) < 0)
+			break; /* ENOENT: end of the map */
+		key = next_key;
+		first = 0;
+
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = ebpf_map_fd;
+		attr.key = (uintptr_t) &key;
+		attr.value = (uintptr_t) ebpf_values;
+		if(bpf(BPF_MAP_LOOKUP_ELEM, &attr) < 0)
+			continue; /* deleted meanwhile */
+
+		bytes = packets = 0;
+		for(cpu = 0; cpu < ebpf_cpus; cpu ++)
+		{
+			bytes += ebpf_values[cpu].bytes;
+			packets += ebpf_values[cpu].packets;
+		}
+
+		/* Totals at the previous walk */
+		prev_bytes = prev_packets = idle = 0;
+		for(i = IpAddrHash(&key) >> (32 - ebpf_seen_bits); !IpAddrIsEmpty(&prev[i].ip); i = (i + 1) & mask)
+		{
+			if(IpAddrEqual(&prev[i].ip, &key))
+			{
+				prev_bytes = prev[i].bytes;
+				prev_packets = prev[i].packets;
+				idle = prev[i].idle;
+				break;
+			}
+		}
+
+		if(bytes != prev_bytes)
+		{
+			HandleTraffic(&key, bytes - prev_bytes, packets - prev_packets);
+			idle = 0;
+		}
+		else if(++ idle >= EBPF_IDLE_WALKS && idle_count < ltEbpfMaxClients)
+		{
+			ebpf_idle_keys[idle_count ++] = key;
+			continue; /* forget it */
+		}
+
+		for(i = IpAddrHash(&key) >> (32 - ebpf_seen_bits); !IpAddrIsEmpty(&cur[i].ip); i = (i + 1) & mask);
+		c = &cur[i];
+		c->ip = key;
+		c->idle = idle;
+		c->bytes = bytes;
+		c->packets = packets;
+	}
+
+	/*
+		Remove idle clients, so that the map doesn't become full.
+		NOTE: a packet counted between the lookup and this deletion is lost,
+		which is acceptable for a client that has been idle for EBPF_IDLE_WALKS.
+	*/
+	for(i = 0; i < idle_count; i ++)
+	{
+		memset(&attr, 0, sizeof(attr));
+		attr.map_fd = ebpf_map_fd;
+		attr.key = (uintptr_t) &ebpf_idle_keys[i];
+		bpf(BPF_MAP_DELETE_ELEM, &attr);
+	}
+
+	memset(prev, 0, sizeof(struct EbpfClient) << ebpf_seen_bits);
+	ebpf_seen[0] = cur;
+	ebpf_seen[1] = prev;
+}
+
+__attribute__((hot)) void CaptureLoopEbpf()
+{
+	while(1)
+	{
+		sleep(1);
+		time(&TIME);
+
+		EbpfCollect();
+		AnalyzeIfDue();
+	}
+}
@@ -0,0 +1,30 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_EBPF_H
+#define _LIMITTRAF_EBPF_H
+
+/*
+	LIMITTRAF_CAPTURE_EBPF: packets are counted in the kernel by an eBPF program
+	attached to the clsact egress hook of ltNetworkInterface. It adds the length
+	of each packet to a per-CPU hash map (destination IP -> bytes, packets),
+	and CaptureLoopEbpf() periodically reads the changes of that map.
+	Used by capture.c, see InitializeCapture() and CaptureLoop().
+*/
+void InitializeEbpf();
+void TerminateEbpf();
+void CaptureLoopEbpf();
+
+#endif
@@ -0,0 +1,152 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_IPADDR_H
+#define _LIMITTRAF_IPADDR_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <arpa/inet.h>
+
+/*
+	Client address, the key of all per-client data (from capture to actions).
+	IPv6 addresses are stored as is, IPv4 ones as IPv4-mapped IPv6 (::ffff:a.b.c.d),
+	so that both families are compared and hashed the same way.
+	All zeros (::) means "no address" (empty slot of a hash table).
+
+	Text is only made for logging, see IpAddrToString().
+*/
+struct IpAddr
+{
+	uint8_t addr[16]; /* network byte order */
+};
+
+#define IPADDR_STRLEN INET6_ADDRSTRLEN /* buffer size for IpAddrToString() */
+
+static const uint8_t IPADDR_V4_PREFIX[12] = { 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0xff, 0xff };
+
+/* 'ip' is in host byte order */
+static inline void IpAddrFromIpv4(struct IpAddr *dst, uint32_t ip)
+{
+	memcpy(dst->addr, IPADDR_V4_PREFIX, 12);
+	dst->addr[12] = ip >> 24;
+	dst->addr[13] = ip >> 16;
+	dst->addr[14] = ip >> 8;
+	dst->addr[15] = ip;
+}
+
+/* 'addr' is 4 bytes in network byte order */
+static inline void IpAddrFromIpv4Bytes(struct IpAddr *dst, const void *addr)
+{
+	memcpy(dst->addr, IPADDR_V4_PREFIX, 12);
+	memcpy(dst->addr + 12, addr, 4);
+}
+
+static inline int IpAddrIsIpv4(const struct IpAddr *ip)
+{
+	return !memcmp(ip->addr, IPADDR_V4_PREFIX, 12);
+}
+
+/* Only for IpAddrIsIpv4(): the address in host byte order */
+static inline uint32_t IpAddrIpv4(const struct IpAddr *ip)
+{
+	return ((uint32_t) ip->addr[12] << 24) | (ip->addr[13] << 16) | (ip->addr[14] << 8) | ip->addr[15];
+}
+
+static inline int IpAddrEqual(const struct IpAddr *a, const struct IpAddr *b)
+{
+	return !memcmp(a->addr, b->addr, 16);
+}
+
+static inline int IpAddrIsEmpty(const struct IpAddr *ip)
+{
+	static const struct IpAddr empty;
+	return IpAddrEqual(ip, &empty);
+}
+
+/*
+	Network of 'ip' for the "PER /prefix" rules (see limittraf.conf): /prefix of IPv4 addresses,
+	/(prefix + 32) of IPv6 ones, so that e.g. /24 and /16 become /56 and /48, the usual
+	allocations of a home and a site. The result is :: for some reserved IPv6 addresses (e.g. ::1).
+*/
+static inline unsigned int IpAddrSubnetLength(const struct IpAddr *ip, unsigned int prefix)
+{
+	return IpAddrIsIpv4(ip) ? prefix : prefix + 32;
+}
+
+static inline void IpAddrSubnet(struct IpAddr *dst, const struct IpAddr *ip, unsigned int prefix)
+{
+	unsigned int bits = (IpAddrIsIpv4(ip) ? 96 : 0) + IpAddrSubnetLength(ip, prefix), i;
+
+	*dst = *ip;
+	if(bits % 8)
+		dst->addr[bits / 8] &= 0xff << (8 - bits % 8);
+	for(i = (bits + 7) / 8; i < 16; i ++)
+		dst->addr[i] = 0;
+}
+
+/* For hash tables: use the upper bits, e.g. IpAddrHash(ip) >> (32 - bits) */
+static inline uint32_t IpAddrHash(const struct IpAddr *ip)
+{
+	uint32_t w[4];
+	memcpy(w, ip->addr, 16);
+	return (w[0] ^ w[1] ^ w[2] ^ w[3]) * 2654435761U;
+}
+
+/*
+	Destination address and length of the IPv4 or IPv6 packet at 'iph'
+	(same as "> a.b.c.d" and "length N" in the tcpdump output).
+	Returns 0 on success, -1 if this is not an IP packet or if 'caplen' is too short.
+*/
+static inline int IpAddrFromPacket(const uint8_t *iph, unsigned int caplen, struct IpAddr *dst, unsigned int *length)
+{
+	if(caplen < 20)
+		return -1;
+
+	switch(iph[0] >> 4)
+	{
+		case 4:
+			IpAddrFromIpv4Bytes(dst, iph + 16);
+			*length = (iph[2] << 8) | iph[3];
+			return 0;
+		case 6:
+			if(caplen < 40) return -1;
+			memcpy(dst->addr, iph + 24, 16);
+			*length = ((iph[4] << 8) | iph[5]) + 40; /* payload length + fixed header */
+			return 0;
+	}
+	return -1;
+}
+
+/* Returns 'buf', which must have IPADDR_STRLEN bytes */
+static inline const char *IpAddrToString(const struct IpAddr *ip, char *buf)
+{
+	if(IpAddrIsIpv4(ip))
+		return inet_ntop(AF_INET, ip->addr + 12, buf, IPADDR_STRLEN);
+	return inet_ntop(AF_INET6, ip->addr, buf, IPADDR_STRLEN);
+}
+
+/* "a.b.c.d/N" of the subnet from IpAddrSubnet(), just the address if 'prefix' is 0 */
+#define IPADDR_SUBNET_STRLEN (IPADDR_STRLEN + 4)
+static inline const char *IpAddrSubnetToString(const struct IpAddr *subnet, unsigned int prefix, char *buf)
+{
+	IpAddrToString(subnet, buf);
+	if(prefix)
+		sprintf(buf + strlen(buf), "/%u", IpAddrSubnetLength(subnet, prefix));
+	return buf;
+}
+
+#endif
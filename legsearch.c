@@ -24,7 +24,7 @@
 #include "legsearch.h"
 
 const char LEGSEARCH_REGEX[] = "(?:googlebot\\.com|yandex\\.(?:ru|net|com)|mail\\.ru)$"; /* applied to DNS names of client IPs */
-int is_legitimate_search_engine(const char *ip);
+int is_legitimate_search_engine(const struct IpAddr *ip);
 int legsearch_cache_hit_counter = 0;
 int legsearch_cache_miss_counter = 0;
 
@@ -51,10 +51,11 @@ __attribute__((cold)) void TerminateLegSearch()
 	legsearch_extra = NULL;
 }
 
-static int _is_legitimate_search_engine_uncached(const char *ip)
+static int _is_legitimate_search_engine_uncached(const struct IpAddr *ip)
 {
 	struct hostent *host;
-	struct in_addr addr;
+	const void *addr;
+	int family, addr_len;
 	char hostname[HOST_NAME_MAX + 1];
 	int hostname_len;
 	char **p;
@@ -66,10 +67,20 @@ static int _is_legitimate_search_engine_uncached(const char *ip)
 		InitializeLegSearch();
 	}
 	
-	if(inet_pton(AF_INET, ip, &addr) != 1) /* should not happen: IP format is assured by REGEX string */
-		return 0;
+	if(IpAddrIsIpv4(ip))
+	{
+		family = AF_INET;
+		addr = ip->addr + 12;
+		addr_len = 4;
+	}
+	else
+	{
+		family = AF_INET6;
+		addr = ip->addr;
+		addr_len = 16;
+	}
 
-	host = gethostbyaddr(&addr, sizeof(addr), AF_INET);
+	host = gethostbyaddr(addr, addr_len, family);
 	if(!host) return 0; /* lookup failed */
 
 	hostname_len = strlen(host->h_name);
@@ -81,19 +92,19 @@ static int _is_legitimate_search_engine_uncached(const char *ip)
 	hostname[hostname_len] = '\0';
 	
 	/* Check if this reverse DNS entry wasn't lying by making A query */
-	host = gethostbyname(hostname);
+	host = gethostbyname2(hostname, family);
 	if(!host) return 0; /* lookup failed */
 	
 	for(p = host->h_addr_list; *p != NULL; p ++)
 	{
-		if(!memcmp(*p, &addr, sizeof(addr)))
+		if(!memcmp(*p, addr, addr_len))
 			return 1;
 	}
 	
 	return 0;
 }
 
-int is_legitimate_search_engine(const char *ip)
+int is_legitimate_search_engine(const struct IpAddr *ip)
 {
 	/*
 		Let's search the cache first
@@ -16,6 +16,8 @@
 #ifndef _LIMITTRAF_LEGSEARCH_H
 #define _LIMITTRAF_LEGSEARCH_H
 
+#include "ipaddr.h"
+
 /* Compile the regex used by is_legitimate_search_engine() */
 void InitializeLegSearch();
 
@@ -28,6 +30,6 @@ void TerminateLegSearch();
 	@retval 1 A legitimate search engine.
 	@retval 0 Not a search engine (or unknown search engine).
 */
-int is_legitimate_search_engine(const char *ip);
+int is_legitimate_search_engine(const struct IpAddr *ip);
 
 #endif
@@ -13,25 +13,44 @@
 	GNU General Public License for more details.
 */
 
+#include "capture.h" /* LIMITTRAF_CAPTURE_* values for ltCaptureMode */
+
 /*
 	Configuration options
 */
 
 const char *ltCfgFile = "limittraf.conf";
 
+const int ltCaptureMode = LIMITTRAF_CAPTURE_PCAP; // LIMITTRAF_CAPTURE_RING for high packet rates, LIMITTRAF_CAPTURE_TCPDUMP to parse the output of ltTcpDump instead
 const char *ltTcpDump = "tcpdump"; // "/usr/sbin/tcpdump";
 const char *ltNetworkInterface = "em1"; // "eth0"
-const char *ltTcpDumpOptions = "src port 80";
+const unsigned int ltRingBlockSize = 1 << 22; /* LIMITTRAF_CAPTURE_RING: 4 megabytes, must be a multiple of the page size */
+const unsigned int ltRingBlockCount = 64; /* LIMITTRAF_CAPTURE_RING: ring size = ltRingBlockSize * ltRingBlockCount */
+const unsigned int ltRingRetireTimeout = 100; /* LIMITTRAF_CAPTURE_RING: milliseconds before a partially filled block is passed to us */
+const int ltCaptureThreads = 1; /* LIMITTRAF_CAPTURE_RING: number of capture workers (PACKET_FANOUT), e.g. the number of CPU cores */
+const unsigned int ltQueueSize = 1 << 20; /* packets queued by the capture thread (32 bytes each): covers a slow Analyze() */
+const unsigned int ltEbpfMaxClients = 65536; /* LIMITTRAF_CAPTURE_EBPF: size of the kernel map (distinct client IPs) */
+const int ltConntrackDumpInterval = 1; /* LIMITTRAF_CAPTURE_CONNTRACK: seconds between dumps of the conntrack table */
+const char *ltTcpDumpOptions = "src port 80"; /* BPF filter expression (see pcap-filter(7)) */
 
 const char *ltTc = "tc"; // "/sbin/tc"
 
 const char *ltWorkDir = "/tmp/limittraf";
 const char *ltDbFile = "limittraf.db";
+const char *ltArchiveDir = "archive"; /* traffic history (one file per hour), see archive.h */
+const char *ltSnapshotFile = "limittraf.snapshot"; /* state restored after a restart, see SaveSnapshot() */
+const int ltSnapshotInterval = 60; /* seconds between snapshots, 0 = no snapshots */
 const char *ltLogFile = "limittraf.log";
+const unsigned long ltHistoryRetention = 0; /* seconds of traffic kept in ltArchiveDir, 0 = the longest interval of limittraf.conf */
+const unsigned long ltSketchMemory = 0; /* bytes: approximate accounting in fixed memory (see sketch.h), e.g. 4 << 20 to stay in L3; 0 = exact per-client windows */
+const unsigned int ltSketchTopK = 1024; /* clients tracked per interval in the approximate mode */
+const unsigned long ltWindowMemory = 256 << 20; /* bytes: hard limit for the traffic of the clients in the PLAN intervals (see window.h) */
 const unsigned long ltLegitimateSearchEngineCacheExpires = 604800; // 604800 seconds = 1 week
 
 const int ltAnalyzeInterval = 5;
-const unsigned long ltMemoryDumpLevel = 10 * 1204 * 1024; // 10 megabytes
+const unsigned int ltAnalyzeThreads = 0; /* threads of AnalyzeDb() (see pool.h), 0 = one per CPU core */
+const int ltImmediateTriggers = 1; /* also check the levels as the packets arrive, not only in Analyze() (exact mode only, see CheckLevels() in database.c) */
+const unsigned long ltMemoryDumpLevel = 10 * 1024 * 1024; // 10 megabytes
 
 /*
 
@@ -41,52 +60,70 @@ const unsigned long ltMemoryDumpLevel = 10 * 1204 * 1024; // 10 megabytes
 */
 
 #include <stdio.h>
-#include <pcre.h>
+#include <stdlib.h>
 #include <string.h>
 #include <sys/stat.h>
 #include <time.h>
 #include <unistd.h>
 #include <errno.h>
 #include <assert.h>
+#include <arpa/inet.h>
+#include <pthread.h>
 
+#include "limittraf.h"
 #include "conf.h"
 #include "database.h"
 #include "legsearch.h"
 #include "actions.h"
+#include "queue.h"
+#include "writer.h"
+#include "threshold.h"
 
-/*
-	Format of two lines printed by 'tcpdump -fnvKtq', with the newline removed from the first line:
-		IP (tos 0x0, ttl 64, id 46394, offset 0, flags [DF], proto TCP (6), length 1492)    10.205.15.60.80 > 80.102.204.74.1155: tcp 1452
-*/
-static const char TcpDumpRequiredParams[] = "-fnvKtq"; /* These affect the format and therefore must be specified for parsing to success */
+const char *ltReplayFile = NULL; /* --replay FILE: process a pcap file instead of live capture */
 
-static const char TCPDUMP_REGEX[] = "length ([0-9]+).*> ([0-9]+\\.[0-9]+\\.[0-9]+\\.[0-9]+)";
-static const int TCPDUMP_LINE_MAX = 4096;
+time_t TIME = 0; /* = time(NULL), an approximation for timestamp of current packet */
+static time_t last_analyze = 0; /* TIME of the last Analyze(), 0 before the first packet */
+static unsigned long packets_total = 0;
+static double analyze_seconds = 0; /* wall-clock time spent in Analyze() */
+static double account_seconds = 0; /* ConsumeLoop(): time spent in HandleTraffic(), since the last Analyze() */
+static int use_queue = 0; /* CaptureUsesQueue(): capture thread + ConsumeLoop() */
 
-static pcre *tcpdump_regex;
-static pcre_extra *tcpdump_extra;
+static const unsigned int QUEUE_BATCH = 1024; /* packets popped from the queue at once */
 
-time_t TIME = 0; /* = time(NULL), an approximation for timestamp of current packet */
+/*
+	Packets lost by the capture (kernel drops, queue overflows), see LostSince().
+	One record per Analyze() which found new losses, oldest ones are overwritten.
+*/
+#define LOSS_HISTORY 4096
+static struct
+{
+	time_t time;
+	uint64_t lost;
+} loss_history[LOSS_HISTORY];
+static unsigned int loss_count = 0; /* total number of records ever added */
+static uint64_t lost_total = 0; /* as of the last Analyze() */
 
 
 /* ... */
-static void Initialize(); /* Create the database and compile the regex */
+static void ParseArguments(int argc, char **argv);
+static void Initialize(); /* Create the database and open the packet source */
 static void Analyze(); /* Called every ltAnalyzeInterval seconds */
 static void Terminate(); /* Free all used resources */
+static void ReportReplay(double seconds); /* Print the throughput of --replay */
+static void ConsumeLoop(); /* Main thread: account the packets queued by the capture thread */
 
-int main( void )
+static inline double monotonic_seconds()
 {
-	char buffer[TCPDUMP_LINE_MAX];
-	int ovector[9]; /* we have 2 values to match, +1 place for the entire regexp; PCRE requires 3x more space */
-	char *TcpDumpCommand;
-	FILE *tcpdump;
-	int lineno;
-	time_t last_analyze;
-	
-	/* IP and length are determined for each packet */
-	char ip[17]; int length;
-	char length_as_string[6]; /* MTU is never longer than 5 digits in decimal notation */
-	
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+int main(int argc, char **argv)
+{
+	double started;
+
+	ParseArguments(argc, argv);
 	Initialize();
 
 #if 0
@@ -94,101 +131,161 @@ int main( void )
  		"66.249.73.111"
 		// "199.21.99.124"
 		;
-	fprintf(stderr, "%s is%s a legitimate search engine\n", testhost, is_legitimate_search_engine(testhost) ? "" : " NOT");
-	fprintf(stderr, "%s is%s a legitimate search engine\n", testhost, is_legitimate_search_engine(testhost) ? "" : " NOT");
-	fprintf(stderr, "%s is%s a legitimate search engine\n", testhost, is_legitimate_search_engine(testhost) ? "" : " NOT");
+	struct IpAddr testip;
+	IpAddrFromIpv4(&testip, ntohl(inet_addr(testhost)));
+	fprintf(stderr, "%s is%s a legitimate search engine\n", testhost, is_legitimate_search_engine(&testip) ? "" : " NOT");
+	fprintf(stderr, "%s is%s a legitimate search engine\n", testhost, is_legitimate_search_engine(&testip) ? "" : " NOT");
+	fprintf(stderr, "%s is%s a legitimate search engine\n", testhost, is_legitimate_search_engine(&testip) ? "" : " NOT");
 	exit(0);
 #endif
+
+	/* begin Main Loop */
+	started = monotonic_seconds();
+	if(use_queue)
+		ConsumeLoop();
+	else
+		CaptureLoop();
+
+	/* Normally this code is not reached (except for --replay) */
+	if(ltReplayFile)
+	{
+		/* Analyze the tail of the file and move it to the archive */
+		CommitTransaction();
+		Analyze();
+		BeginTransaction();
+
+		ReportReplay(monotonic_seconds() - started);
+	}
+	Terminate();
 	
-	TcpDumpCommand = malloc(1024);
-	if(!TcpDumpCommand)
+	return 0;
+}
+
+/*
+	Called by CaptureLoop() for every captured packet (in the capture thread).
+	With --replay nothing may be lost, so we wait for the main thread instead of dropping.
+*/
+__attribute__((hot)) void HandlePacket(time_t time, const struct IpAddr *ip, unsigned int length)
+{
+	QueuePush(time, ip, length, ltReplayFile != NULL);
+}
+
+static void *CaptureThread(void *arg)
+{
+	(void) arg;
+	CaptureLoop();
+	QueueClose();
+	return NULL;
+}
+
+__attribute__((hot)) static void ConsumeLoop()
+{
+	struct QueueRecord *records;
+	pthread_t thread;
+	unsigned int i, count;
+	double started, analyzed;
+	int ret;
+
+	records = malloc(QUEUE_BATCH * sizeof(struct QueueRecord));
+	if(!records)
 	{
-		fprintf(stderr, "malloc() for TcpDumpCommand failed: %s\n", strerror(errno));
+		fprintf(stderr, "malloc() for queue batch failed: %s\n", strerror(errno));
 		exit(1);
 	}
-	snprintf(TcpDumpCommand, 1024, "%s %s %s -i %s", ltTcpDump, ltTcpDumpOptions, TcpDumpRequiredParams, ltNetworkInterface);
-	
-	fprintf(stderr, "Starting %s\n", TcpDumpCommand);
-	tcpdump = popen(TcpDumpCommand, "r");
-	free(TcpDumpCommand);
 
-	if(!tcpdump)
+	ret = pthread_create(&thread, NULL, CaptureThread, NULL);
+	if(ret != 0)
 	{
-		fprintf(stderr, "popen(%s) failed: %s\n", ltTcpDump, strerror(errno));
-		return 1;
+		fprintf(stderr, "pthread_create() for capture thread failed: %s\n", strerror(ret));
+		exit(1);
 	}
-	
-	/* begin Main Loop */
-	lineno = 0;
-	last_analyze = time(NULL);
-	while(fgets(buffer, TCPDUMP_LINE_MAX, tcpdump))
+
+	while(1)
 	{
-		int ret;
-		int off = strlen(buffer);
-#ifndef NDEBUG
-		if(!off)
+		count = QueuePop(records, QUEUE_BATCH);
+		if(!count)
 		{
-			fprintf(stderr, "tcpdump returned an empty line (bug in tcpdump or changed format). Exiting.\n");
-			break;
+			if(QueueIsFinished())
+				break; /* EOF (e.g. --replay) */
+			usleep(1000);
+			continue;
 		}
-#endif
-		fgets(&buffer[off - 1], TCPDUMP_LINE_MAX - off, tcpdump);
-		time(&TIME);
 
-		if((++ lineno) % 100 == 0)
+		started = monotonic_seconds();
+		analyzed = analyze_seconds;
+		for(i = 0; i < count; i ++)
 		{
-			fprintf(stderr, "%i...\n", lineno);
-			if(DbMemoryUsed() > ltMemoryDumpLevel)
-			{
-				CommitTransaction();
-				CompactDb();
-				BeginTransaction();
-			}
-		}
-	
-		ret = pcre_exec(tcpdump_regex, tcpdump_extra, buffer, strlen(buffer), 0, 0, ovector, 9);
-		if(ret < 0)
-		{
-			fprintf(stderr, "pcre_exec() returned %i on [[%s]]\n", ret, buffer);
-			continue;
+			TIME = records[i].time;
+			HandleTraffic(&records[i].ip, records[i].length, 1);
+			AnalyzeIfDue();
 		}
+		account_seconds += monotonic_seconds() - started - (analyze_seconds - analyzed);
+	}
 
-		pcre_copy_substring(buffer, ovector, 8, 1, length_as_string, 6);
-		pcre_copy_substring(buffer, ovector, 8, 2, ip, 17);
-		
-//		fprintf(stderr, "[%6i] Length %s from %s\n", lineno, length_as_string, ip);
-		
-		length = atoi(length_as_string);
-		Register(ip, length);
+	pthread_join(thread, NULL);
+	free(records);
+}
 
-		if(TIME - last_analyze > ltAnalyzeInterval)
-		{
-			last_analyze = TIME;
+__attribute__((hot)) void HandleTraffic(const struct IpAddr *ip, uint64_t bytes, unsigned int packets)
+{
+	static unsigned long registered = 0; /* number of Register() calls */
 
-			/* No error checking on commits because this is our private in-memory database */
+	packets_total += packets;
+	if((++ registered) % 100 == 0)
+	{
+		if(!ltReplayFile)
+			fprintf(stderr, "%lu...\n", packets_total);
+		if(DbMemoryUsed() > ltMemoryDumpLevel)
+		{
 			CommitTransaction();
-			Analyze();
+			CompactDb();
 			BeginTransaction();
 		}
 	}
 
-	/* Normally this code is not reached */
-	pclose(tcpdump);
-	Terminate();
-	
-	return 0;
+	Register(ip, bytes);
 }
 
-__attribute__((cold)) static void CompileTcpdumpRegex()
+__attribute__((hot)) void AnalyzeIfDue()
 {
-	const char *error; int erroffset;
-	tcpdump_regex = pcre_compile(TCPDUMP_REGEX, PCRE_NO_UTF8_CHECK, &error, &erroffset, NULL);
-	if(!tcpdump_regex)
+	if(!last_analyze)
+		last_analyze = TIME; /* first packet */
+
+	/* NOTE: with --replay TIME comes from the file, so Analyze() follows the schedule of the recorded traffic */
+	if(TIME - last_analyze > ltAnalyzeInterval)
 	{
-		fprintf(stderr, "Failed to compile regexp: '%s': %s\n", TCPDUMP_REGEX, error);
-		exit(1);
+		last_analyze = TIME;
+
+		/* No error checking on commits because this is our private in-memory database */
+		CommitTransaction();
+		Analyze();
+		BeginTransaction();
+	}
+}
+
+__attribute__((cold)) static void Usage(const char *argv0)
+{
+	fprintf(stderr, "Usage: %s [--replay FILE.pcap]\n", argv0);
+	exit(1);
+}
+
+__attribute__((cold)) static void ParseArguments(int argc, char **argv)
+{
+	int i;
+	for(i = 1; i < argc; i ++)
+	{
+		if(!strcmp(argv[i], "--replay") && i + 1 < argc)
+		{
+			/* absolute path: Initialize() changes the current directory to ltWorkDir */
+			ltReplayFile = realpath(argv[++ i], NULL);
+			if(!ltReplayFile)
+			{
+				fprintf(stderr, "%s: %s\n", argv[i], strerror(errno));
+				exit(1);
+			}
+		}
+		else Usage(argv[0]);
 	}
-	tcpdump_extra = pcre_study(tcpdump_regex, PCRE_STUDY_JIT_COMPILE, &error); /* returned NULL is ok here */
 }
 
 __attribute__((cold)) static void Initialize()
@@ -202,17 +299,48 @@ __attribute__((cold)) static void Initialize()
 	}
 	chdir(ltWorkDir);
 	
-	CompileTcpdumpRegex();
 	InitializeLegSearch();
 	InitializeActions();
 	InitializeDb();
+	InitializeCapture();
+
+	use_queue = CaptureUsesQueue();
+	if(use_queue)
+		InitializeQueue(ltQueueSize);
 }
 __attribute__((cold)) static void Terminate()
 {
+	TerminateCapture();
+	if(use_queue)
+		TerminateQueue();
 	TerminateDb();
 	TerminateActions();
 	TerminateLegSearch();
-	if(tcpdump_extra) pcre_free_study(tcpdump_extra);
+}
+
+/*
+	Remember that 'lost' packets were lost by the capture before 'time'.
+*/
+static void RecordLoss(time_t time, uint64_t lost)
+{
+	loss_history[loss_count % LOSS_HISTORY].time = time;
+	loss_history[loss_count % LOSS_HISTORY].lost = lost;
+	loss_count ++;
+}
+
+uint64_t LostSince(time_t since)
+{
+	unsigned int i, oldest;
+	uint64_t lost = 0;
+
+	oldest = loss_count > LOSS_HISTORY ? loss_count - LOSS_HISTORY : 0;
+	for(i = loss_count; i > oldest; i --)
+	{
+		if(loss_history[(i - 1) % LOSS_HISTORY].time <= since)
+			break;
+		lost += loss_history[(i - 1) % LOSS_HISTORY].lost;
+	}
+	return lost;
 }
 
 /**
@@ -221,9 +349,70 @@ __attribute__((cold)) static void Terminate()
 */
 __attribute__((hot)) static void Analyze()
 {
-	fprintf(stderr, "Analyzing...\n");
-	
+	static double last_snapshot = 0; /* monotonic: snapshots are about real time, even with --replay */
+	double started = monotonic_seconds(), t_analyze, t_compact, t_save, t_snapshot;
+	uint64_t depth = 0, max_depth = 0, overflows = 0, lost;
+	struct CaptureStats stats;
+	struct WriterStats writer;
+	struct WindowsStats windows;
+
+	/*
+		Losses are collected before AnalyzeDb(),
+		so that it can mark the intervals which don't have all the traffic.
+	*/
+	CaptureStatistics(&stats);
+	if(use_queue)
+		QueueStats(&depth, &max_depth, &overflows);
+
+	lost = stats.dropped + overflows - lost_total;
+	if(stats.dropped + overflows < lost_total)
+		lost = 0; /* the counters were reset (e.g. tcpdump was restarted) */
+	lost_total = stats.dropped + overflows;
+	if(lost)
+		RecordLoss(TIME, lost);
+
+	fprintf(stderr, "Analyzing... (capture: %lu received, %lu dropped, %lu lost since the last time%s",
+		(unsigned long) stats.received, (unsigned long) stats.dropped, (unsigned long) lost, lost ? " - LOSSY" : "");
+	if(stats.backlog_unit)
+		fprintf(stderr, ", backlog: %lu %s", (unsigned long) stats.backlog, stats.backlog_unit);
+	if(use_queue)
+		fprintf(stderr, "; queue: %lu packets, max %lu since the last time, %lu dropped in total",
+			(unsigned long) depth, (unsigned long) max_depth, (unsigned long) overflows);
+	WriterStatistics(&writer);
+	fprintf(stderr, "; writer: %u jobs (%lu KB) queued, lag %.3f seconds, busy %.3f seconds since the last time",
+		writer.jobs, (unsigned long) (writer.bytes >> 10), writer.lag, writer.busy);
+	WindowsStatistics(&windows);
+	fprintf(stderr, "; windows: %lu clients, %lu of %lu KB, %lu evicted, %lu rejected in total; levels: %s)\n",
+		(unsigned long) windows.clients, (unsigned long) (windows.memory >> 10), (unsigned long) (windows.budget >> 10),
+		(unsigned long) windows.evicted, (unsigned long) windows.rejected, ThresholdKernel());
+
+	t_analyze = monotonic_seconds();
 	AnalyzeDb(); /* the actual work is performed here */
+	t_compact = monotonic_seconds();
 	CompactDb();
+	t_save = monotonic_seconds();
 	LegSearch_Save();
+	t_snapshot = monotonic_seconds();
+	if(ltSnapshotInterval && t_snapshot - last_snapshot >= ltSnapshotInterval)
+	{
+		SaveSnapshot();
+		last_snapshot = t_snapshot;
+	}
+
+	fprintf(stderr, "Analyze() took %.3f seconds: AnalyzeDb %.3f, CompactDb %.3f, LegSearch_Save %.3f, SaveSnapshot %.3f",
+		monotonic_seconds() - started, t_compact - t_analyze, t_save - t_compact, t_snapshot - t_save, monotonic_seconds() - t_snapshot);
+	if(use_queue)
+		fprintf(stderr, " (accounting since the last time: %.3f)", account_seconds);
+	fprintf(stderr, "\n");
+
+	account_seconds = 0;
+	analyze_seconds += monotonic_seconds() - started;
+}
+
+__attribute__((cold)) static void ReportReplay(double seconds)
+{
+	fprintf(stderr, "Replayed %lu packets from %s in %.3f seconds: %.0f packets per second"
+		" (%.3f seconds in Analyze(), %.0f packets per second without it)\n",
+		packets_total, ltReplayFile, seconds, packets_total / seconds,
+		analyze_seconds, packets_total / (seconds - analyze_seconds));
 }
@@ -17,13 +17,66 @@
 #define _LIMITTRAF_H
 
 #include <time.h>
+#include <stdint.h>
+
+#include "ipaddr.h"
+
+extern const char *ltCfgFile;
 
 extern const char *ltTc; /* Path to the 'tc' binary */
 extern const char *ltNetworkInterface; /* e.g. 'eth0' */
 
+extern const int ltCaptureMode; /* LIMITTRAF_CAPTURE_* constant from capture.h */
+extern const char *ltTcpDump; /* Path to the 'tcpdump' binary */
+extern const char *ltTcpDumpOptions; /* BPF filter, e.g. 'src port 80' */
+
+extern const unsigned int ltRingBlockSize; /* TPACKET_V3 ring parameters, see ring.c */
+extern const unsigned int ltRingBlockCount;
+extern const unsigned int ltRingRetireTimeout;
+extern const int ltCaptureThreads;
+extern const unsigned int ltEbpfMaxClients; /* LIMITTRAF_CAPTURE_EBPF: size of the kernel map, see ebpf.c */
+extern const unsigned int ltQueueSize; /* packets between the capture thread and the main thread, see queue.h */
+extern const int ltConntrackDumpInterval; /* LIMITTRAF_CAPTURE_CONNTRACK: seconds between dumps, see conntrack.c */
+
+extern const char *ltReplayFile; /* --replay: pcap file to process instead of live capture, or NULL */
+
 extern const char *ltDbFile;
+extern const char *ltArchiveDir;
+extern const char *ltSnapshotFile;
+extern const int ltSnapshotInterval; /* seconds, see SaveSnapshot() */
 extern const char *ltLogFile;
+extern const unsigned long ltHistoryRetention; /* seconds, see ExpireHistory() */
+extern const unsigned long ltSketchMemory; /* bytes, 0 = exact mode, see sketch.h */
+extern const unsigned int ltSketchTopK;
+extern const unsigned long ltWindowMemory; /* bytes, see window.h */
+extern const unsigned int ltAnalyzeThreads; /* 0 = one per CPU core */
+extern const int ltImmediateTriggers; /* 1 = the levels are also checked by Register() */
 
 extern time_t TIME; /* = time(NULL), an approximation for timestamp of current packet */
 
+/*
+	Account one packet ('length' bytes sent to 'ip' at 'time').
+	Called by CaptureLoop() in the capture thread: the packet is only queued,
+	it's accounted later by the main thread (which also runs Analyze()).
+*/
+void HandlePacket(time_t time, const struct IpAddr *ip, unsigned int length);
+
+/*
+	Account 'bytes' sent to 'ip' in 'packets' packets (already summed up by a capture worker).
+	Unlike HandlePacket(), never runs Analyze(): call AnalyzeIfDue() after a group of these.
+*/
+void HandleTraffic(const struct IpAddr *ip, uint64_t bytes, unsigned int packets);
+
+/*
+	Run Analyze() if more than ltAnalyzeInterval seconds have passed since the previous one.
+*/
+void AnalyzeIfDue();
+
+/*
+	Number of packets which were lost by the capture (dropped by the kernel,
+	by the queue, etc.) after 'since', as noticed by Analyze().
+	Used by AnalyzeDb() to mark the intervals where the traffic is underestimated.
+*/
+uint64_t LostSince(time_t since);
+
 #endif
@@ -0,0 +1,165 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+/*
+	ltarchive - read the traffic archive of limittraf (see archive.h) offline.
+
+	ltarchive DIR stat                  - files, blocks, records and time range
+	ltarchive DIR dump FROM TO [IP]     - records with FROM < time < TO: "time ip bytes"
+	ltarchive DIR sum FROM TO           - bytes of each client with FROM < time < TO: "ip bytes", descending
+
+	FROM and TO are UNIX timestamps. Used by analyze_postfactum.pl.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <inttypes.h>
+
+#include "archive.h"
+
+struct ClientSum
+{
+	struct IpAddr ip;
+	uint64_t bytes;
+};
+
+static struct ClientSum *sums = NULL;
+static uint64_t sums_count = 0, sums_size = 0;
+
+static void PrintRecord(time_t time, const struct IpAddr *ip, uint64_t bytes, void *arg)
+{
+	char ip_text[IPADDR_STRLEN];
+	(void) arg;
+
+	printf("%lld %s %" PRIu64 "\n", (long long) time, IpAddrToString(ip, ip_text), bytes);
+}
+
+static void CollectRecord(time_t time, const struct IpAddr *ip, uint64_t bytes, void *arg)
+{
+	(void) time; (void) arg;
+
+	if(sums_count == sums_size)
+	{
+		sums_size = sums_size ? sums_size * 2 : 65536;
+		sums = realloc(sums, sums_size * sizeof(struct ClientSum));
+		if(!sums)
+		{
+			fprintf(stderr, "realloc() for %" PRIu64 " records failed\n", sums_size);
+			exit(1);
+		}
+	}
+	sums[sums_count].ip = *ip;
+	sums[sums_count].bytes = bytes;
+	sums_count ++;
+}
+
+static int compare_by_ip(const void *a, const void *b)
+{
+	return memcmp(((const struct ClientSum *) a)->ip.addr, ((const struct ClientSum *) b)->ip.addr, 16);
+}
+
+static int compare_by_bytes_desc(const void *a, const void *b)
+{
+	uint64_t x = ((const struct ClientSum *) a)->bytes, y = ((const struct ClientSum *) b)->bytes;
+	return x < y ? 1 : (x > y ? -1 : 0);
+}
+
+static int ParseIp(const char *text, struct IpAddr *ip)
+{
+	struct in_addr addr;
+
+	if(inet_pton(AF_INET, text, &addr) == 1)
+	{
+		IpAddrFromIpv4Bytes(ip, &addr);
+		return 0;
+	}
+	return inet_pton(AF_INET6, text, ip->addr) == 1 ? 0 : -1;
+}
+
+static void Usage()
+{
+	fprintf(stderr,
+		"Usage:\n"
+		"\tltarchive DIR stat\n"
+		"\tltarchive DIR dump FROM TO [IP]\n"
+		"\tltarchive DIR sum FROM TO\n");
+	exit(2);
+}
+
+int main(int argc, char **argv)
+{
+	struct ArchiveSummary summary;
+	struct IpAddr ip;
+	char ip_text[IPADDR_STRLEN];
+	time_t from, to;
+	uint64_t i, n;
+
+	if(argc < 3)
+		Usage();
+
+	if(!strcmp(argv[2], "stat"))
+	{
+		if(ArchiveSummarize(argv[1], &summary) < 0)
+		{
+			printf("files: %" PRIu64 ", bytes: %" PRIu64 ", no records\n", summary.files, summary.bytes);
+			return 0;
+		}
+		printf("files: %" PRIu64 "\nblocks: %" PRIu64 "\nrecords: %" PRIu64 "\nbytes: %" PRIu64 " (%.2f per record)\nfrom: %lld\nto: %lld\n",
+			summary.files, summary.blocks, summary.records, summary.bytes, (double) summary.bytes / summary.records,
+			(long long) summary.time_min, (long long) summary.time_max);
+		return 0;
+	}
+
+	if(argc < 5)
+		Usage();
+	from = strtoll(argv[3], NULL, 10);
+	to = strtoll(argv[4], NULL, 10);
+
+	if(!strcmp(argv[2], "dump"))
+	{
+		if(argc > 5 && ParseIp(argv[5], &ip) < 0)
+		{
+			fprintf(stderr, "Not an IP address: %s\n", argv[5]);
+			return 2;
+		}
+		ArchiveRead(argv[1], from, to, argc > 5 ? &ip : NULL, PrintRecord, NULL);
+		return 0;
+	}
+
+	if(!strcmp(argv[2], "sum"))
+	{
+		ArchiveRead(argv[1], from, to, NULL, CollectRecord, NULL);
+
+		/* Sum the records of each address, then order by the sums */
+		qsort(sums, sums_count, sizeof(struct ClientSum), compare_by_ip);
+		for(i = 0, n = 0; i < sums_count; i ++)
+		{
+			if(n && IpAddrEqual(&sums[n - 1].ip, &sums[i].ip))
+				sums[n - 1].bytes += sums[i].bytes;
+			else
+				sums[n ++] = sums[i];
+		}
+		qsort(sums, n, sizeof(struct ClientSum), compare_by_bytes_desc);
+
+		for(i = 0; i < n; i ++)
+			printf("%s %" PRIu64 "\n", IpAddrToString(&sums[i].ip, ip_text), sums[i].bytes);
+		free(sums);
+		return 0;
+	}
+
+	Usage();
+	return 2;
+}
@@ -0,0 +1,148 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "pool.h"
+
+/* All fields below are protected by 'lock' */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t start = PTHREAD_COND_INITIALIZER; /* a new job or the workers must stop */
+static pthread_cond_t finished = PTHREAD_COND_INITIALIZER; /* the last part of the job is done */
+static void (*job)(unsigned int part, unsigned int parts, void *arg);
+static void *job_arg;
+static unsigned int job_parts;
+static unsigned long generation = 0; /* number of the job, so that a worker doesn't do one twice */
+static unsigned int pending = 0; /* parts of the workers which are not done yet */
+static int stopping = 0;
+
+static pthread_t *threads = NULL;
+static unsigned int size = 1; /* including the caller of PoolRun() */
+
+static void *PoolThread(void *arg)
+{
+	unsigned int part = (unsigned int) (uintptr_t) arg;
+	unsigned long seen = 0;
+
+	pthread_mutex_lock(&lock);
+	while(1)
+	{
+		while(generation == seen && !stopping)
+			pthread_cond_wait(&start, &lock);
+		if(stopping)
+			break;
+		seen = generation;
+		if(part >= job_parts)
+			continue; /* not needed this time */
+
+		pthread_mutex_unlock(&lock);
+		job(part, job_parts, job_arg);
+		pthread_mutex_lock(&lock);
+
+		if(-- pending == 0)
+			pthread_cond_signal(&finished);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+__attribute__((cold)) void InitializePool(unsigned int count)
+{
+	long cpus;
+	unsigned int t;
+	int ret;
+
+	if(!count)
+	{
+		cpus = sysconf(_SC_NPROCESSORS_ONLN);
+		count = cpus > 0 ? cpus : 1;
+	}
+	if(count > POOL_MAX_THREADS)
+		count = POOL_MAX_THREADS;
+
+	stopping = 0;
+	size = 1;
+	if(count == 1)
+		return;
+
+	threads = malloc((count - 1) * sizeof(pthread_t));
+	if(!threads)
+	{
+		fprintf(stderr, "malloc() for the pool threads failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	for(t = 1; t < count; t ++)
+	{
+		ret = pthread_create(&threads[t - 1], NULL, PoolThread, (void *) (uintptr_t) t);
+		if(ret != 0)
+		{
+			fprintf(stderr, "pthread_create() for a pool thread failed: %s\n", strerror(ret));
+			exit(1);
+		}
+		size ++;
+	}
+}
+
+__attribute__((cold)) void TerminatePool()
+{
+	unsigned int t;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&lock);
+
+	for(t = 1; t < size; t ++)
+		pthread_join(threads[t - 1], NULL);
+	free(threads);
+	threads = NULL;
+	size = 1;
+}
+
+unsigned int PoolSize()
+{
+	return size;
+}
+
+void PoolRun(void (*run)(unsigned int part, unsigned int parts, void *arg), void *arg, unsigned int parts)
+{
+	if(parts <= 1)
+	{
+		run(0, 1, arg);
+		return;
+	}
+
+	pthread_mutex_lock(&lock);
+	job = run;
+	job_arg = arg;
+	job_parts = parts;
+	pending = parts - 1;
+	generation ++;
+	pthread_cond_broadcast(&start);
+	pthread_mutex_unlock(&lock);
+
+	run(0, parts, arg);
+
+	pthread_mutex_lock(&lock);
+	while(pending)
+		pthread_cond_wait(&finished, &lock);
+	pthread_mutex_unlock(&lock);
+}
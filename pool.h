@@ -0,0 +1,37 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_POOL_H
+#define _LIMITTRAF_POOL_H
+
+/*
+	Pool: worker threads which split one piece of work (e.g. the clients of AnalyzeDb())
+	into parts. The calling thread does part 0 itself, so a pool of 1 has no threads at all.
+	Only one PoolRun() at a time (the main thread).
+*/
+#define POOL_MAX_THREADS 64
+void InitializePool(unsigned int threads); /* 0 = one per CPU core */
+void TerminatePool();
+
+/* Number of threads, including the caller of PoolRun() */
+unsigned int PoolSize();
+
+/*
+	Call 'job(part, parts, arg)' for every 'part' from 0 to 'parts' - 1 in parallel
+	and return when all of them are done. 'parts' must not be greater than PoolSize().
+*/
+void PoolRun(void (*job)(unsigned int part, unsigned int parts, void *arg), void *arg, unsigned int parts);
+
+#endif
@@ -0,0 +1,85 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "queue.h"
+
+struct Queue queue;
+
+__attribute__((cold)) void InitializeQueue(unsigned int capacity)
+{
+	uint64_t size = 1;
+
+	while(size < capacity)
+		size <<= 1;
+
+	memset(&queue, 0, sizeof(queue));
+	queue.mask = size - 1;
+	queue.records = calloc(size, sizeof(struct QueueRecord));
+	if(!queue.records)
+	{
+		fprintf(stderr, "calloc() for the packet queue (%lu records) failed: %s\n", (unsigned long) size, strerror(errno));
+		exit(1);
+	}
+}
+
+__attribute__((cold)) void TerminateQueue()
+{
+	free(queue.records);
+	queue.records = NULL;
+}
+
+void QueueClose()
+{
+	__atomic_store_n(&queue.closed, 1, __ATOMIC_RELEASE);
+}
+
+__attribute__((hot)) unsigned int QueuePop(struct QueueRecord *records, unsigned int max)
+{
+	uint64_t head = __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE);
+	uint64_t tail = queue.tail;
+	uint64_t depth = head - tail;
+	unsigned int i, count;
+
+	if(depth > queue.max_depth)
+		queue.max_depth = depth;
+
+	count = depth < max ? depth : max;
+	for(i = 0; i < count; i ++)
+		records[i] = queue.records[(tail + i) & queue.mask];
+
+	__atomic_store_n(&queue.tail, tail + count, __ATOMIC_RELEASE);
+	return count;
+}
+
+int QueueIsFinished()
+{
+	/* 'closed' must be read first: the producer sets it after the last push */
+	if(!__atomic_load_n(&queue.closed, __ATOMIC_ACQUIRE))
+		return 0;
+	return __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE) == queue.tail;
+}
+
+void QueueStats(uint64_t *depth, uint64_t *max_depth, uint64_t *overflows)
+{
+	*depth = __atomic_load_n(&queue.head, __ATOMIC_ACQUIRE) - queue.tail;
+	*max_depth = queue.max_depth > *depth ? queue.max_depth : *depth;
+	*overflows = __atomic_load_n(&queue.overflows, __ATOMIC_RELAXED);
+	queue.max_depth = 0;
+}
@@ -0,0 +1,115 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_QUEUE_H
+#define _LIMITTRAF_QUEUE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <sched.h>
+
+#include "ipaddr.h"
+
+/*
+	Queue: bounded single-producer/single-consumer ring of packets,
+	from the capture thread (QueuePush) to the main thread (QueuePop),
+	so that a slow Analyze() doesn't stop the reading of packets.
+	No locks: each side only writes its own index.
+*/
+struct QueueRecord
+{
+	int64_t time; /* timestamp of the packet (TIME) */
+	struct IpAddr ip;
+	uint32_t length;
+};
+
+struct Queue
+{
+	struct QueueRecord *records;
+	uint64_t mask; /* capacity - 1 (capacity is a power of 2) */
+
+	/* Written by the producer */
+	uint64_t head __attribute__((aligned(64)));
+	uint64_t tail_cache; /* last known 'tail', so that the consumer's cache line is rarely read */
+	uint64_t overflows; /* records dropped because the queue was full */
+	int closed; /* the producer has finished (EOF) */
+
+	/* Written by the consumer */
+	uint64_t tail __attribute__((aligned(64)));
+	uint64_t max_depth; /* since the last QueueStats() */
+};
+
+extern struct Queue queue;
+
+/* 'capacity' is rounded up to a power of 2 */
+void InitializeQueue(unsigned int capacity);
+void TerminateQueue();
+
+/*
+	Producer side: add one packet.
+	If the queue is full, the packet is dropped and counted in 'overflows',
+	or (if 'wait' is set, e.g. for --replay) we wait for the consumer.
+*/
+__attribute__((hot)) static inline void QueuePush(time_t time, const struct IpAddr *ip, unsigned int length, int wait)
+{
+	struct QueueRecord *r;
+	uint64_t head = queue.head;
+
+	if(head - queue.tail_cache > queue.mask)
+	{
+		while(1)
+		{
+			queue.tail_cache = __atomic_load_n(&queue.tail, __ATOMIC_ACQUIRE);
+			if(head - queue.tail_cache <= queue.mask)
+				break;
+
+			if(!wait)
+			{
+				__atomic_store_n(&queue.overflows, queue.overflows + 1, __ATOMIC_RELAXED);
+				return;
+			}
+			sched_yield();
+		}
+	}
+
+	r = &queue.records[head & queue.mask];
+	r->time = time;
+	r->ip = *ip;
+	r->length = length;
+	__atomic_store_n(&queue.head, head + 1, __ATOMIC_RELEASE);
+}
+
+/*
+	Producer side: no more packets will be pushed.
+*/
+void QueueClose();
+
+/*
+	Consumer side: copy up to 'max' packets into 'records'.
+	Returns the number of packets, 0 if the queue is empty.
+*/
+unsigned int QueuePop(struct QueueRecord *records, unsigned int max);
+
+/*
+	Consumer side: 1 if QueueClose() was called and all packets were popped.
+*/
+int QueueIsFinished();
+
+/*
+	Current depth, maximum depth since the previous call and the total number of dropped packets.
+*/
+void QueueStats(uint64_t *depth, uint64_t *max_depth, uint64_t *overflows);
+
+#endif
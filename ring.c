@@ -0,0 +1,448 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/mman.h>
+#include <sys/ioctl.h>
+#include <net/if.h>
+#include <arpa/inet.h>
+#include <linux/if_packet.h>
+#include <linux/if_ether.h>
+#include <linux/filter.h>
+#include <pthread.h>
+#include <pcap.h>
+
+#include "limittraf.h"
+#include "ring.h"
+#include "shard.h"
+#include "capture.h"
+
+/*
+	The socket is SOCK_DGRAM, so frames start with the IP header (link-layer header is removed).
+	RING_SNAPLEN is enough for IPv4 header with options and for IPv6 header: the BPF filter returns this value
+	for every accepted packet, so the kernel never copies anything beyond it into the ring.
+*/
+static const int RING_SNAPLEN = 64;
+static const unsigned int RING_FRAME_SIZE = 2048; /* only used by the kernel to validate tp_frame_nr in TPACKET_V3 */
+static const int RING_POLL_TIMEOUT = 100; /* milliseconds: workers must call ShardSync() regularly even without traffic */
+
+struct Ring
+{
+	int fd;
+	uint8_t *map; /* 'blocks' blocks of ltRingBlockSize bytes */
+	size_t map_size;
+	unsigned int blocks;
+
+	/* Only with ltCaptureThreads > 1 */
+	pthread_t thread;
+	struct Shard shard;
+};
+
+static struct Ring *rings; /* ltCaptureThreads elements */
+static int ring_count;
+static int ring_is_loopback;
+static int ring_stop; /* set by TerminateRing() to stop the workers */
+static uint64_t ring_received = 0, ring_dropped = 0; /* PACKET_STATISTICS resets the kernel counters, so we sum them */
+
+/*
+	Compile ltTcpDumpOptions for raw IP packets (that's what SOCK_DGRAM socket sees)
+	and attach it to the socket.
+*/
+__attribute__((cold)) static void RingAttachFilter(int fd)
+{
+	pcap_t *dead;
+	struct bpf_program filter;
+	struct sock_fprog fprog;
+
+	dead = pcap_open_dead(DLT_RAW, RING_SNAPLEN);
+	if(!dead)
+	{
+		fprintf(stderr, "pcap_open_dead() failed\n");
+		exit(1);
+	}
+
+	if(pcap_compile(dead, &filter, ltTcpDumpOptions, 1, PCAP_NETMASK_UNKNOWN) < 0)
+	{
+		fprintf(stderr, "pcap_compile(%s) failed: %s\n", ltTcpDumpOptions, pcap_geterr(dead));
+		exit(1);
+	}
+
+	/* struct bpf_insn of libpcap has the same layout as struct sock_filter of the kernel */
+	fprog.len = filter.bf_len;
+	fprog.filter = (struct sock_filter *) filter.bf_insns;
+	if(setsockopt(fd, SOL_SOCKET, SO_ATTACH_FILTER, &fprog, sizeof(fprog)) < 0)
+	{
+		fprintf(stderr, "setsockopt(SO_ATTACH_FILTER, %s) failed: %s\n", ltTcpDumpOptions, strerror(errno));
+		exit(1);
+	}
+
+	pcap_freecode(&filter);
+	pcap_close(dead);
+}
+
+/*
+	Join the socket into the fanout group of all workers.
+
+	PACKET_FANOUT_HASH would distribute flows (the hash includes ports),
+	but each client IP must always be accounted by the same worker,
+	so we use a classic BPF program which selects the worker by the destination address:
+		worker = (ip ^ (ip >> 16)) % ring_count
+	(for IPv6, 'ip' is the last 32 bits of the address).
+	SKF_NET_OFF makes the offset relative to the IP header (for both incoming and outgoing packets).
+*/
+__attribute__((cold)) static void RingJoinFanout(int fd)
+{
+	int arg = (getpid() & 0xffff) | (PACKET_FANOUT_CBPF << 16);
+	struct sock_filter code[] = {
+		BPF_STMT(BPF_LD | BPF_B | BPF_ABS, SKF_NET_OFF), /* A = version and header length */
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 4), /* A = IP version */
+		BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 6, 0, 2),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 36), /* IPv6: A = destination address (last 32 bits) */
+		BPF_JUMP(BPF_JMP | BPF_JA, 1, 0, 0),
+		BPF_STMT(BPF_LD | BPF_W | BPF_ABS, SKF_NET_OFF + 16), /* IPv4: A = destination address */
+		BPF_STMT(BPF_MISC | BPF_TAX, 0), /* X = A */
+		BPF_STMT(BPF_ALU | BPF_RSH | BPF_K, 16), /* A >>= 16 */
+		BPF_STMT(BPF_ALU | BPF_XOR | BPF_X, 0), /* A ^= X */
+		BPF_STMT(BPF_ALU | BPF_MOD | BPF_K, ring_count), /* A %= ring_count */
+		BPF_STMT(BPF_RET | BPF_A, 0)
+	};
+	struct sock_fprog fprog;
+
+	if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT, &arg, sizeof(arg)) < 0)
+	{
+		fprintf(stderr, "setsockopt(PACKET_FANOUT) failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	fprog.len = sizeof(code) / sizeof(code[0]);
+	fprog.filter = code;
+	if(setsockopt(fd, SOL_PACKET, PACKET_FANOUT_DATA, &fprog, sizeof(fprog)) < 0)
+	{
+		fprintf(stderr, "setsockopt(PACKET_FANOUT_DATA) failed: %s\n", strerror(errno));
+		exit(1);
+	}
+}
+
+__attribute__((cold)) static void RingOpen(struct Ring *ring, unsigned int blocks)
+{
+	int version = TPACKET_V3;
+	struct tpacket_req3 req;
+	struct sockaddr_ll addr;
+	struct ifreq ifr;
+
+	/*
+		Protocol 0: the socket receives nothing until bind(),
+		so that no packets are queued before the filter is attached.
+	*/
+	ring->fd = socket(AF_PACKET, SOCK_DGRAM, 0);
+	if(ring->fd < 0)
+	{
+		fprintf(stderr, "socket(AF_PACKET) failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0)
+	{
+		fprintf(stderr, "setsockopt(PACKET_VERSION, TPACKET_V3) failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	RingAttachFilter(ring->fd);
+
+	memset(&req, 0, sizeof(req));
+	req.tp_block_size = ltRingBlockSize;
+	req.tp_block_nr = blocks;
+	req.tp_frame_size = RING_FRAME_SIZE;
+	req.tp_frame_nr = (ltRingBlockSize / RING_FRAME_SIZE) * blocks;
+	req.tp_retire_blk_tov = ltRingRetireTimeout;
+	if(setsockopt(ring->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0)
+	{
+		fprintf(stderr, "setsockopt(PACKET_RX_RING, %u blocks of %u bytes) failed: %s\n", blocks, ltRingBlockSize, strerror(errno));
+		exit(1);
+	}
+
+	ring->blocks = blocks;
+	ring->map_size = (size_t) ltRingBlockSize * blocks;
+	ring->map = mmap(NULL, ring->map_size, PROT_READ | PROT_WRITE, MAP_SHARED, ring->fd, 0);
+	if(ring->map == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap() of the packet ring (%zu bytes) failed: %s\n", ring->map_size, strerror(errno));
+		exit(1);
+	}
+
+	memset(&ifr, 0, sizeof(ifr));
+	strncpy(ifr.ifr_name, ltNetworkInterface, IFNAMSIZ - 1);
+	if(ioctl(ring->fd, SIOCGIFINDEX, &ifr) < 0)
+	{
+		fprintf(stderr, "%s: SIOCGIFINDEX failed: %s\n", ltNetworkInterface, strerror(errno));
+		exit(1);
+	}
+
+	memset(&addr, 0, sizeof(addr));
+	addr.sll_family = AF_PACKET;
+	addr.sll_protocol = htons(ETH_P_ALL); /* IPv4 and IPv6 (the filter drops everything else) */
+	addr.sll_ifindex = ifr.ifr_ifindex;
+
+	if(ioctl(ring->fd, SIOCGIFFLAGS, &ifr) < 0)
+	{
+		fprintf(stderr, "%s: SIOCGIFFLAGS failed: %s\n", ltNetworkInterface, strerror(errno));
+		exit(1);
+	}
+	ring_is_loopback = (ifr.ifr_flags & IFF_LOOPBACK) != 0;
+
+	if(bind(ring->fd, (struct sockaddr *) &addr, sizeof(addr)) < 0)
+	{
+		fprintf(stderr, "bind(%s) failed: %s\n", ltNetworkInterface, strerror(errno));
+		exit(1);
+	}
+
+	/* The fanout group can only be joined by a bound socket */
+	if(ring_count > 1)
+		RingJoinFanout(ring->fd);
+}
+
+__attribute__((cold)) void InitializeRing()
+{
+	unsigned int blocks;
+	int i;
+
+	if(ltRingBlockSize % getpagesize() != 0 || ltRingBlockSize < RING_FRAME_SIZE)
+	{
+		fprintf(stderr, "ltRingBlockSize (%u) must be a multiple of the page size (%i)\n", ltRingBlockSize, getpagesize());
+		exit(1);
+	}
+
+	ring_count = ltCaptureThreads > 1 ? ltCaptureThreads : 1;
+	rings = calloc(ring_count, sizeof(struct Ring));
+	if(!rings)
+	{
+		fprintf(stderr, "calloc() for rings failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	/* ltRingBlockCount is the total for all workers */
+	blocks = ltRingBlockCount / ring_count;
+	if(blocks < 2) blocks = 2;
+
+	for(i = 0; i < ring_count; i ++)
+		RingOpen(&rings[i], blocks);
+
+	fprintf(stderr, "Capturing on %s via TPACKET_V3 ring: %i worker(s), %u blocks of %u bytes each (filter: %s)\n",
+		ltNetworkInterface, ring_count, blocks, ltRingBlockSize, ltTcpDumpOptions);
+}
+
+__attribute__((cold)) void TerminateRing()
+{
+	int i;
+
+	if(!rings)
+		return;
+
+	if(ring_count > 1)
+	{
+		__atomic_store_n(&ring_stop, 1, __ATOMIC_RELEASE);
+		for(i = 0; i < ring_count; i ++)
+			if(rings[i].thread)
+				pthread_join(rings[i].thread, NULL);
+	}
+
+	for(i = 0; i < ring_count; i ++)
+	{
+		if(rings[i].map && rings[i].map != MAP_FAILED)
+			munmap(rings[i].map, rings[i].map_size);
+		if(rings[i].fd >= 0)
+			close(rings[i].fd);
+		if(ring_count > 1)
+			TerminateShard(&rings[i].shard);
+	}
+
+	free(rings);
+	rings = NULL;
+}
+
+void RingStatistics(struct CaptureStats *stats)
+{
+	struct tpacket_stats_v3 st;
+	socklen_t len;
+	struct tpacket_block_desc *block;
+	unsigned int j;
+	int i;
+
+	stats->backlog = 0;
+	for(i = 0; i < ring_count; i ++)
+	{
+		len = sizeof(st);
+		if(getsockopt(rings[i].fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) == 0)
+		{
+			/* tp_packets includes tp_drops */
+			ring_received += st.tp_packets;
+			ring_dropped += st.tp_drops;
+		}
+		else
+			fprintf(stderr, "getsockopt(PACKET_STATISTICS) failed: %s\n", strerror(errno));
+
+		/* Blocks filled by the kernel, but not yet processed by the worker (approximate: it's running) */
+		for(j = 0; j < rings[i].blocks; j ++)
+		{
+			block = (struct tpacket_block_desc *) (rings[i].map + (size_t) j * ltRingBlockSize);
+			if(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)
+				stats->backlog ++;
+		}
+	}
+
+	stats->received = ring_received;
+	stats->dropped = ring_dropped;
+	stats->backlog_unit = "blocks";
+}
+
+/*
+	Account all packets of the block in one pass:
+	into 'table' (worker thread) or via HandlePacket() (if 'table' is NULL).
+*/
+__attribute__((hot)) static void RingWalkBlock(struct tpacket_block_desc *block, struct ShardTable *table)
+{
+	struct tpacket3_hdr *frame;
+	const struct sockaddr_ll *sll;
+	struct IpAddr ip;
+	uint32_t i, count;
+	unsigned int length;
+
+	count = block->hdr.bh1.num_pkts;
+	frame = (struct tpacket3_hdr *) ((uint8_t *) block + block->hdr.bh1.offset_to_first_pkt);
+
+	for(i = 0; i < count; i ++, frame = (struct tpacket3_hdr *) ((uint8_t *) frame + frame->tp_next_offset))
+	{
+		/*
+			On loopback every packet is seen twice: as outgoing and as incoming.
+			Count only one of them (libpcap does the same).
+		*/
+		if(ring_is_loopback)
+		{
+			sll = (const struct sockaddr_ll *) ((uint8_t *) frame + TPACKET_ALIGN(sizeof(struct tpacket3_hdr)));
+			if(sll->sll_pkttype == PACKET_OUTGOING)
+				continue;
+		}
+
+		if(IpAddrFromPacket((const uint8_t *) frame + frame->tp_net, frame->tp_snaplen, &ip, &length) < 0)
+			continue;
+
+		if(table)
+			ShardAdd(table, &ip, length);
+		else
+		{
+			HandlePacket(frame->tp_sec, &ip, length);
+		}
+	}
+}
+
+/*
+	Wait for the next block of the ring and account it.
+	Returns 0 on success, 1 if there's no block ready yet, -1 on error.
+*/
+__attribute__((hot)) static inline int RingNextBlock(struct Ring *ring, unsigned int *idx, int timeout, struct ShardTable *table)
+{
+	struct tpacket_block_desc *block;
+	struct pollfd pfd;
+
+	block = (struct tpacket_block_desc *) (ring->map + (size_t) *idx * ltRingBlockSize);
+
+	if(!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER))
+	{
+		/* Kernel still fills this block (it's retired after ltRingRetireTimeout even if not full) */
+		pfd.fd = ring->fd;
+		pfd.events = POLLIN | POLLERR;
+		pfd.revents = 0;
+		if(poll(&pfd, 1, timeout) < 0 && errno != EINTR)
+		{
+			fprintf(stderr, "poll() on the packet ring failed: %s\n", strerror(errno));
+			return -1;
+		}
+		return 1;
+	}
+
+	RingWalkBlock(block, table);
+
+	/* Return the block to the kernel */
+	__atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+	*idx = (*idx + 1) % ring->blocks;
+	return 0;
+}
+
+/*
+	Capture worker (ltCaptureThreads > 1): accounts its share of packets into its own shard.
+	Doesn't touch TIME or the database: the main thread does that in ShardDrain().
+*/
+__attribute__((hot)) static void *RingWorker(void *arg)
+{
+	struct Ring *ring = arg;
+	struct ShardTable *table = &ring->shard.table[ring->shard.acked];
+	unsigned int idx = 0;
+
+	while(!__atomic_load_n(&ring_stop, __ATOMIC_ACQUIRE))
+	{
+		if(RingNextBlock(ring, &idx, RING_POLL_TIMEOUT, table) < 0)
+			break;
+		ShardSync(&ring->shard, &table);
+	}
+	return NULL;
+}
+
+__attribute__((hot)) void CaptureLoopRing()
+{
+	unsigned int idx = 0;
+	int i, ret;
+
+	if(ring_count == 1)
+	{
+		while(RingNextBlock(&rings[0], &idx, -1, NULL) >= 0);
+		return;
+	}
+
+	for(i = 0; i < ring_count; i ++)
+	{
+		InitializeShard(&rings[i].shard);
+
+		ret = pthread_create(&rings[i].thread, NULL, RingWorker, &rings[i]);
+		if(ret != 0)
+		{
+			fprintf(stderr, "pthread_create() for capture worker %i failed: %s\n", i, strerror(ret));
+			exit(1);
+		}
+	}
+
+	/*
+		Main thread: collect the shards every second
+		(this is the granularity of TIME in the database) and run Analyze().
+	*/
+	while(1)
+	{
+		sleep(1);
+		time(&TIME);
+
+		/* One wait for all workers (at most RING_POLL_TIMEOUT), however many there are */
+		for(i = 0; i < ring_count; i ++)
+			ShardSwitch(&rings[i].shard);
+		for(i = 0; i < ring_count; i ++)
+			ShardDrain(&rings[i].shard);
+		AnalyzeIfDue();
+	}
+}
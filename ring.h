@@ -0,0 +1,35 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_RING_H
+#define _LIMITTRAF_RING_H
+
+/*
+	LIMITTRAF_CAPTURE_RING: AF_PACKET socket with a TPACKET_V3 receive ring
+	which is mmap'ed into our address space (no copy and no syscall per packet).
+	Used by capture.c, see InitializeCapture() and CaptureLoop().
+*/
+void InitializeRing();
+void TerminateRing();
+void CaptureLoopRing();
+
+/*
+	Kernel counters (PACKET_STATISTICS) of all rings and the number of blocks
+	waiting for the workers, see CaptureStatistics().
+*/
+struct CaptureStats;
+void RingStatistics(struct CaptureStats *stats);
+
+#endif
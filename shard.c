@@ -0,0 +1,120 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+
+#include "limittraf.h"
+#include "shard.h"
+
+static const unsigned int SHARD_INITIAL_BITS = 12; /* 4096 clients */
+
+static void ShardTableAllocate(struct ShardTable *table, unsigned int bits)
+{
+	size_t capacity = (size_t) 1 << bits;
+
+	table->bits = bits;
+	table->used = 0;
+	table->ip = calloc(capacity, sizeof(struct IpAddr));
+	table->bytes = calloc(capacity, sizeof(uint64_t));
+	table->packets = calloc(capacity, sizeof(uint32_t));
+
+	if(!table->ip || !table->bytes || !table->packets)
+	{
+		fprintf(stderr, "calloc() for shard table (%zu clients) failed: %s\n", capacity, strerror(errno));
+		exit(1);
+	}
+}
+
+static void ShardTableFree(struct ShardTable *table)
+{
+	free(table->ip);
+	free(table->bytes);
+	free(table->packets);
+	table->ip = NULL;
+	table->bytes = NULL;
+	table->packets = NULL;
+}
+
+__attribute__((cold)) void InitializeShard(struct Shard *shard)
+{
+	ShardTableAllocate(&shard->table[0], SHARD_INITIAL_BITS);
+	ShardTableAllocate(&shard->table[1], SHARD_INITIAL_BITS);
+	shard->active = shard->acked = 0;
+}
+
+__attribute__((cold)) void TerminateShard(struct Shard *shard)
+{
+	ShardTableFree(&shard->table[0]);
+	ShardTableFree(&shard->table[1]);
+}
+
+void ShardGrow(struct ShardTable *table)
+{
+	struct ShardTable old = *table;
+	size_t i, capacity = (size_t) 1 << old.bits;
+	unsigned int mask, j;
+
+	ShardTableAllocate(table, old.bits + 1);
+	mask = (1U << table->bits) - 1;
+
+	for(i = 0; i < capacity; i ++)
+	{
+		if(IpAddrIsEmpty(&old.ip[i])) continue;
+
+		j = IpAddrHash(&old.ip[i]) >> (32 - table->bits);
+		while(!IpAddrIsEmpty(&table->ip[j]))
+			j = (j + 1) & mask;
+
+		table->ip[j] = old.ip[i];
+		table->bytes[j] = old.bytes[i];
+		table->packets[j] = old.packets[i];
+		table->used ++;
+	}
+
+	ShardTableFree(&old);
+}
+
+void ShardSwitch(struct Shard *shard)
+{
+	__atomic_store_n(&shard->active, !shard->active, __ATOMIC_RELEASE);
+}
+
+void ShardDrain(struct Shard *shard)
+{
+	unsigned int old = !shard->active;
+	struct ShardTable *table = &shard->table[old];
+	size_t i, capacity;
+
+	/* Wait until the worker stops using the old table (see ShardSwitch()) */
+	while(__atomic_load_n(&shard->acked, __ATOMIC_ACQUIRE) == old)
+		usleep(1000);
+
+	capacity = (size_t) 1 << table->bits;
+	for(i = 0; i < capacity; i ++)
+	{
+		if(IpAddrIsEmpty(&table->ip[i])) continue;
+
+		HandleTraffic(&table->ip[i], table->bytes[i], table->packets[i]);
+
+		memset(&table->ip[i], 0, sizeof(struct IpAddr));
+		table->bytes[i] = 0;
+		table->packets[i] = 0;
+	}
+	table->used = 0;
+}
@@ -0,0 +1,109 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_SHARD_H
+#define _LIMITTRAF_SHARD_H
+
+#include <stdint.h>
+
+#include "ipaddr.h"
+
+/*
+	Shard: per-IP byte counters owned by one capture worker thread.
+
+	The worker adds packets to shard->table[shard->active] without any locks.
+	The main thread periodically calls ShardSwitch(), which switches the worker
+	to the other table, then ShardDrain(), which passes the totals of the old one to HandleTraffic().
+*/
+struct ShardTable
+{
+	struct IpAddr *ip; /* open addressing with linear probing; :: = empty slot */
+	uint64_t *bytes;
+	uint32_t *packets;
+	unsigned int bits; /* capacity = 1 << bits */
+	unsigned int used;
+};
+struct Shard
+{
+	struct ShardTable table[2];
+	unsigned int active; /* table the worker should write to; changed by ShardSwitch() */
+	unsigned int acked; /* table the worker is writing to; changed by ShardSync() */
+};
+
+void InitializeShard(struct Shard *shard);
+void TerminateShard(struct Shard *shard);
+
+/* Resize the table when it becomes too full (called by ShardAdd()) */
+void ShardGrow(struct ShardTable *table);
+
+/*
+	Worker side: account one packet.
+*/
+__attribute__((hot)) static inline void ShardAdd(struct ShardTable *table, const struct IpAddr *ip, unsigned int length)
+{
+	unsigned int mask = (1U << table->bits) - 1;
+	unsigned int i = IpAddrHash(ip) >> (32 - table->bits);
+
+	while(!IpAddrEqual(&table->ip[i], ip))
+	{
+		if(IpAddrIsEmpty(&table->ip[i]))
+		{
+			if(table->used * 4 >= mask * 3) /* 75% full */
+			{
+				ShardGrow(table);
+				ShardAdd(table, ip, length);
+				return;
+			}
+
+			table->ip[i] = *ip;
+			table->used ++;
+			break;
+		}
+		i = (i + 1) & mask;
+	}
+
+	table->bytes[i] += length;
+	table->packets[i] ++;
+}
+
+/*
+	Worker side: should be called between packets (e.g. after each block of the ring).
+	Switches '*table' to another table if ShardSwitch() has requested that.
+*/
+static inline void ShardSync(struct Shard *shard, struct ShardTable **table)
+{
+	unsigned int active = __atomic_load_n(&shard->active, __ATOMIC_ACQUIRE);
+	if(active != shard->acked)
+	{
+		*table = &shard->table[active];
+		__atomic_store_n(&shard->acked, active, __ATOMIC_RELEASE);
+	}
+}
+
+/*
+	Main thread: ask the worker to switch to the other table at its next ShardSync().
+	With several workers, all of them should be switched before the first ShardDrain(),
+	so that they are waited for at the same time, not one after another.
+*/
+void ShardSwitch(struct Shard *shard);
+
+/*
+	Main thread, after ShardSwitch(): collect everything accounted by the worker since the previous ShardDrain().
+	Waits until the worker calls ShardSync(), so the worker must call it regularly
+	even when there's no traffic.
+*/
+void ShardDrain(struct Shard *shard);
+
+#endif
@@ -0,0 +1,353 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "sketch.h"
+#include "conf.h"
+
+static const unsigned int SKETCH_MIN_BITS = 8; /* even if ltSketchMemory is too small */
+static const double SKETCH_E = 2.718281828; /* error bound of Count-Min: e / width of the total */
+
+/*
+	Second hash of the client (the first one is IpAddrHash()): the columns of the rows
+	are h1 + row * h2 (Kirsch-Mitzenmacher), so one pair of hashes is enough for all rows.
+*/
+static inline uint32_t SketchHash2(const struct IpAddr *ip)
+{
+	uint64_t w[2], h;
+	memcpy(w, ip->addr, 16);
+
+	h = w[0] * 0x9e3779b97f4a7c15ULL ^ w[1];
+	h ^= h >> 33;
+	h *= 0xff51afd7ed558ccdULL;
+	h ^= h >> 33;
+	return (uint32_t) h | 1;
+}
+
+static inline void SketchColumns(const struct Sketch *sk, const struct IpAddr *ip, size_t *columns)
+{
+	uint32_t h1 = IpAddrHash(ip), h2 = SketchHash2(ip);
+	unsigned int row;
+
+	for(row = 0; row < SKETCH_DEPTH; row ++)
+		columns[row] = (size_t) row * ((size_t) 1 << sk->bits) + ((h1 + row * h2) >> (32 - sk->bits));
+}
+
+static inline uint64_t SketchEstimate(const uint64_t *sum, const size_t *columns)
+{
+	uint64_t est = sum[columns[0]];
+	unsigned int row;
+
+	for(row = 1; row < SKETCH_DEPTH; row ++)
+		if(sum[columns[row]] < est)
+			est = sum[columns[row]];
+	return est;
+}
+
+__attribute__((cold)) void InitializeSketch(struct Sketch *sk, size_t memory, unsigned int top)
+{
+	size_t width, per_interval, fixed;
+	unsigned int k;
+
+	sk->intervals = PLAN.count;
+	sk->top = top ? top : 1;
+	for(sk->index_bits = 1; ((size_t) 1 << sk->index_bits) < 2 * (size_t) sk->top; sk->index_bits ++);
+
+	/* The counters get everything except the top-K: the largest power of 2 that fits */
+	fixed = sk->intervals * (sk->top * sizeof(struct SketchEntry) + ((size_t) 1 << sk->index_bits) * sizeof(int32_t));
+	per_interval = (SKETCH_BUCKETS + 1) * SKETCH_DEPTH * sizeof(uint64_t);
+	for(sk->bits = SKETCH_MIN_BITS; sk->bits < 31; sk->bits ++)
+		if(fixed + sk->intervals * per_interval * ((size_t) 2 << sk->bits) > memory)
+			break;
+	width = (size_t) 1 << sk->bits;
+
+	sk->interval = calloc(sk->intervals, sizeof(struct SketchInterval));
+	if(!sk->interval)
+	{
+		fprintf(stderr, "calloc() for sketch intervals failed: %s\n", strerror(errno));
+		exit(1);
+	}
+
+	for(k = 0; k < sk->intervals; k ++)
+	{
+		struct SketchInterval *si = &sk->interval[k];
+
+		si->bucket_seconds = (PLAN.intervals[k].seconds + SKETCH_BUCKETS - 1) / SKETCH_BUCKETS;
+		if(si->bucket_seconds < 1)
+			si->bucket_seconds = 1;
+
+		si->buckets = calloc(SKETCH_BUCKETS * SKETCH_DEPTH * width, sizeof(uint64_t));
+		si->sum = calloc(SKETCH_DEPTH * width, sizeof(uint64_t));
+		si->heap = calloc(sk->top, sizeof(struct SketchEntry));
+		si->index = malloc(((size_t) 1 << sk->index_bits) * sizeof(int32_t));
+		if(!si->buckets || !si->sum || !si->heap || !si->index)
+		{
+			fprintf(stderr, "calloc() for sketch of %i seconds (%zu counters) failed: %s\n", PLAN.intervals[k].seconds, width, strerror(errno));
+			exit(1);
+		}
+		memset(si->index, 0xff, ((size_t) 1 << sk->index_bits) * sizeof(int32_t));
+	}
+
+	sk->memory = fixed + sk->intervals * per_interval * width;
+	fprintf(stderr, "Approximate mode: sketch of %u intervals, %u x %zu counters each, top %u clients, %zu KB in total\n",
+		sk->intervals, SKETCH_DEPTH, width, sk->top, sk->memory >> 10);
+}
+
+__attribute__((cold)) void TerminateSketch(struct Sketch *sk)
+{
+	unsigned int k;
+
+	for(k = 0; k < sk->intervals; k ++)
+	{
+		free(sk->interval[k].buckets);
+		free(sk->interval[k].sum);
+		free(sk->interval[k].heap);
+		free(sk->interval[k].index);
+	}
+	free(sk->interval);
+	sk->interval = NULL;
+	sk->intervals = 0;
+}
+
+/*
+	Top-K: min-heap of entries, each of them knows its slot in 'index'
+	(open addressing with linear probing), which points back to the entry.
+*/
+static inline void HeapSet(struct SketchInterval *si, unsigned int pos, const struct SketchEntry *e)
+{
+	si->heap[pos] = *e;
+	si->index[e->slot] = pos;
+}
+
+static void HeapDown(struct SketchInterval *si, unsigned int pos)
+{
+	struct SketchEntry e = si->heap[pos];
+	unsigned int child;
+
+	while((child = 2 * pos + 1) < si->count)
+	{
+		if(child + 1 < si->count && si->heap[child + 1].estimate < si->heap[child].estimate)
+			child ++;
+		if(si->heap[child].estimate >= e.estimate)
+			break;
+		HeapSet(si, pos, &si->heap[child]);
+		pos = child;
+	}
+	HeapSet(si, pos, &e);
+}
+
+static void HeapUp(struct SketchInterval *si, unsigned int pos)
+{
+	struct SketchEntry e = si->heap[pos];
+	unsigned int parent;
+
+	while(pos > 0)
+	{
+		parent = (pos - 1) / 2;
+		if(si->heap[parent].estimate <= e.estimate)
+			break;
+		HeapSet(si, pos, &si->heap[parent]);
+		pos = parent;
+	}
+	HeapSet(si, pos, &e);
+}
+
+/* Slot of 'ip' in 'index' (its entry is index[slot]), or the empty slot where it would be */
+static inline uint32_t IndexFind(const struct Sketch *sk, const struct SketchInterval *si, const struct IpAddr *ip)
+{
+	uint32_t mask = ((uint32_t) 1 << sk->index_bits) - 1;
+	uint32_t slot = IpAddrHash(ip) >> (32 - sk->index_bits);
+
+	while(si->index[slot] >= 0 && !IpAddrEqual(&si->heap[si->index[slot]].ip, ip))
+		slot = (slot + 1) & mask;
+	return slot;
+}
+
+/* Empty 'slot' without tombstones: the following entries of the probe sequence are shifted back */
+static void IndexDelete(const struct Sketch *sk, struct SketchInterval *si, uint32_t slot)
+{
+	uint32_t mask = ((uint32_t) 1 << sk->index_bits) - 1;
+	uint32_t next = slot, home;
+
+	while(1)
+	{
+		si->index[slot] = -1;
+		while(1)
+		{
+			next = (next + 1) & mask;
+			if(si->index[next] < 0)
+				return;
+
+			/* Can the entry at 'next' move to 'slot', i.e. is 'slot' not before its home slot? */
+			home = IpAddrHash(&si->heap[si->index[next]].ip) >> (32 - sk->index_bits);
+			if(((next - home) & mask) >= ((next - slot) & mask))
+				break;
+		}
+
+		si->index[slot] = si->index[next];
+		si->heap[si->index[slot]].slot = slot;
+		slot = next;
+	}
+}
+
+/* Recalculate the estimates of the top-K (they only fall when the buckets expire) and restore the heap */
+static void SketchRefresh(struct Sketch *sk, struct SketchInterval *si)
+{
+	size_t columns[SKETCH_DEPTH];
+	unsigned int i;
+
+	for(i = 0; i < si->count; i ++)
+	{
+		SketchColumns(sk, &si->heap[i].ip, columns);
+		si->heap[i].estimate = SketchEstimate(si->sum, columns);
+	}
+	for(i = si->count / 2; i-- > 0; )
+		HeapDown(si, i);
+}
+
+/* Subtract the buckets which have left the interval by 'time' from the sum */
+static void SketchAdvance(struct Sketch *sk, struct SketchInterval *si, time_t time)
+{
+	size_t width = (size_t) 1 << sk->bits, c;
+	int64_t number = time / si->bucket_seconds;
+	uint64_t *bucket;
+	unsigned int b;
+
+	if(number <= si->current)
+		return;
+
+	if(number - si->current >= SKETCH_BUCKETS)
+	{
+		/* Nothing is left */
+		memset(si->buckets, 0, SKETCH_BUCKETS * SKETCH_DEPTH * width * sizeof(uint64_t));
+		memset(si->sum, 0, SKETCH_DEPTH * width * sizeof(uint64_t));
+		memset(si->totals, 0, sizeof(si->totals));
+		si->total = 0;
+	}
+	else
+	{
+		while(si->current < number)
+		{
+			si->current ++;
+			b = si->current % SKETCH_BUCKETS;
+			if(!si->totals[b])
+				continue;
+
+			bucket = &si->buckets[b * SKETCH_DEPTH * width];
+			for(c = 0; c < SKETCH_DEPTH * width; c ++)
+				si->sum[c] -= bucket[c];
+			memset(bucket, 0, SKETCH_DEPTH * width * sizeof(uint64_t));
+
+			si->total -= si->totals[b];
+			si->totals[b] = 0;
+		}
+	}
+
+	si->current = number;
+	SketchRefresh(sk, si);
+}
+
+__attribute__((hot)) void SketchAdd(struct Sketch *sk, const struct IpAddr *ip, time_t time, uint64_t bytes)
+{
+	size_t client_columns[SKETCH_DEPTH], subnet_columns[SKETCH_DEPTH], *columns;
+	size_t width = (size_t) 1 << sk->bits;
+	const struct IpAddr *key;
+	struct IpAddr subnet;
+	struct SketchEntry e;
+	uint64_t *bucket, est;
+	int64_t number;
+	unsigned int k, row, b;
+	uint32_t slot;
+	int pos;
+
+	SketchColumns(sk, ip, client_columns);
+	for(k = 0; k < sk->intervals; k ++)
+	{
+		struct SketchInterval *si = &sk->interval[k];
+
+		/* "PER /prefix" intervals count the subnets instead */
+		key = ip;
+		columns = client_columns;
+		if(PLAN.intervals[k].prefix)
+		{
+			IpAddrSubnet(&subnet, ip, PLAN.intervals[k].prefix);
+			if(IpAddrIsEmpty(&subnet))
+				continue;
+			key = &subnet;
+			columns = subnet_columns;
+			SketchColumns(sk, key, columns);
+		}
+
+		number = time / si->bucket_seconds;
+		if(number > si->current)
+			SketchAdvance(sk, si, time);
+		else if(number <= si->current - SKETCH_BUCKETS)
+			continue; /* already out of this interval */
+
+		b = number % SKETCH_BUCKETS;
+		bucket = &si->buckets[b * SKETCH_DEPTH * width];
+		for(row = 0; row < SKETCH_DEPTH; row ++)
+		{
+			bucket[columns[row]] += bytes;
+			si->sum[columns[row]] += bytes;
+		}
+		si->totals[b] += bytes;
+		si->total += bytes;
+
+		est = SketchEstimate(si->sum, columns);
+		slot = IndexFind(sk, si, key);
+		pos = si->index[slot];
+		if(pos >= 0)
+		{
+			/* Already tracked: the estimate has grown */
+			si->heap[pos].estimate = est;
+			HeapDown(si, pos);
+		}
+		else if(si->count < sk->top)
+		{
+			e.ip = *key;
+			e.estimate = est;
+			e.slot = slot;
+			HeapSet(si, si->count ++, &e);
+			HeapUp(si, si->count - 1);
+		}
+		else if(est > si->heap[0].estimate)
+		{
+			/* Replaces the smallest one */
+			IndexDelete(sk, si, si->heap[0].slot);
+			e.ip = *key;
+			e.estimate = est;
+			e.slot = IndexFind(sk, si, key); /* the deletion may have moved the empty slot */
+			HeapSet(si, 0, &e);
+			HeapDown(si, 0);
+		}
+	}
+}
+
+unsigned int SketchTop(struct Sketch *sk, unsigned int k, time_t time, const struct SketchEntry **entries)
+{
+	SketchAdvance(sk, &sk->interval[k], time);
+	*entries = sk->interval[k].heap;
+	return sk->interval[k].count;
+}
+
+uint64_t SketchError(const struct Sketch *sk, unsigned int k)
+{
+	return (uint64_t) (SKETCH_E * sk->interval[k].total / ((size_t) 1 << sk->bits)) + 1;
+}
@@ -0,0 +1,94 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_SKETCH_H
+#define _LIMITTRAF_SKETCH_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <time.h>
+
+#include "ipaddr.h"
+
+/*
+	Sketch: approximate accounting in a fixed amount of memory (ltSketchMemory),
+	for floods and scans with millions of distinct clients, where the exact
+	per-client Window would grow without limit.
+
+	Each PLAN interval has a ring of SKETCH_BUCKETS Count-Min Sketches (SKETCH_DEPTH rows
+	of 'width' counters), one per 1/SKETCH_BUCKETS of the interval, and their element-wise sum:
+	the estimate of a client is the minimum of its counters in the sum. It's never too low,
+	and too high by at most e/width of all traffic of the interval (with probability 1 - e^-SKETCH_DEPTH),
+	see SketchError(). When a bucket leaves the interval, its counters are subtracted from the sum.
+
+	The biggest clients of each interval (by estimate) are kept in a min-heap of 'top' entries
+	(Space-Saving: a new client replaces the smallest one if its estimate is higher),
+	AnalyzeDb() only looks at these.
+	The intervals of the "PER /prefix" rules count the subnets (see IpAddrSubnet()) instead of the clients.
+*/
+#define SKETCH_DEPTH 4
+#define SKETCH_BUCKETS 12 /* the start of the interval moves in steps of 1/12 of it (like WINDOW_MIN_BUCKETS) */
+
+struct SketchEntry
+{
+	struct IpAddr ip;
+	uint64_t estimate;
+	uint32_t slot; /* in 'index' */
+};
+
+struct SketchInterval
+{
+	time_t bucket_seconds;
+	int64_t current; /* number of the newest bucket (time / bucket_seconds) */
+	uint64_t *buckets; /* buckets[(b * SKETCH_DEPTH + row) * width + column], b = number % SKETCH_BUCKETS */
+	uint64_t *sum; /* sum[row * width + column] of all buckets */
+	uint64_t totals[SKETCH_BUCKETS]; /* all bytes of each bucket */
+	uint64_t total; /* sum of totals[] */
+
+	struct SketchEntry *heap; /* min-heap by estimate */
+	unsigned int count;
+	int32_t *index; /* open addressing: position in 'heap' of a client, -1 = empty */
+};
+
+struct Sketch
+{
+	unsigned int intervals; /* = PLAN.count */
+	struct SketchInterval *interval;
+	unsigned int bits; /* width = 1 << bits */
+	unsigned int top; /* heap size */
+	unsigned int index_bits; /* size of 'index' = 1 << index_bits */
+	size_t memory; /* allocated */
+};
+
+/*
+	NOTE: must be called after ReadConfiguration().
+	'memory' (bytes) is divided between the intervals, 'top' is the number of clients tracked per interval.
+*/
+void InitializeSketch(struct Sketch *sk, size_t memory, unsigned int top);
+void TerminateSketch(struct Sketch *sk);
+
+/* Account 'bytes' sent to 'ip' at 'time' */
+void SketchAdd(struct Sketch *sk, const struct IpAddr *ip, time_t time, uint64_t bytes);
+
+/*
+	The tracked clients of PLAN.intervals[k] with their estimates as of 'time'.
+	Returns their number, '*entries' is valid until the next call of SketchAdd().
+*/
+unsigned int SketchTop(struct Sketch *sk, unsigned int k, time_t time, const struct SketchEntry **entries);
+
+/* Maximum overestimate in PLAN.intervals[k] (with probability 1 - e^-SKETCH_DEPTH, i.e. 98%) */
+uint64_t SketchError(const struct Sketch *sk, unsigned int k);
+
+#endif
@@ -0,0 +1,100 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <sys/mman.h>
+
+#include "slab.h"
+
+__attribute__((cold)) void InitializeSlab(struct Slab *slab, size_t size, struct SlabBudget *budget)
+{
+	size_t capacity;
+
+	slab->size = (size + SLAB_ALIGN - 1) / SLAB_ALIGN * SLAB_ALIGN;
+	capacity = budget->limit / slab->size;
+	slab->capacity = capacity < 1 ? 1 : (capacity < SLAB_NONE ? capacity : SLAB_NONE - 1);
+	slab->top = 0;
+	slab->free = SLAB_NONE;
+	slab->used = 0;
+	slab->budget = budget;
+
+	/* Only the address space: no memory is used until the pages are touched */
+	slab->base = mmap(NULL, (size_t) slab->capacity * slab->size, PROT_READ | PROT_WRITE,
+		MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if(slab->base == MAP_FAILED)
+	{
+		fprintf(stderr, "mmap() of %zu bytes for a slab of %zu-byte entries failed: %s\n",
+			(size_t) slab->capacity * slab->size, slab->size, strerror(errno));
+		exit(1);
+	}
+}
+
+__attribute__((cold)) void TerminateSlab(struct Slab *slab)
+{
+	munmap(slab->base, (size_t) slab->capacity * slab->size);
+	slab->budget->used -= (size_t) slab->top * slab->size;
+	slab->base = NULL;
+	slab->top = slab->used = 0;
+}
+
+static inline uint32_t *SlabLink(const struct Slab *slab, uint32_t n)
+{
+	return (uint32_t *) ((uint8_t *) SlabEntry(slab, n) + slab->size - sizeof(uint32_t));
+}
+
+__attribute__((hot)) uint32_t SlabAlloc(struct Slab *slab)
+{
+	uint32_t n = slab->free;
+
+	if(n != SLAB_NONE)
+	{
+		slab->free = *SlabLink(slab, n);
+		*SlabLink(slab, n) = 0;
+	}
+	else
+	{
+		/* New pages of the mmap() are zero already */
+		if(slab->top == slab->capacity || SlabBudgetCharge(slab->budget, slab->size) < 0)
+			return SLAB_NONE;
+		n = slab->top ++;
+	}
+
+	slab->used ++;
+	return n;
+}
+
+void SlabFree(struct Slab *slab, uint32_t n)
+{
+	memset(SlabEntry(slab, n), 0, slab->size);
+	*SlabLink(slab, n) = slab->free;
+	slab->free = n;
+	slab->used --;
+}
+
+int SlabRestore(struct Slab *slab, const void *entries, uint32_t top, uint32_t free, uint32_t used)
+{
+	if(slab->top || top > slab->capacity || used > top || (free != SLAB_NONE && free >= top)
+		|| SlabBudgetCharge(slab->budget, (size_t) top * slab->size) < 0)
+		return -1;
+
+	memcpy(slab->base, entries, (size_t) top * slab->size);
+	slab->top = top;
+	slab->free = free;
+	slab->used = used;
+	return 0;
+}
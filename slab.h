@@ -0,0 +1,88 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_SLAB_H
+#define _LIMITTRAF_SLAB_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+	Slab: arena of fixed-size entries, each of them aligned to a cache line,
+	numbered from 0 (so that tables can hold 4-byte numbers instead of pointers).
+	The address space for the whole budget is reserved once by InitializeSlab(),
+	the pages are only touched when the entries are handed out, and freed entries
+	are reused first: once the number of entries stops growing, nothing is allocated
+	and the resident memory stays the same.
+
+	Several slabs can share one SlabBudget (a hard limit of their memory together):
+	SlabAlloc() fails when it's reached, and the caller has to free something (see WindowEvict()).
+*/
+#define SLAB_ALIGN 64 /* cache line */
+#define SLAB_NONE UINT32_MAX
+
+struct SlabBudget
+{
+	size_t limit; /* bytes */
+	size_t used; /* bytes charged by all slabs (entries which were ever handed out) and by their users */
+};
+
+struct Slab
+{
+	uint8_t *base;
+	size_t size; /* of one entry: a multiple of SLAB_ALIGN */
+	uint32_t capacity; /* entries reserved */
+	uint32_t top; /* entries [0, top) were handed out at least once */
+	uint32_t free; /* first free entry below 'top', SLAB_NONE if none */
+	uint32_t used;
+	struct SlabBudget *budget;
+};
+
+/* 'size' is rounded up to SLAB_ALIGN (an entry must have at least 4 bytes) */
+void InitializeSlab(struct Slab *slab, size_t size, struct SlabBudget *budget);
+void TerminateSlab(struct Slab *slab);
+
+/* Number of a zeroed entry, SLAB_NONE if the budget is exhausted */
+uint32_t SlabAlloc(struct Slab *slab);
+
+/* The entry is zeroed (its last 4 bytes link it into the free list) */
+void SlabFree(struct Slab *slab, uint32_t n);
+
+/*
+	Fill an empty slab with 'top' entries saved from another one (e.g. by WindowSave()),
+	along with its 'free' and 'used'. Returns -1 if they don't fit into the budget.
+*/
+int SlabRestore(struct Slab *slab, const void *entries, uint32_t top, uint32_t free, uint32_t used);
+
+static inline void *SlabEntry(const struct Slab *slab, uint32_t n)
+{
+	return slab->base + (size_t) n * slab->size;
+}
+
+/* Memory outside of the slabs which counts against the budget (e.g. their indexes): 0 if it fits, -1 if not */
+static inline int SlabBudgetCharge(struct SlabBudget *budget, size_t bytes)
+{
+	if(budget->used + bytes > budget->limit)
+		return -1;
+	budget->used += bytes;
+	return 0;
+}
+
+static inline void SlabBudgetRelease(struct SlabBudget *budget, size_t bytes)
+{
+	budget->used -= bytes;
+}
+
+#endif
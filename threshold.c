@@ -0,0 +1,155 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define THRESHOLD_X86
+#endif
+
+#include "threshold.h"
+
+typedef unsigned int (*ThresholdFunction)(const uint64_t *sums, unsigned int count, const int64_t *thresholds, unsigned int levels, uint8_t *crossed);
+
+/* No branches on the sums: the clients over a level are rare, and their positions are random */
+static unsigned int ThresholdScalar(const uint64_t *sums, unsigned int count, const int64_t *thresholds, unsigned int levels, uint8_t *crossed)
+{
+	unsigned int n, j, over = 0;
+	uint8_t c;
+
+	for(n = 0; n < count; n ++)
+	{
+		c = 0;
+		for(j = 0; j < levels; j ++)
+			c += (int64_t) sums[n] >= thresholds[j];
+		crossed[n] = c;
+		over += c != 0;
+	}
+	return over;
+}
+
+#ifdef THRESHOLD_X86
+
+/* Lowest bytes of the four 64-bit counters of 'c' (each of them is below 256) */
+__attribute__((target("avx2"))) static inline uint32_t ThresholdPack4(__m256i c)
+{
+	__m128i lo = _mm_shuffle_epi32(_mm256_castsi256_si128(c), 0x08); /* counters 0, 1 as 32-bit */
+	__m128i hi = _mm_shuffle_epi32(_mm256_extracti128_si256(c, 1), 0x08); /* 2, 3 */
+	__m128i v = _mm_unpacklo_epi64(lo, hi);
+
+	v = _mm_packus_epi32(v, v);
+	v = _mm_packus_epi16(v, v);
+	return _mm_cvtsi128_si32(v);
+}
+
+/*
+	4 clients per step: each comparison gives -1 in the lanes which have reached the level,
+	and subtracting it counts the levels. 'sums[n] >= t' is 'sums[n] > t - 1'.
+*/
+__attribute__((target("avx2"))) static unsigned int ThresholdAvx2(const uint64_t *sums, unsigned int count, const int64_t *thresholds, unsigned int levels, uint8_t *crossed)
+{
+	__m256i t[THRESHOLD_MAX_LEVELS];
+	__m256i v, c, m;
+	unsigned int n, j, over = 0;
+	uint32_t packed;
+
+	for(j = 0; j < levels; j ++)
+		t[j] = _mm256_set1_epi64x(thresholds[j] - 1);
+
+	for(n = 0; n + 4 <= count; n += 4)
+	{
+		v = _mm256_loadu_si256((const __m256i *) (sums + n));
+		m = _mm256_cmpgt_epi64(v, t[0]);
+		if(_mm256_testz_si256(m, m))
+		{
+			/* Below the lowest level, therefore below all of them (the usual case) */
+			memset(crossed + n, 0, 4);
+			continue;
+		}
+		over += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(m)));
+
+		c = _mm256_sub_epi64(_mm256_setzero_si256(), m);
+		for(j = 1; j < levels; j ++)
+			c = _mm256_sub_epi64(c, _mm256_cmpgt_epi64(v, t[j]));
+		packed = ThresholdPack4(c);
+		memcpy(crossed + n, &packed, 4);
+	}
+	return over + ThresholdScalar(sums + n, count - n, thresholds, levels, crossed + n);
+}
+
+/* Same as ThresholdAvx2(), 2 clients per step */
+__attribute__((target("sse4.2"))) static unsigned int ThresholdSse42(const uint64_t *sums, unsigned int count, const int64_t *thresholds, unsigned int levels, uint8_t *crossed)
+{
+	__m128i t[THRESHOLD_MAX_LEVELS];
+	__m128i v, c, m;
+	unsigned int n, j, over = 0;
+	int mask;
+
+	for(j = 0; j < levels; j ++)
+		t[j] = _mm_set1_epi64x(thresholds[j] - 1);
+
+	for(n = 0; n + 2 <= count; n += 2)
+	{
+		v = _mm_loadu_si128((const __m128i *) (sums + n));
+		m = _mm_cmpgt_epi64(v, t[0]);
+		mask = _mm_movemask_pd(_mm_castsi128_pd(m));
+		if(!mask)
+		{
+			crossed[n] = crossed[n + 1] = 0;
+			continue;
+		}
+		over += __builtin_popcount(mask);
+
+		c = _mm_sub_epi64(_mm_setzero_si128(), m);
+		for(j = 1; j < levels; j ++)
+			c = _mm_sub_epi64(c, _mm_cmpgt_epi64(v, t[j]));
+		crossed[n] = _mm_cvtsi128_si64(c);
+		crossed[n + 1] = _mm_cvtsi128_si64(_mm_unpackhi_epi64(c, c));
+	}
+	return over + ThresholdScalar(sums + n, count - n, thresholds, levels, crossed + n);
+}
+
+#endif
+
+static ThresholdFunction threshold = ThresholdScalar;
+static const char *threshold_name = "scalar";
+
+__attribute__((cold)) void InitializeThreshold()
+{
+#ifdef THRESHOLD_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2"))
+	{
+		threshold = ThresholdAvx2;
+		threshold_name = "AVX2";
+	}
+	else if(__builtin_cpu_supports("sse4.2"))
+	{
+		threshold = ThresholdSse42;
+		threshold_name = "SSE4.2";
+	}
+#endif
+}
+
+__attribute__((hot)) unsigned int ThresholdCrossed(const uint64_t *sums, unsigned int count, const int64_t *thresholds, unsigned int levels, uint8_t *crossed)
+{
+	return threshold(sums, count, thresholds, levels, crossed);
+}
+
+const char *ThresholdKernel()
+{
+	return threshold_name;
+}
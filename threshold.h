@@ -0,0 +1,39 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_THRESHOLD_H
+#define _LIMITTRAF_THRESHOLD_H
+
+#include <stdint.h>
+
+/*
+	Threshold: the level check of AnalyzeDb() for a block of clients at once.
+	'sums' are those of one interval for a block of clients (see AnalyzePart() in database.c), 'thresholds' are the levels
+	of one interval in ascending order: crossed[n] is the number of them which sums[n] has reached,
+	i.e. the index of the highest one plus 1, 0 if none.
+	Returns the number of clients with crossed[n] > 0.
+
+	Uses AVX2 or SSE4.2 if the CPU has them (see InitializeThreshold()), plain C otherwise.
+	There must be at least one threshold; the sums and the thresholds must be below 2^63 (the comparisons are signed).
+*/
+#define THRESHOLD_MAX_LEVELS 255
+
+void InitializeThreshold();
+unsigned int ThresholdCrossed(const uint64_t *sums, unsigned int count, const int64_t *thresholds, unsigned int levels, uint8_t *crossed);
+
+/* Name of the implementation chosen by InitializeThreshold(), for the statistics of Analyze() */
+const char *ThresholdKernel();
+
+#endif
@@ -0,0 +1,580 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+
+#include "window.h"
+#include "conf.h"
+
+static const unsigned int WINDOW_INITIAL_BITS = 12; /* 4096 clients */
+static const unsigned int WINDOW_EVICT_SCAN = 256; /* entries checked by one WindowEvict(): a full table costs little per packet */
+
+/* A new index of (1 << bits) slots, charged to the budget. Returns NULL if it doesn't fit. */
+static uint32_t *WindowAllocateIndex(struct Window *win, unsigned int bits)
+{
+	size_t capacity = (size_t) 1 << bits;
+	uint32_t *index;
+
+	if(SlabBudgetCharge(win->slab.budget, capacity * sizeof(uint32_t)) < 0)
+		return NULL;
+
+	index = malloc(capacity * sizeof(uint32_t));
+	if(!index)
+	{
+		fprintf(stderr, "malloc() for window index (%zu clients) failed: %s\n", capacity, strerror(errno));
+		exit(1);
+	}
+	memset(index, 0xff, capacity * sizeof(uint32_t)); /* SLAB_NONE */
+	return index;
+}
+
+static void WindowFreeIndex(struct Window *win)
+{
+	free(win->index);
+	SlabBudgetRelease(win->slab.budget, ((size_t) 1 << win->bits) * sizeof(uint32_t));
+	win->index = NULL;
+}
+
+/* Buckets of the finest tier in one bucket of tier 't' */
+static inline unsigned int WindowRatio(unsigned int t)
+{
+	return WINDOW_TIER_SECONDS[t] / WINDOW_BUCKET;
+}
+
+__attribute__((cold)) void InitializeWindow(struct Window *win, int prefix, struct SlabBudget *budget)
+{
+	unsigned int k, t;
+
+	win->prefix = prefix;
+	win->intervals = 0;
+	win->plan = malloc(PLAN.count * sizeof(unsigned int));
+	win->tier = malloc(PLAN.count * sizeof(unsigned int));
+	win->width = malloc(PLAN.count * sizeof(unsigned int));
+	if(!win->plan || !win->tier || !win->width)
+	{
+		fprintf(stderr, "malloc() for window intervals failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	for(k = 0; k < (unsigned int) PLAN.count; k ++)
+		if(PLAN.intervals[k].prefix == prefix)
+			win->plan[win->intervals ++] = k;
+
+	memset(win->length, 0, sizeof(win->length));
+	for(k = 0; k < win->intervals; k ++)
+	{
+		/* The coarsest tier which has at least WINDOW_MIN_BUCKETS buckets in this interval */
+		for(t = WINDOW_TIERS - 1; t > 0; t --)
+			if((unsigned int) PLAN.intervals[win->plan[k]].seconds >= WINDOW_MIN_BUCKETS * WINDOW_TIER_SECONDS[t])
+				break;
+
+		win->tier[k] = t;
+		win->width[k] = (PLAN.intervals[win->plan[k]].seconds + WINDOW_TIER_SECONDS[t] - 1) / WINDOW_TIER_SECONDS[t];
+		if(win->width[k] < 1)
+			win->width[k] = 1;
+		if(win->width[k] > win->length[t])
+			win->length[t] = win->width[k];
+	}
+
+	win->total = 0;
+	win->span = 0;
+	for(t = 0; t < WINDOW_TIERS; t ++)
+	{
+		win->offset[t] = win->intervals + win->total; /* in WindowEntry.data, after the sums */
+		win->total += win->length[t];
+		if((time_t) win->length[t] * WINDOW_TIER_SECONDS[t] > win->span)
+			win->span = (time_t) win->length[t] * WINDOW_TIER_SECONDS[t];
+	}
+
+	win->active = NULL;
+	win->active_count = win->active_size = 0;
+
+	InitializeSlab(&win->slab, sizeof(struct WindowEntry) + (win->intervals + win->total) * sizeof(uint64_t), budget);
+	win->hand = 0;
+	win->evicted = win->rejected = 0;
+	win->used = 0;
+	win->bits = WINDOW_INITIAL_BITS;
+	win->index = WindowAllocateIndex(win, win->bits);
+	if(!win->index)
+	{
+		fprintf(stderr, "The memory budget of the windows (%zu bytes) is too small\n", budget->limit);
+		exit(1);
+	}
+}
+
+__attribute__((cold)) void TerminateWindow(struct Window *win)
+{
+	WindowFreeIndex(win);
+	TerminateSlab(&win->slab);
+	free(win->plan);
+	free(win->tier);
+	free(win->width);
+	free(win->active);
+	win->plan = NULL;
+	win->tier = NULL;
+	win->width = NULL;
+	win->active = NULL;
+}
+
+/* Slot of 'index' for entry 'n' (the first empty one of its probe sequence) */
+static inline void WindowIndexInsert(uint32_t *index, unsigned int bits, const struct IpAddr *ip, uint32_t n)
+{
+	unsigned int mask = (1U << bits) - 1;
+	unsigned int j = IpAddrHash(ip) >> (32 - bits);
+
+	while(index[j] != SLAB_NONE)
+		j = (j + 1) & mask;
+	index[j] = n;
+}
+
+/* Double the index (the entries stay where they are). Returns -1 if it doesn't fit into the budget. */
+static int WindowGrow(struct Window *win)
+{
+	size_t i, capacity = (size_t) 1 << win->bits;
+	uint32_t *index;
+
+	if(win->bits >= 31 || !(index = WindowAllocateIndex(win, win->bits + 1)))
+		return -1;
+
+	for(i = 0; i < capacity; i ++)
+		if(win->index[i] != SLAB_NONE)
+			WindowIndexInsert(index, win->bits + 1, WindowAddress(win, win->index[i]), win->index[i]);
+
+	WindowFreeIndex(win);
+	win->index = index;
+	win->bits ++;
+	return 0;
+}
+
+/*
+	Make room for a new client when the budget is reached: CLOCK, the first client
+	which is not in active[] (i.e. below the levels and without traffic since the last AnalyzeDb())
+	and was not 'referenced' since the hand passed it last time. Returns -1 if there's none.
+*/
+static int WindowEvict(struct Window *win)
+{
+	struct WindowEntry *e;
+	struct IpAddr ip;
+	uint64_t checked;
+
+	/* Up to two rounds (the first one may only clear 'referenced'), the next call continues where this one stopped */
+	for(checked = 0; checked < 2 * (uint64_t) win->slab.top && checked < WINDOW_EVICT_SCAN; checked ++)
+	{
+		if(win->hand >= win->slab.top)
+			win->hand = 0;
+		e = WindowEntryOf(win, win->hand ++);
+
+		if(IpAddrIsEmpty(&e->ip) || e->listed)
+			continue;
+		if(e->referenced)
+		{
+			e->referenced = 0;
+			continue;
+		}
+
+		ip = e->ip;
+		WindowRemove(win, &ip);
+		win->evicted ++;
+		return 0;
+	}
+	return -1;
+}
+
+/* Add the client 'ip' (not in the table yet) with this newest bucket. Returns -1 if there's no room. */
+static int WindowInsert(struct Window *win, const struct IpAddr *ip, int64_t number)
+{
+	struct WindowEntry *e;
+	uint32_t n;
+
+	if(win->used * 4 >= ((1U << win->bits) - 1) * 3 /* 75% full */
+		&& WindowGrow(win) < 0 && WindowEvict(win) < 0)
+	{
+		win->rejected ++;
+		return -1;
+	}
+
+	n = SlabAlloc(&win->slab);
+	if(n == SLAB_NONE && (WindowEvict(win) < 0 || (n = SlabAlloc(&win->slab)) == SLAB_NONE))
+	{
+		win->rejected ++;
+		return -1;
+	}
+
+	e = WindowEntryOf(win, n);
+	e->ip = *ip;
+	e->current = number;
+	WindowIndexInsert(win->index, win->bits, ip, n);
+	win->used ++;
+	return n;
+}
+
+/*
+	Number of the entry of client 'ip', or -1 if it's not in the table.
+	If 'number' is not negative, a missing client is added (with this newest bucket).
+*/
+static inline int WindowFind(struct Window *win, const struct IpAddr *ip, int64_t number)
+{
+	unsigned int mask = (1U << win->bits) - 1;
+	unsigned int j = IpAddrHash(ip) >> (32 - win->bits);
+	uint32_t n;
+
+	while((n = win->index[j]) != SLAB_NONE)
+	{
+		if(IpAddrEqual(WindowAddress(win, n), ip))
+			return n;
+		j = (j + 1) & mask;
+	}
+
+	if(number < 0)
+		return -1;
+	return WindowInsert(win, ip, number);
+}
+
+/* Move the rings of entry 'e' forward to bucket 'number': the buckets which are reused are cleared */
+static inline void WindowRotate(struct Window *win, struct WindowEntry *e, int64_t number)
+{
+	int64_t from, to, b;
+	uint64_t *ring;
+	unsigned int t, len;
+
+	if(number <= e->current)
+		return;
+
+	for(t = 0; t < WINDOW_TIERS; t ++)
+	{
+		len = win->length[t];
+		if(!len)
+			continue;
+
+		from = e->current / WindowRatio(t);
+		to = number / WindowRatio(t);
+		if(to <= from)
+			continue; /* still the same bucket of this tier */
+
+		ring = &e->data[win->offset[t]];
+		if(to - from >= len)
+			memset(ring, 0, len * sizeof(uint64_t)); /* all buckets of this tier have left its intervals */
+		else
+			for(b = from + 1; b <= to; b ++)
+				ring[b % len] = 0;
+	}
+	e->current = number;
+}
+
+int WindowAdvance(struct Window *win, unsigned int i, time_t time)
+{
+	struct WindowEntry *e = WindowEntryOf(win, i);
+	uint64_t *sums = e->data, *ring, acc, any = 0;
+	unsigned int k, t, len, pos, taken;
+
+	WindowRotate(win, e, time / WINDOW_BUCKET);
+
+	/*
+		One sweep per tier, from the newest bucket back: the intervals of a tier are
+		sorted by width (PLAN.intervals are sorted by length, see ReadConfiguration()),
+		so the sum of each one is the running total at its width, and every bucket is read once,
+		however many intervals there are.
+	*/
+	for(t = 0; t < WINDOW_TIERS; t ++)
+	{
+		len = win->length[t];
+		if(!len)
+			continue;
+
+		ring = &e->data[win->offset[t]];
+		pos = (e->current / WindowRatio(t)) % len;
+		acc = 0;
+		taken = 0;
+		for(k = 0; k < win->intervals; k ++)
+		{
+			if(win->tier[k] != t)
+				continue;
+
+			for(; taken < win->width[k]; taken ++)
+			{
+				acc += ring[pos];
+				pos = pos ? pos - 1 : len - 1;
+			}
+			sums[k] = acc;
+			any |= acc;
+		}
+	}
+	return any != 0;
+}
+
+__attribute__((hot)) int WindowAdd(struct Window *win, const struct IpAddr *ip, time_t time, uint64_t bytes)
+{
+	int64_t number = time / WINDOW_BUCKET, age;
+	int i = WindowFind(win, ip, number);
+	struct WindowEntry *e;
+	unsigned int t;
+
+	if(i < 0)
+		return -1; /* no room, see 'rejected' */
+	e = WindowEntryOf(win, i);
+
+	WindowRotate(win, e, number);
+
+	if(!e->listed)
+	{
+		if(win->active_count == win->active_size)
+		{
+			win->active_size = win->active_size ? win->active_size * 2 : 1024;
+			win->active = realloc(win->active, win->active_size * sizeof(struct IpAddr));
+			if(!win->active)
+			{
+				fprintf(stderr, "realloc() for active clients failed: %s\n", strerror(errno));
+				exit(1);
+			}
+		}
+		win->active[win->active_count ++] = *ip;
+		e->listed = 1;
+	}
+	e->referenced = 1;
+
+	/*
+		The same bytes go into every tier: each of them holds all traffic, at its own resolution.
+		The sums are not touched here: WindowAdvance() recalculates them before AnalyzeDb() reads them.
+	*/
+	for(t = 0; t < WINDOW_TIERS; t ++)
+	{
+		if(!win->length[t])
+			continue;
+
+		age = e->current / WindowRatio(t) - number / WindowRatio(t);
+		if(age < win->length[t])
+			e->data[win->offset[t] + (number / WindowRatio(t)) % win->length[t]] += bytes;
+	}
+	return i;
+}
+
+void WindowRemove(struct Window *win, const struct IpAddr *ip)
+{
+	unsigned int mask = (1U << win->bits) - 1, home, i, j;
+	uint32_t n;
+
+	i = IpAddrHash(ip) >> (32 - win->bits);
+	while(1)
+	{
+		n = win->index[i];
+		if(n == SLAB_NONE)
+			return;
+		if(IpAddrEqual(WindowAddress(win, n), ip))
+			break;
+		i = (i + 1) & mask;
+	}
+
+	/*
+		Backward shift deletion: the entries after the removed one
+		are moved back if the hole is between them and their home slot,
+		so that linear probing still finds them.
+	*/
+	j = i;
+	while(1)
+	{
+		win->index[i] = SLAB_NONE;
+		do
+		{
+			j = (j + 1) & mask;
+			if(win->index[j] == SLAB_NONE)
+			{
+				SlabFree(&win->slab, n);
+				win->used --;
+				return;
+			}
+			home = IpAddrHash(WindowAddress(win, win->index[j])) >> (32 - win->bits);
+		} while(i <= j ? (i < home && home <= j) : (i < home || home <= j));
+
+		win->index[i] = win->index[j];
+		i = j;
+	}
+}
+
+int WindowLookup(struct Window *win, const struct IpAddr *ip)
+{
+	return WindowFind(win, ip, -1);
+}
+
+void WindowSettle(struct Window *win, time_t time, int (*keep)(struct Window *win, unsigned int i))
+{
+	int64_t number = time / WINDOW_BUCKET;
+	struct WindowEntry *e;
+	struct IpAddr ip;
+	unsigned int a, count = 0;
+	uint32_t n;
+	int i;
+
+	for(a = 0; a < win->active_count; a ++)
+	{
+		i = WindowFind(win, &win->active[a], -1);
+		if(i < 0)
+			continue;
+
+		if(keep(win, i))
+			win->active[count ++] = win->active[a];
+		else
+			WindowEntryOf(win, i)->listed = 0;
+	}
+	win->active_count = count;
+
+	/*
+		CLOCK: idle clients (nothing in the longest tier, so no need to call WindowAdvance())
+		are removed, the others lose 'referenced' (see WindowEvict()).
+	*/
+	for(n = win->slab.top / WINDOW_SWEEP_CYCLES + 1; n > 0 && win->slab.top; n --)
+	{
+		if(win->hand >= win->slab.top)
+			win->hand = 0;
+		e = WindowEntryOf(win, win->hand ++);
+		if(IpAddrIsEmpty(&e->ip) || e->listed)
+			continue;
+
+		if((number - e->current) * WINDOW_BUCKET >= win->span)
+		{
+			ip = e->ip;
+			WindowRemove(win, &ip);
+		}
+		else
+			e->referenced = 0;
+	}
+}
+
+/* Header of WindowSave(), followed by index[], the entries of the slab and active[] */
+struct WindowSnapshotHeader
+{
+	uint64_t geometry;
+	uint32_t bits, used, active_count;
+	uint32_t top, free, entries; /* of the slab */
+};
+
+/* FNV-1a step */
+static inline uint64_t GeometryAdd(uint64_t h, uint64_t value)
+{
+	return (h ^ value) * 1099511628211ULL;
+}
+
+uint64_t WindowGeometry(const struct Window *win)
+{
+	uint64_t h = 14695981039346656037ULL;
+	unsigned int k, t;
+
+	h = GeometryAdd(h, WINDOW_BUCKET);
+	h = GeometryAdd(h, win->slab.size); /* also tells the slab entries from the older arrays */
+	if(win->prefix)
+		h = GeometryAdd(h, win->prefix); /* the snapshots of client windows stay compatible */
+	h = GeometryAdd(h, win->intervals);
+	for(k = 0; k < win->intervals; k ++)
+	{
+		h = GeometryAdd(h, win->tier[k]);
+		h = GeometryAdd(h, win->width[k]);
+	}
+	for(t = 0; t < WINDOW_TIERS; t ++)
+	{
+		h = GeometryAdd(h, WINDOW_TIER_SECONDS[t]);
+		h = GeometryAdd(h, win->length[t]);
+	}
+	return h;
+}
+
+int WindowSave(const struct Window *win, FILE *f)
+{
+	size_t capacity = (size_t) 1 << win->bits;
+	struct WindowSnapshotHeader h;
+
+	memset(&h, 0, sizeof(h));
+	h.geometry = WindowGeometry(win);
+	h.bits = win->bits;
+	h.used = win->used;
+	h.active_count = win->active_count;
+	h.top = win->slab.top;
+	h.free = win->slab.free;
+	h.entries = win->slab.used;
+
+	if(fwrite(&h, sizeof(h), 1, f) != 1
+		|| fwrite(win->index, sizeof(uint32_t), capacity, f) != capacity
+		|| fwrite(win->slab.base, win->slab.size, h.top, f) != h.top
+		|| fwrite(win->active, sizeof(struct IpAddr), win->active_count, f) != win->active_count)
+		return -1;
+	return 0;
+}
+
+static inline const uint8_t *LoadArray(void *array, const uint8_t *p, size_t bytes)
+{
+	memcpy(array, p, bytes);
+	return p + bytes;
+}
+
+const uint8_t *WindowLoad(struct Window *win, const uint8_t *p, size_t size)
+{
+	struct WindowSnapshotHeader h;
+	size_t capacity;
+	uint32_t *index;
+
+	if(size < sizeof(h))
+		return NULL;
+	memcpy(&h, p, sizeof(h));
+	if(h.geometry != WindowGeometry(win) || h.bits < 1 || h.bits > 31 || win->slab.top)
+		return NULL;
+
+	capacity = (size_t) 1 << h.bits;
+	if(size - sizeof(h) < capacity * sizeof(uint32_t) + (size_t) h.top * win->slab.size
+		+ (size_t) h.active_count * sizeof(struct IpAddr))
+		return NULL;
+	p += sizeof(h);
+
+	/* The old index is still charged: the new one is allocated first */
+	index = WindowAllocateIndex(win, h.bits);
+	if(!index)
+		return NULL;
+	if(SlabRestore(&win->slab, p + capacity * sizeof(uint32_t), h.top, h.free, h.entries) < 0)
+	{
+		free(index);
+		SlabBudgetRelease(win->slab.budget, capacity * sizeof(uint32_t));
+		return NULL;
+	}
+
+	WindowFreeIndex(win);
+	win->index = index;
+	win->bits = h.bits;
+	win->used = h.used;
+	p = LoadArray(win->index, p, capacity * sizeof(uint32_t));
+	p += (size_t) h.top * win->slab.size;
+
+	win->active_size = h.active_count > 1024 ? h.active_count : 1024;
+	free(win->active);
+	win->active = malloc(win->active_size * sizeof(struct IpAddr));
+	if(!win->active)
+	{
+		fprintf(stderr, "malloc() for active clients failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	win->active_count = h.active_count;
+	p = LoadArray(win->active, p, (size_t) h.active_count * sizeof(struct IpAddr));
+
+	win->hand = 0;
+	return p;
+}
+
+void WindowCatchUp(struct Window *win, time_t time)
+{
+	uint32_t n;
+
+	/* The clients with nothing left are removed later by WindowSettle() */
+	for(n = 0; n < win->slab.top; n ++)
+		if(!IpAddrIsEmpty(WindowAddress(win, n)))
+			WindowAdvance(win, n, time);
+}
@@ -0,0 +1,166 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_WINDOW_H
+#define _LIMITTRAF_WINDOW_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "ipaddr.h"
+#include "slab.h"
+
+/*
+	Window: traffic of each client in the last PLAN intervals, kept up to date
+	as the packets arrive, so that AnalyzeDb() doesn't have to query anything.
+
+	Each client has rings of buckets in several tiers (10 seconds, 1 minute,
+	10 minutes, 1 hour) and a sum for each interval: bytes are only added to the bucket
+	when they arrive, and WindowAdvance() recalculates all sums of the client
+	in one pass over its buckets. Every interval uses the coarsest tier which still has
+	WINDOW_MIN_BUCKETS buckets in it, so a day is 24 hourly buckets, not 8640 10-second ones,
+	and the start of the interval moves in steps of its tier (the end is always TIME).
+	Only the tiers used by some interval are kept, each as long as its longest interval.
+
+	The same table holds the subnets of the "PER /prefix" rules: their keys are the network
+	addresses (see IpAddrSubnet()), one Window per prefix length, with only the intervals of its rules.
+
+	Clients are entries of a slab (see slab.h): all windows together stay within a hard
+	budget (ltWindowMemory), and once the number of clients stops growing, no memory is allocated.
+	A CLOCK hand goes around the entries: clients idle for longer than the longest interval
+	are removed as it passes (see WindowSettle()), and when the budget is reached, a new client
+	takes the entry of one which is below the levels and had no traffic since the hand passed it
+	(see WindowEvict()). If there's no such client, the new one is not counted ('rejected').
+*/
+#define WINDOW_BUCKET 10 /* seconds: width of the finest tier (same as the records of the archive) */
+#define WINDOW_TIERS 4
+#define WINDOW_MIN_BUCKETS 12 /* i.e. the start of an interval is within 1/12 of its length */
+
+static const unsigned int WINDOW_TIER_SECONDS[WINDOW_TIERS] = { 10, 60, 600, 3600 };
+
+/* Client 'i' of the window is entry 'i' of its slab: one cache-line-aligned block */
+struct WindowEntry
+{
+	struct IpAddr ip; /* :: = free entry */
+	int64_t current; /* number (time / WINDOW_BUCKET) of the newest bucket of the client */
+	uint8_t listed; /* the client is in active[] */
+	uint8_t referenced; /* received traffic since the CLOCK hand passed it */
+	uint8_t reserved[2];
+	uint32_t slack; /* bytes which may still arrive before the client can reach a level, 0 = unknown (see CheckLevels() in database.c) */
+	uint64_t data[]; /* data[k]: bytes in the last width[k] buckets of tier[k] (see WindowSum()), then the buckets: data[offset[t] + (number in tier t % length[t])] */
+};
+
+struct Window
+{
+	struct Slab slab; /* of struct WindowEntry */
+	uint32_t *index; /* open addressing with linear probing: numbers of the entries, SLAB_NONE = empty slot */
+	unsigned int bits; /* capacity of 'index' = 1 << bits */
+	unsigned int used;
+	uint32_t hand; /* CLOCK: next entry to be checked */
+	uint64_t evicted, rejected; /* clients, since InitializeWindow() */
+
+	/*
+		Clients which AnalyzeDb() must look at: those which received traffic
+		since the last WindowSettle() and those which were kept by it
+		(e.g. because they are over some level). Sums of other clients can only fall.
+		Addresses, not indices: an entry can be evicted and reused by another client.
+	*/
+	struct IpAddr *active;
+	unsigned int active_count, active_size;
+
+	int prefix; /* PLAN.intervals[].prefix of the intervals of this window, 0 = clients */
+	unsigned int intervals;
+	unsigned int *plan; /* plan[k]: index of interval 'k' in PLAN.intervals */
+	unsigned int *tier; /* tier[k]: tier used by interval k */
+	unsigned int *width; /* width[k]: seconds of interval k in buckets of tier[k] */
+	unsigned int length[WINDOW_TIERS]; /* buckets of each tier, 0 if the tier is not used */
+	unsigned int offset[WINDOW_TIERS]; /* in WindowEntry.data */
+	unsigned int total; /* sum of length[]: buckets per client */
+	time_t span; /* seconds covered by the longest tier */
+};
+
+/*
+	NOTE: must be called after ReadConfiguration(). Only the PLAN intervals with this 'prefix' are used.
+	The entries and the index count against 'budget', which may be shared by several windows.
+*/
+void InitializeWindow(struct Window *win, int prefix, struct SlabBudget *budget);
+void TerminateWindow(struct Window *win);
+
+/*
+	Account 'bytes' sent to 'ip' at 'time'.
+	Older traffic (e.g. loaded from the archive) is accepted too, as long as it's still in some interval.
+	It's lost if the client is new and there's no room for it (see 'rejected').
+	Returns the number of the client's entry, -1 if it was lost.
+*/
+int WindowAdd(struct Window *win, const struct IpAddr *ip, time_t time, uint64_t bytes);
+
+/*
+	Move the window of client 'i' forward to 'time' and recalculate the sums of all its intervals.
+	Each tier is moved separately: its buckets only change every WINDOW_TIER_SECONDS[t].
+	The cost depends on the number of buckets, not on the number of intervals.
+	Returns 0 if the client has no traffic in any of the intervals anymore.
+*/
+int WindowAdvance(struct Window *win, unsigned int i, time_t time);
+
+/* Forget the client (e.g. when WindowAdvance() has returned 0) */
+void WindowRemove(struct Window *win, const struct IpAddr *ip);
+
+/* Index of the client 'ip', -1 if it isn't in the table */
+int WindowLookup(struct Window *win, const struct IpAddr *ip);
+
+/*
+	End of the AnalyzeDb() cycle: only the clients of active[] for which 'keep' returns 1
+	stay there. Then the CLOCK hand checks a part of the entries for clients which have no traffic
+	left in any interval (they are removed), so that it goes around all of them every WINDOW_SWEEP_CYCLES calls.
+*/
+#define WINDOW_SWEEP_CYCLES 64
+void WindowSettle(struct Window *win, time_t time, int (*keep)(struct Window *win, unsigned int i));
+
+/*
+	Snapshot of the table (see SaveSnapshot() in database.c): the index and the entries as they are in memory.
+	WindowGeometry() identifies the tiers and the intervals: a snapshot made
+	with another limittraf.conf can't be loaded.
+*/
+uint64_t WindowGeometry(const struct Window *win);
+int WindowSave(const struct Window *win, FILE *f); /* 0 on success, -1 on a write error */
+
+/*
+	Replace the clients of 'win' (after InitializeWindow()) by the snapshot at 'p'.
+	Returns the end of the snapshot, or NULL if it's not a snapshot of this geometry,
+	doesn't fit into 'size' bytes or into the budget ('win' is not changed then).
+*/
+const uint8_t *WindowLoad(struct Window *win, const uint8_t *p, size_t size);
+
+/* Move all clients forward to 'time' (e.g. after WindowLoad()) */
+void WindowCatchUp(struct Window *win, time_t time);
+
+static inline struct WindowEntry *WindowEntryOf(const struct Window *win, unsigned int i)
+{
+	return SlabEntry(&win->slab, i);
+}
+
+/* Bytes sent to client 'i' in PLAN.intervals[win->plan[k]] (as of the last WindowAdvance()) */
+static inline uint64_t WindowSum(const struct Window *win, unsigned int i, unsigned int k)
+{
+	return WindowEntryOf(win, i)->data[k];
+}
+
+static inline const struct IpAddr *WindowAddress(const struct Window *win, unsigned int i)
+{
+	return &WindowEntryOf(win, i)->ip;
+}
+
+#endif
@@ -0,0 +1,171 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <time.h>
+#include <pthread.h>
+
+#include "writer.h"
+
+struct WriterJob
+{
+	void (*run)(void *data, size_t size);
+	void *data;
+	size_t size;
+	double queued; /* monotonic time */
+	struct WriterJob *next;
+};
+
+/* All fields below are protected by 'lock' */
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t wakeup = PTHREAD_COND_INITIALIZER; /* a job was queued or the writer must stop */
+static pthread_cond_t done = PTHREAD_COND_INITIALIZER; /* a job was done */
+static struct WriterJob *head = NULL, *tail = NULL; /* the head is the running job (if 'running') */
+static unsigned int jobs = 0;
+static uint64_t bytes = 0;
+static double busy = 0;
+static int running = 0, stopping = 0;
+static pthread_t thread;
+
+static inline double monotonic_seconds()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec * 1e-9;
+}
+
+static void *WriterThread(void *arg)
+{
+	struct WriterJob *job;
+	double started;
+	(void) arg;
+
+	pthread_mutex_lock(&lock);
+	while(1)
+	{
+		while(!head && !stopping)
+			pthread_cond_wait(&wakeup, &lock);
+		if(!head)
+			break; /* stopping, and nothing is left */
+
+		/* The job stays in the list while it runs, so that it's counted in the lag */
+		job = head;
+		pthread_mutex_unlock(&lock);
+
+		started = monotonic_seconds();
+		job->run(job->data, job->size);
+		free(job->data);
+
+		pthread_mutex_lock(&lock);
+		busy += monotonic_seconds() - started;
+		head = job->next;
+		if(!head)
+			tail = NULL;
+		jobs --;
+		bytes -= job->size;
+		free(job);
+		pthread_cond_broadcast(&done);
+	}
+	pthread_mutex_unlock(&lock);
+	return NULL;
+}
+
+__attribute__((cold)) void InitializeWriter()
+{
+	int ret;
+
+	stopping = 0;
+	ret = pthread_create(&thread, NULL, WriterThread, NULL);
+	if(ret != 0)
+	{
+		fprintf(stderr, "pthread_create() for the writer thread failed: %s\n", strerror(ret));
+		exit(1);
+	}
+	running = 1;
+}
+
+__attribute__((cold)) void TerminateWriter()
+{
+	if(!running)
+		return;
+
+	pthread_mutex_lock(&lock);
+	stopping = 1;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+
+	pthread_join(thread, NULL);
+	running = 0;
+}
+
+void WriterQueue(void (*run)(void *data, size_t size), void *data, size_t size)
+{
+	struct WriterJob *job;
+
+	if(!running)
+	{
+		run(data, size);
+		free(data);
+		return;
+	}
+
+	job = malloc(sizeof(struct WriterJob));
+	if(!job)
+	{
+		fprintf(stderr, "malloc() for a writer job failed: %s\n", strerror(errno));
+		exit(1);
+	}
+	job->run = run;
+	job->data = data;
+	job->size = size;
+	job->queued = monotonic_seconds();
+	job->next = NULL;
+
+	pthread_mutex_lock(&lock);
+	while(head && bytes + size > WRITER_MAX_QUEUED)
+		pthread_cond_wait(&done, &lock);
+
+	if(tail)
+		tail->next = job;
+	else
+		head = job;
+	tail = job;
+	jobs ++;
+	bytes += size;
+	pthread_cond_signal(&wakeup);
+	pthread_mutex_unlock(&lock);
+}
+
+void WriterWait()
+{
+	pthread_mutex_lock(&lock);
+	while(head)
+		pthread_cond_wait(&done, &lock);
+	pthread_mutex_unlock(&lock);
+}
+
+void WriterStatistics(struct WriterStats *stats)
+{
+	pthread_mutex_lock(&lock);
+	stats->jobs = jobs;
+	stats->bytes = bytes;
+	stats->lag = head ? monotonic_seconds() - head->queued : 0;
+	stats->busy = busy;
+	busy = 0;
+	pthread_mutex_unlock(&lock);
+}
@@ -0,0 +1,52 @@
+/*
+	limittraf - per-client outgoing traffic limiter.
+	Copyright (C) 2013-2015 Edward Chernenko.
+
+	This program is free software; you can redistribute it and/or modify
+	it under the terms of the GNU General Public License as published by
+	the Free Software Foundation; either version 3 of the License, or
+	(at your option) any later version.
+
+	This program is distributed in the hope that it will be useful,
+	but WITHOUT ANY WARRANTY; without even the implied warranty of
+	MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+	GNU General Public License for more details.
+*/
+
+#ifndef _LIMITTRAF_WRITER_H
+#define _LIMITTRAF_WRITER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+	Writer: background thread which does the disc writes (blocks of the archive,
+	snapshots, deletion of old hours), so that CompactDb() and SaveSnapshot()
+	only hand over a buffer and the main loop keeps accounting packets.
+	Jobs are done one by one, in the order they were queued.
+*/
+void InitializeWriter();
+void TerminateWriter(); /* does the remaining jobs first */
+
+/*
+	Queue 'run(data, size)'; 'data' (from malloc()) belongs to the writer from now on
+	and is freed after the job. If the writer isn't running, the job is done right away.
+	Only blocks if WRITER_MAX_QUEUED bytes are already waiting (the disc can't keep up at all).
+*/
+#define WRITER_MAX_QUEUED (256 << 20)
+void WriterQueue(void (*run)(void *data, size_t size), void *data, size_t size);
+
+/* Wait until all queued jobs are done (e.g. before the files are read) */
+void WriterWait();
+
+/* Writer lag, see Analyze() */
+struct WriterStats
+{
+	unsigned int jobs; /* queued or running */
+	uint64_t bytes; /* of these jobs */
+	double lag; /* seconds since the oldest of them was queued, 0 if none */
+	double busy; /* seconds spent in jobs since the last WriterStatistics() */
+};
+void WriterStatistics(struct WriterStats *stats);
+
+#endif